@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2019-2022 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * On-disk cache of IRRD replies.
+ *
+ * Every reply lives in its own file, named after the hash of the key
+ * (server, sources in effect and query text).  The file starts with
+ * a short header:
+ *
+ *	bgpq4-cache 1
+ *	<key>
+ *	<expiry time> <status>
+ *
+ * followed by the space separated reply tokens.  Status is A (data
+ * follows), C (no data) or D (key not found).  Files are written to
+ * a temporary name and renamed into place, so concurrent runs sharing
+ * the same directory never see partial entries.
+ *
+ * What the server supports is kept the same way, under the key
+ * "<server>:<port> capabilities" with status A and two tokens: 1 or 0
+ * for the A query, and the sources it has.
+ *
+ * The member sets of as-sets walked one by one (EXCEPT, -L) are kept
+ * under the key "<server>:<port> <sources> graph <set>", with status A
+ * and the graph lifetime (-y).
+ *
+ * Sources and the names in a query are folded to upper case in keys.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+#define CACHE_MAGIC	"bgpq4-cache 1"
+
+extern int debug_expander;
+
+static uint64_t
+bgpq_cache_hash(const char *key)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+
+	for (; *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static void
+bgpq_cache_path(struct bgpq_expander *b, const char *key, char *path,
+    size_t size)
+{
+	snprintf(path, size, "%s/%016" PRIx64, b->cachedir,
+	    bgpq_cache_hash(key));
+}
+
+void
+bgpq_cache_init(struct bgpq_expander *b)
+{
+	struct stat	st;
+
+	if (mkdir(b->cachedir, 0755) == -1 && errno != EEXIST)
+		sx_report(SX_FATAL, "Unable to create cache directory %s: %s\n",
+		    b->cachedir, strerror(errno));
+
+	if (stat(b->cachedir, &st) == -1 || !S_ISDIR(st.st_mode))
+		sx_report(SX_FATAL, "Cache directory %s is not a directory\n",
+		    b->cachedir);
+
+	if (access(b->cachedir, R_OK | W_OK | X_OK) == -1)
+		sx_report(SX_FATAL, "Cache directory %s is not writable: %s\n",
+		    b->cachedir, strerror(errno));
+}
+
+/*
+ * Only replies that describe IRR objects are worth caching, !s and
+ * friends change the session state and must always hit the server.
+ */
+int
+bgpq_cache_query(const char *query)
+{
+	return !strncmp(query, "!i", 2) || !strncmp(query, "!gas", 4) ||
+	    !strncmp(query, "!6as", 4) || !strncmp(query, "!a", 2);
+}
+
+char *
+bgpq_cache_key(struct bgpq_expander *b, const char *sources,
+    const char *query)
+{
+	char	*key, *p, *end;
+	size_t	 len;
+
+	len = strlen(b->server) + strlen(b->port) + strlen(sources) +
+	    strlen(query) + 4;
+
+	if ((key = malloc(len)) == NULL)
+		err(1, NULL);
+
+	/* query carries the trailing newline, strip it */
+	snprintf(key, len, "%s:%s %s %.*s", b->server, b->port, sources,
+	    (int)strcspn(query, "\n"), query);
+
+	/*
+	 * Source and object names are not case sensitive: fold them, so
+	 * every spelling of a query shares one entry.  The command itself
+	 * ("!i", "graph") is left alone.
+	 */
+	p = key + strlen(b->server) + strlen(b->port) + 2;
+	for (end = p + strlen(sources); p < end; p++)
+		*p = toupper((unsigned char)*p);
+	p++;
+	p += *p == '!' ? 2 : strcspn(p, " ");
+	for (; *p != '\0'; p++)
+		*p = toupper((unsigned char)*p);
+
+	return key;
+}
+
+/*
+ * Read the entry for key, if there is one that did not expire yet.
+ * Returns its tokens, with the status and their length.
+ */
+static char *
+bgpq_cache_read(struct bgpq_expander *b, const char *key, char *status,
+    size_t *len)
+{
+	char		 path[PATH_MAX];
+	char		*buf, *p, *eol;
+	struct stat	 st;
+	ssize_t		 ret;
+	size_t		 off = 0;
+	long long	 expires;
+	int		 fd;
+
+	bgpq_cache_path(b, key, path, sizeof(path));
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	if ((buf = malloc(st.st_size + 1)) == NULL)
+		err(1, NULL);
+
+	while (off < (size_t)st.st_size) {
+		ret = read(fd, buf + off, st.st_size - off);
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+	close(fd);
+	buf[off] = '\0';
+
+	p = buf;
+	if ((eol = strchr(p, '\n')) == NULL)
+		goto miss;
+	*eol = '\0';
+	if (strcmp(p, CACHE_MAGIC) != 0)
+		goto miss;
+
+	p = eol + 1;
+	if ((eol = strchr(p, '\n')) == NULL)
+		goto miss;
+	*eol = '\0';
+	if (strcmp(p, key) != 0) {
+		SX_DEBUG(debug_expander, "cache: collision for %s\n", key);
+		goto miss;
+	}
+
+	p = eol + 1;
+	if ((eol = strchr(p, '\n')) == NULL)
+		goto miss;
+	if (sscanf(p, "%lld %c", &expires, status) != 2)
+		goto miss;
+	if (expires < (long long)time(NULL)) {
+		SX_DEBUG(debug_expander > 2, "cache: %s expired\n", key);
+		goto miss;
+	}
+	if (*status != 'A' && *status != 'C' && *status != 'D')
+		goto miss;
+
+	p = eol + 1;
+	*len = off - (p - buf);
+	memmove(buf, p, *len + 1);
+
+	SX_DEBUG(debug_expander, "cache: hit for %s (%c, %zu bytes)\n",
+	    key, *status, *len);
+
+	return buf;
+
+miss:
+	free(buf);
+	return NULL;
+}
+
+int
+bgpq_cache_lookup(struct bgpq_expander *b, struct request *req)
+{
+	req->cached = bgpq_cache_read(b, req->cachekey, &req->cachedstatus,
+	    &req->cachedlen);
+
+	return req->cached != NULL;
+}
+
+/*
+ * Start writing the entry for key, expiring in ttl seconds, under
+ * a temporary name, which is returned in tmpname.
+ */
+static FILE *
+bgpq_cache_create(struct bgpq_expander *b, const char *key, char status,
+    time_t ttl, char **tmpname)
+{
+	char	 tmp[PATH_MAX];
+	FILE	*f;
+	int	 fd;
+
+	snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXXXXXX", b->cachedir);
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		sx_report(SX_ERROR, "cache: unable to create %s: %s\n", tmp,
+		    strerror(errno));
+		return NULL;
+	}
+
+	if ((f = fdopen(fd, "w")) == NULL) {
+		sx_report(SX_ERROR, "cache: fdopen failed: %s\n",
+		    strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return NULL;
+	}
+
+	if ((*tmpname = strdup(tmp)) == NULL)
+		err(1, NULL);
+
+	fprintf(f, CACHE_MAGIC "\n%s\n%lld %c\n", key,
+	    (long long)(time(NULL) + ttl), status);
+
+	return f;
+}
+
+/*
+ * Close the entry for key and move it into place.
+ */
+static void
+bgpq_cache_rename(struct bgpq_expander *b, const char *key, FILE *f,
+    const char *tmp)
+{
+	char	path[PATH_MAX];
+	int	failed;
+
+	failed = ferror(f);
+	if (fclose(f) != 0)
+		failed = 1;
+
+	bgpq_cache_path(b, key, path, sizeof(path));
+
+	if (failed || rename(tmp, path) == -1) {
+		sx_report(SX_ERROR, "cache: unable to store %s: %s\n", path,
+		    strerror(errno));
+		unlink(tmp);
+	}
+}
+
+void
+bgpq_cache_begin(struct bgpq_expander *b, struct request *req, char status)
+{
+	req->cachef = bgpq_cache_create(b, req->cachekey, status,
+	    status == 'D' ? b->cachenegttl : b->cachettl, &req->cachetmp);
+}
+
+void
+bgpq_cache_token(struct request *req, const char *token)
+{
+	fputs(token, req->cachef);
+	fputc(' ', req->cachef);
+}
+
+void
+bgpq_cache_commit(struct bgpq_expander *b, struct request *req)
+{
+	bgpq_cache_rename(b, req->cachekey, req->cachef, req->cachetmp);
+	req->cachef = NULL;
+
+	free(req->cachetmp);
+	req->cachetmp = NULL;
+}
+
+void
+bgpq_cache_abort(struct request *req)
+{
+	if (req->cachef == NULL)
+		return;
+
+	fclose(req->cachef);
+	req->cachef = NULL;
+
+	unlink(req->cachetmp);
+	free(req->cachetmp);
+	req->cachetmp = NULL;
+}
+
+static char *
+bgpq_cache_caps_key(struct bgpq_expander *b)
+{
+	char	*key;
+	size_t	 len;
+
+	len = strlen(b->server) + strlen(b->port) + sizeof(" capabilities") + 1;
+
+	if ((key = malloc(len)) == NULL)
+		err(1, NULL);
+
+	snprintf(key, len, "%s:%s capabilities", b->server, b->port);
+
+	return key;
+}
+
+/*
+ * What the server of b supports, as found out by an earlier run.
+ */
+int
+bgpq_cache_caps_lookup(struct bgpq_expander *b, int *aquery, char **sources)
+{
+	char	*key, *buf, *p, status;
+	size_t	 len;
+
+	key = bgpq_cache_caps_key(b);
+	buf = bgpq_cache_read(b, key, &status, &len);
+	free(key);
+
+	if (buf == NULL)
+		return 0;
+
+	p = buf;
+	*aquery = strtol(p, &p, 10);
+	p += strspn(p, " ");
+	len = strcspn(p, " ");
+
+	if (status != 'A' || len == 0) {
+		free(buf);
+		return 0;
+	}
+
+	if ((*sources = strndup(p, len)) == NULL)
+		err(1, NULL);
+
+	free(buf);
+
+	return 1;
+}
+
+void
+bgpq_cache_caps_store(struct bgpq_expander *b, int aquery,
+    const char *sources)
+{
+	char	*key, *tmp;
+	FILE	*f;
+
+	key = bgpq_cache_caps_key(b);
+
+	if ((f = bgpq_cache_create(b, key, 'A', b->cachettl, &tmp)) != NULL) {
+		fprintf(f, "%d %s ", aquery, sources);
+		bgpq_cache_rename(b, key, f, tmp);
+		free(tmp);
+	}
+
+	free(key);
+}
+
+/*
+ * Member sets of an as-set, recorded under key by an earlier walk.
+ */
+char *
+bgpq_cache_graph_lookup(struct bgpq_expander *b, const char *key,
+    size_t *len)
+{
+	char	*buf, status;
+
+	if ((buf = bgpq_cache_read(b, key, &status, len)) == NULL)
+		return NULL;
+
+	if (status != 'A') {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+void
+bgpq_cache_graph_store(struct bgpq_expander *b, const char *key,
+    const char *members, size_t len)
+{
+	char	*tmp;
+	FILE	*f;
+
+	if ((f = bgpq_cache_create(b, key, 'A', b->graphttl, &tmp)) != NULL) {
+		fwrite(members, 1, len, f);
+		bgpq_cache_rename(b, key, f, tmp);
+		free(tmp);
+	}
+}
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Daemon mode (-Z): filters are generated on request.
+ *
+ * Clients connect to a Unix socket, send a single line with the options
+ * and objects as they would be given to bgpq4 and read the filter until
+ * the connection is closed.  Requests are expanded over sessions to the
+ * IRRd that are kept open, and share the replies with each other and
+ * with the requests to come, for as long as the cache ttl (-y) allows.
+ * Expanded requests are rendered and sent back by a pool of threads.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+#define DAEMON_REQUEST_MAX	65536	/* longest request line */
+#define DAEMON_EXPIRE		60	/* seconds between expiring replies */
+#define DAEMON_WORKERS_MAX	64
+
+extern int debug_expander;
+
+struct client {
+	TAILQ_ENTRY(client)	 entry;
+	struct daemon		*daemon;
+	int			 fd;
+	char			*buf;
+	size_t			 len, size;
+};
+
+TAILQ_HEAD(clients, client);
+
+struct daemon {
+	struct bgpq_expander	*b;
+	int			 fd;
+	int			 aquery;
+	unsigned int		 nrequests, nrunning;
+	struct clients		 clients;
+	struct bgpq_jobs	 pending, running;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	struct bgpq_jobs	 done;
+#endif
+};
+
+/* where parsing a request goes once it failed */
+static jmp_buf	requestfailed;
+
+static int
+daemon_listen(const char *path)
+{
+	struct sockaddr_un	 sun;
+	struct stat		 st;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		sx_report(SX_FATAL, "Socket path too long: %s\n", path);
+
+	/* left behind by an earlier daemon */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		sx_report(SX_FATAL, "Unable to create socket: %s\n",
+		    strerror(errno));
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		sx_report(SX_FATAL, "Unable to bind %s: %s\n", path,
+		    strerror(errno));
+
+	if (listen(fd, 128) == -1)
+		sx_report(SX_FATAL, "Unable to listen on %s: %s\n", path,
+		    strerror(errno));
+
+	fcntl(fd, F_SETFL, O_NONBLOCK|(fcntl(fd, F_GETFL)));
+
+	return fd;
+}
+
+/*
+ * Render an expanded request and send it to the client.  The filter is
+ * rendered into memory first, the printers are used by one thread at a
+ * time and should not wait for slow clients.
+ */
+static void
+daemon_output(struct bgpq_job *j)
+{
+	char	*buf = NULL;
+	size_t	 len = 0, off = 0;
+	ssize_t	 ret;
+	FILE	*f;
+
+	if ((f = open_memstream(&buf, &len)) == NULL)
+		err(1, NULL);
+
+	/* a filter missing some of the objects is worse than none */
+	if (j->expander.unreachable)
+		fprintf(f, "FATAL ERROR:IRRd could not be reached, no "
+		    "filter generated\n");
+	else
+		bgpq_job_render(j, f);
+
+	if (fclose(f) != 0)
+		err(1, NULL);
+
+	while (off < len) {
+		ret = write(j->client, buf + off, len - off);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1) {
+			SX_DEBUG(debug_expander, "daemon: request %u: %s\n",
+			    j->line, strerror(errno));
+			break;
+		}
+		off += ret;
+	}
+
+	SX_DEBUG(debug_expander, "daemon: request %u: sent %zu bytes\n",
+	    j->line, off);
+
+	close(j->client);
+	free(buf);
+	bgpq_job_free(j);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+daemon_worker(void *arg)
+{
+	struct daemon	*d = arg;
+	struct bgpq_job	*j;
+
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		while ((j = STAILQ_FIRST(&d->done)) == NULL)
+			pthread_cond_wait(&d->cond, &d->lock);
+		STAILQ_REMOVE_HEAD(&d->done, entry);
+		pthread_mutex_unlock(&d->lock);
+
+		daemon_output(j);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * One worker per CPU, each filter is rendered by a single one of them.
+ */
+static void
+daemon_workers(struct daemon *d)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_t	 thread;
+	long		 i, n;
+
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	STAILQ_INIT(&d->done);
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	else if (n > DAEMON_WORKERS_MAX)
+		n = DAEMON_WORKERS_MAX;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&thread, NULL, daemon_worker, d) != 0)
+			sx_report(SX_FATAL, "Unable to start worker: %s\n",
+			    strerror(errno));
+		pthread_detach(thread);
+	}
+
+	SX_DEBUG(debug_expander, "daemon: started %ld workers\n", n);
+#endif
+}
+
+static void
+daemon_done(struct daemon *d, struct bgpq_job *j)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&d->lock);
+	STAILQ_INSERT_TAIL(&d->done, j, entry);
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+#else
+	daemon_output(j);
+#endif
+}
+
+static void
+daemon_close(struct daemon *d, struct client *c)
+{
+	TAILQ_REMOVE(&d->clients, c, entry);
+	sx_event_del(d->b->events, c->fd);
+	close(c->fd);
+	free(c->buf);
+	free(c);
+}
+
+/*
+ * Reports made while parsing a request go to the client, failing the
+ * request if fatal.
+ */
+static void
+daemon_report(sx_report_t t, const char *line, void *arg)
+{
+	struct client	*c = arg;
+
+	/* not worth waiting for, the client is told as far as it listens */
+	if (write(c->fd, line, strlen(line)) == -1)
+		SX_DEBUG(debug_expander, "daemon: %s\n", strerror(errno));
+
+	if (t == SX_FATAL)
+		longjmp(requestfailed, 1);
+}
+
+/*
+ * The request line of client c is complete, queue it for expansion.
+ */
+static void
+daemon_request(struct daemon *d, struct client *c)
+{
+	struct bgpq_job	*j;
+
+	SX_DEBUG(debug_expander, "daemon: request %u: %s\n", d->nrequests + 1,
+	    c->buf);
+
+	/* the job keeps the line */
+	j = bgpq_job_new(c->buf, c->len);
+	c->buf = NULL;
+
+	if (setjmp(requestfailed) != 0) {
+		sx_report_hook(NULL, NULL);
+		bgpq_job_free(j);
+		daemon_close(d, c);
+		return;
+	}
+
+	sx_report_hook(daemon_report, c);
+
+	if (bgpq_job_parse(j, d->b, 0) == 0)
+		sx_report(SX_FATAL, "Empty request\n");
+
+	if (j->snapshotin || j->snapshotout)
+		sx_report(SX_FATAL, "Snapshots (-I, -o) can not be used with "
+		    "the daemon\n");
+
+	sx_report_hook(NULL, NULL);
+
+	j->line = ++d->nrequests;
+	j->client = c->fd;
+
+	sx_event_del(d->b->events, c->fd);
+
+	/* replies are written by the workers */
+	fcntl(j->client, F_SETFL, fcntl(j->client, F_GETFL) & ~O_NONBLOCK);
+
+	TAILQ_REMOVE(&d->clients, c, entry);
+	free(c);
+
+	STAILQ_INSERT_TAIL(&d->pending, j, entry);
+}
+
+static void
+daemon_read(int fd __attribute__((unused)),
+    int events __attribute__((unused)), void *arg)
+{
+	struct client	*c = arg;
+	struct daemon	*d = c->daemon;
+	ssize_t		 ret;
+	char		*nl;
+
+	if (c->len + 1 == c->size) {
+		if (c->size >= DAEMON_REQUEST_MAX) {
+			sx_report_hook(daemon_report, c);
+			sx_report(SX_ERROR, "Request too long\n");
+			sx_report_hook(NULL, NULL);
+			daemon_close(d, c);
+			return;
+		}
+		c->size *= 2;
+		if ((c->buf = realloc(c->buf, c->size)) == NULL)
+			err(1, NULL);
+	}
+
+	ret = read(c->fd, c->buf + c->len, c->size - c->len - 1);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret == -1 || (ret == 0 && c->len == 0)) {
+		daemon_close(d, c);
+		return;
+	}
+
+	if (ret == 0) {
+		/* the request ends with the connection */
+		daemon_request(d, c);
+		return;
+	}
+
+	nl = memchr(c->buf + c->len, '\n', ret);
+	c->len += ret;
+	c->buf[c->len] = '\0';
+
+	if (nl != NULL) {
+		*nl = '\0';
+		c->len = nl - c->buf;
+		daemon_request(d, c);
+	}
+}
+
+static void
+daemon_accept(int lfd, int events __attribute__((unused)), void *arg)
+{
+	struct daemon	*d = arg;
+	struct client	*c;
+	int		 fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			sx_report(SX_ERROR, "Unable to accept: %s\n",
+			    strerror(errno));
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK|(fcntl(fd, F_GETFL)));
+
+	if ((c = calloc(1, sizeof(struct client))) == NULL)
+		err(1, NULL);
+	c->daemon = d;
+	c->fd = fd;
+	c->size = 1024;
+	if ((c->buf = malloc(c->size)) == NULL)
+		err(1, NULL);
+
+	TAILQ_INSERT_TAIL(&d->clients, c, entry);
+	sx_event_set(d->b->events, fd, SX_EVENT_READ, daemon_read, c);
+}
+
+/*
+ * Serve requests on the Unix socket at path, never returns.  b holds the
+ * options given on the command line.
+ */
+void
+bgpq_daemon(struct bgpq_expander *b, const char *path)
+{
+	struct bgpq_replies	 replies = RB_INITIALIZER(&replies);
+	struct daemon		 d;
+	struct bgpq_job		*j, *jnext;
+	time_t			 now, expire;
+	int			 rval = 1, started;
+
+	memset(&d, 0, sizeof(d));
+	d.b = b;
+	TAILQ_INIT(&d.clients);
+	STAILQ_INIT(&d.pending);
+	STAILQ_INIT(&d.running);
+
+	/* clients going away while their filter is sent */
+	signal(SIGPIPE, SIG_IGN);
+
+	d.fd = daemon_listen(path);
+
+	/* what the requests will ask for is unknown */
+	d.aquery = bgpq_expand_open(b, 1);
+	b->replies = &replies;
+
+	sx_event_set(b->events, d.fd, SX_EVENT_READ, daemon_accept, &d);
+
+	daemon_workers(&d);
+
+	SX_DEBUG(debug_expander, "daemon: listening on %s\n", path);
+
+	expire = time(NULL) + DAEMON_EXPIRE;
+
+	for (;;) {
+		started = 0;
+		while (d.nrunning < BGPQ_BATCH_JOBS &&
+		    (j = STAILQ_FIRST(&d.pending)) != NULL) {
+			STAILQ_REMOVE_HEAD(&d.pending, entry);
+			STAILQ_INSERT_TAIL(&d.running, j, entry);
+			d.nrunning++;
+			bgpq_expand_job(b, j, d.aquery);
+			started = 1;
+		}
+
+		bgpq_expand_replay(b);
+
+		for (j = STAILQ_FIRST(&d.running); j != NULL; j = jnext) {
+			jnext = STAILQ_NEXT(j, entry);
+			if (j->expander.piped > 0)
+				continue;
+			STAILQ_REMOVE(&d.running, j, bgpq_job, entry);
+			d.nrunning--;
+			bgpq_expand_job_done(j);
+			daemon_done(&d, j);
+		}
+
+		/* room for the requests still pending */
+		if (started && !STAILQ_EMPTY(&d.pending))
+			continue;
+
+		/* the listening socket and the clients are always watched */
+		rval = 1;
+		bgpq_expand_watch(b, 1, &rval);
+
+		/* the jobs of queries given up are done, do not wait */
+		if (!rval)
+			continue;
+
+		now = time(NULL);
+		sx_event_wait(b->events, expire > now ?
+		    (expire - now) * 1000 : 0);
+
+		if ((now = time(NULL)) >= expire) {
+			bgpq_reply_expire(&replies);
+			expire = now + DAEMON_EXPIRE;
+		}
+	}
+}
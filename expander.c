@@ -28,7 +28,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <ctype.h>
@@ -38,11 +38,13 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "extern.h"
@@ -52,21 +54,21 @@ int debug_expander = 0;
 int pipelining = 1;
 int expand_special_asn = 0;
 
-static inline int
-tentry_cmp(struct sx_tentry *a, struct sx_tentry *b)
-{
-	return strcasecmp(a->text, b->text);
-}
+/* what is known about a set name */
+#define NAME_EXPANDING	0x01
+#define NAME_STOPPED	0x02
 
-RB_GENERATE_STATIC(tentree, sx_tentry, entry, tentry_cmp);
+static unsigned int graph_mark;
 
-int
-asn_cmp(struct asn_entry *a, struct asn_entry *b)
+static inline int
+reply_cmp(struct bgpq_reply *a, struct bgpq_reply *b)
 {
-	return (a->asn < b->asn ? -1 : a->asn > b->asn);
+	return strcmp(a->key, b->key);
 }
 
-RB_GENERATE(asn_tree, asn_entry, entry, asn_cmp);
+RB_GENERATE_STATIC(bgpq_replies, bgpq_reply, entry, reply_cmp);
+
+static void bgpq_expander_query_asn(struct bgpq_expander *b, uint32_t asn);
 
 int
 bgpq_expander_init(struct bgpq_expander *b, int af)
@@ -92,19 +94,26 @@ bgpq_expander_init(struct bgpq_expander *b, int af)
 	b->identify = 1;
 	b->server = "rr.ntt.net";
 	b->port = "43";
+	b->nsessions = 1;
 
-	RB_INIT(&b->asnlist);
+	sx_asnset_init(&b->asnlist);
+	sx_asnset_init(&b->stopasns);
+	sx_names_init(&b->names);
 
-	STAILQ_INIT(&b->wq);
-	STAILQ_INIT(&b->rq);
 	STAILQ_INIT(&b->rsets);
+	STAILQ_INIT(&b->dumps);
+
+	b->window = BGPQ_WINDOW_MAX;
+	b->cachettl = 3600;
+	b->cachenegttl = 300;
+	b->graphttl = 3600;
 	STAILQ_INIT(&b->macroses);
 
 	return 1;
 
 fixups:
 	if (b->tree)
-		sx_radix_tree_freeall(b->tree);
+		sx_radix_tree_free(b->tree);
 
 	b->tree = NULL;
 	free(b);
@@ -148,33 +157,56 @@ bgpq_expander_add_rset(struct bgpq_expander *b, char *rs)
 static int
 bgpq_expander_add_already(struct bgpq_expander *b, char *rs)
 {
-	struct sx_tentry	*le, lkey;
-
-	lkey.text = rs;
+	struct sx_name	*n = sx_names_get(&b->names, rs);
 
-	if (RB_FIND(tentree, &b->already, &lkey))
+	if (n->flags & NAME_EXPANDING)
 		return 0;
 
-	le = sx_tentry_new(rs);
-
-	RB_INSERT(tentree, &b->already, le);
+	n->flags |= NAME_EXPANDING;
 
 	return 1;
 }
 
+/*
+ * Stopped ASNs are kept by number, so they are dropped wherever they
+ * are found.  Stopped sets are not walked.
+ */
 int
 bgpq_expander_add_stop(struct bgpq_expander *b, char *rs)
 {
-	struct sx_tentry	*le, lkey;
+	struct sx_name	*n;
+	unsigned long	 asn;
+	char		*eoa;
+
+	if (!strncasecmp(rs, "AS", 2) && isdigit((unsigned char)rs[2])) {
+		asn = strtoul(rs + 2, &eoa, 10);
+		if (*eoa == '\0' && asn <= UINT32_MAX)
+			return sx_asnset_add(&b->stopasns, asn);
+	}
+
+	n = sx_names_get(&b->names, rs);
+
+	if (n->flags & NAME_STOPPED)
+		return 0;
+
+	n->flags |= NAME_STOPPED;
+	b->nstopped++;
 
-	lkey.text = rs;
+	return 1;
+}
+
+int
+bgpq_expander_add_dump(struct bgpq_expander *b, char *file)
+{
+	struct slentry	*le;
 
-	if (RB_FIND(tentree, &b->stoplist, &lkey))
+	if (!b || !file)
 		return 0;
 
-	le = sx_tentry_new(rs);
+	if ((le = sx_slentry_new(file)) == NULL)
+		err(1, NULL);
 
-	RB_INSERT(tentree, &b->stoplist, le);
+	STAILQ_INSERT_TAIL(&b->dumps, le, entry);
 
 	return 1;
 }
@@ -184,7 +216,6 @@ bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 {
 	char			*eoa;
 	uint32_t	 	 asno = 0;
-	struct asn_entry	*asne;
 
 	if (!b || !as)
 		return 0;
@@ -202,11 +233,23 @@ bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 		return 0;
 	}
 
-	if ((asne = malloc(sizeof(struct asn_entry))) == NULL)
-		err(1, NULL);
+	if (sx_asnset_has(&b->stopasns, asno)) {
+		SX_DEBUG(debug_expander > 2, "%s is in the stoplist, ignore\n",
+		    as);
+		return 1;
+	}
+
+	/* already known */
+	if (!sx_asnset_add(&b->asnlist, asno))
+		return 1;
 
-	asne->asn = asno;
-	RB_INSERT(asn_tree, &b->asnlist, asne);
+	/*
+	 * While expanding, fetch the prefixes of a newly discovered ASN
+	 * right away instead of waiting for the as-sets to be done.
+	 */
+	if (b->sessions != NULL &&
+	    (b->generation >= T_PREFIXLIST || b->validate_asns))
+		bgpq_expander_query_asn(b, asno);
 
 	return 1;
 }
@@ -214,25 +257,31 @@ bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 int
 bgpq_expander_add_prefix(struct bgpq_expander *b, char *prefix)
 {
-	struct sx_prefix *p = sx_prefix_alloc(NULL);
+	struct sx_prefix p;
 
-	if (!sx_prefix_parse(p, 0, prefix)) {
+	if (!sx_prefix_parse(&p, 0, prefix)) {
 		sx_report(SX_ERROR, "Unable to parse prefix %s\n", prefix);
 		return 0;
-	} else if (p->family != b->family) {
+	} else if (p.family != b->family) {
 		SX_DEBUG(debug_expander, "Ignoring prefix %s with wrong "
 		    "address family\n", prefix);
 		return 0;
 	}
-	if (b->maxlen && p->masklen>b->maxlen) {
+	if (b->maxlen && p.masklen > b->maxlen) {
 		SX_DEBUG(debug_expander, "Ignoring prefix %s: masklen %i > max"
-		    " masklen %u\n", prefix, p->masklen, b->maxlen);
+		    " masklen %u\n", prefix, p.masklen, b->maxlen);
 		return 0;
 	}
-	sx_radix_tree_insert(b->tree, p);
 
-        if (p)
-		sx_prefix_free(p);
+	/* collected here, the tree is built in one go by bgpq_expand */
+	if (b->nprefixes == b->prefixessize) {
+		b->prefixessize = b->prefixessize ? b->prefixessize * 2 : 1024;
+		b->prefixes = realloc(b->prefixes,
+		    b->prefixessize * sizeof(struct sx_prefix));
+		if (b->prefixes == NULL)
+			err(1, NULL);
+	}
+	b->prefixes[b->nprefixes++] = p;
 
 	return 1;
 }
@@ -243,154 +292,335 @@ bgpq_expander_add_prefix_range(struct bgpq_expander *b, char *prefix)
 	return sx_prefix_range_parse(b->tree, b->family, b->maxlen, prefix);
 }
 
+/*
+ * The parts of a SOURCE::NAME object.  The name is returned in place,
+ * the source is copied into buf, NULL if there is none.
+ */
 char *
-bgpq_get_asset(char *object) {
-	char *d, *asset;
-
-	d = strstr(object, "::");
-	if (d)
-		d += 2;
-	else
-		d = object;
+bgpq_get_asset(char *object)
+{
+	char	*d;
 
-	if ((asset = calloc(1, 256)) == NULL)
-		err(1, NULL);
+	if ((d = strstr(object, "::")) != NULL)
+		return d + 2;
 
-	memcpy(asset, d, strlen(object) - (d - object));
+	return object;
+}
 
-	return asset;
+char *
+bgpq_get_rset(char *object)
+{
+	return bgpq_get_asset(object);
 }
 
 char *
-bgpq_get_rset(char *object) {
-	char *d, *rset;
+bgpq_get_source(char *object, char *buf, size_t len)
+{
+	char	*d;
 
-	d = strstr(object, "::");
+	if ((d = strstr(object, "::")) == NULL)
+		return NULL;
 
-	if (d)
-		d += 2;
-	else
-		d = object;
+	snprintf(buf, len, "%.*s", (int)(d - object), object);
+
+	return buf;
+}
+
+static int
+bgpq_expanded_macro(char *as, struct bgpq_expander *ex,
+    struct request *req __attribute__((unused)))
+{
+	bgpq_expander_add_as(ex, as);
+
+	return 1;
+}
+
+static struct bgpq_session *
+bgpq_session_next(struct bgpq_expander *b)
+{
+	struct bgpq_session	*s = &b->sessions[b->nextsession];
+
+	b->nextsession = (b->nextsession + 1) % b->nsessions;
+
+	return s;
+}
+
+struct request *
+bgpq_pipeline(struct bgpq_expander *b, struct bgpq_session *s,
+    int (*callback)(char *, struct bgpq_expander *b, struct request *req),
+    void *udata, char *fmt, ...);
+
+static struct bgpq_source *
+bgpq_session_find_source(struct bgpq_session *s, const char *sources)
+{
+	struct bgpq_source	*src;
+
+	STAILQ_FOREACH(src, &s->sources, entry) {
+		if (strcmp(src->name, sources) == 0)
+			return src;
+	}
 
-	if ((rset = calloc(1, 256)) == NULL)
+	if ((src = calloc(1, sizeof(struct bgpq_source))) == NULL)
 		err(1, NULL);
+	if ((src->name = strdup(sources)) == NULL)
+		err(1, NULL);
+	STAILQ_INIT(&src->q);
+	STAILQ_INSERT_TAIL(&s->sources, src, entry);
 
-	memcpy(rset, d, strlen(object) - (d - object));
+	return src;
+}
 
-	return rset;
+/*
+ * The queries following on session s are answered from the given
+ * sources.  The session is switched to them once the queries are sent,
+ * see bgpq_session_plan().
+ */
+static void
+bgpq_session_source(struct bgpq_session *s, const char *sources)
+{
+	if (strcmp(s->source->name, sources) != 0)
+		s->source = bgpq_session_find_source(s, sources);
 }
 
-char *
-bgpq_get_source(char *object) {
-	char 		*d;
-	char 		*source;
-	unsigned int	 slen;
+/*
+ * Sources used to expand as-sets unless SOURCE:: says otherwise.
+ */
+static const char *
+bgpq_set_sources(struct bgpq_expander *b)
+{
+	if (!b->usesource && b->sources && b->sources[0] != 0)
+		return b->sources;
+
+	return b->defaultsources;
+}
+
+static int
+bgpq_expanded_prefix(char *as, struct bgpq_expander *ex,
+    struct request *req);
+
+static int
+bgpq_expanded_v6prefix(char *prefix, struct bgpq_expander *ex,
+    struct request *req);
+
+static int
+bgpq_expanded_macro_limit(char *as, struct bgpq_expander *b,
+    struct request *req);
+
+static void
+bgpq_reply_append(struct bgpq_reply *r, const char *data, size_t len);
+
+static void
+bgpq_session_reopen(struct bgpq_expander *b, struct bgpq_session *s);
+
+static void
+bgpq_session_connected(int fd, int events, void *arg);
+
+static void
+bgpq_expander_query_asn(struct bgpq_expander *b, uint32_t asn)
+{
+	struct bgpq_session	*s = bgpq_session_next(b);
+
+	/* prefixes are always looked up in the default sources */
+	bgpq_session_source(s, b->defaultsources);
+
+	if (b->family == AF_INET6)
+		bgpq_pipeline(b, s, bgpq_expanded_v6prefix, NULL,
+		    "!6as%" PRIu32 "\n", asn);
+	else
+		bgpq_pipeline(b, s, bgpq_expanded_prefix, NULL,
+		    "!gas%" PRIu32 "\n", asn);
+}
+
+/*
+ * Members of as-sets are either ASNs or other sets.
+ */
+static int
+bgpq_member_is_set(const char *as)
+{
+	return !strncasecmp(as, "AS-", 3) || strchr(as, '-') || strchr(as, ':');
+}
 
-	d = strstr(object, "::");
+/*
+ * Member sets of set, as recorded by an earlier walk of this batch or
+ * daemon, or of an earlier run in the cache directory.
+ */
+static char *
+bgpq_graph_lookup(struct bgpq_expander *b, const char *set)
+{
+	struct bgpq_reply	*r, find;
+	char			 query[256], *members = NULL;
+	size_t			 len;
 
-	if (d) {
-		if ((source = calloc(1, 256)) == NULL)
+	if (b->replies == NULL && b->cachedir == NULL)
+		return NULL;
+
+	snprintf(query, sizeof(query), "graph %s", set);
+	find.key = bgpq_cache_key(b, bgpq_set_sources(b), query);
+
+	if (b->replies != NULL &&
+	    (r = RB_FIND(bgpq_replies, b->replies, &find)) != NULL &&
+	    r->status == 'A' && r->expires > time(NULL)) {
+		if ((members = strndup(r->data ? r->data : "", r->len)) == NULL)
 			err(1, NULL);
+	} else if (b->cachedir != NULL)
+		members = bgpq_cache_graph_lookup(b, find.key, &len);
+
+	free(find.key);
 
-		slen = d - object;
-		memcpy(source, object, slen);
-		return source;
+	return members;
+}
+
+static void
+bgpq_graph_visit(struct sx_name ***queue, size_t *size, size_t *tail,
+    struct sx_name *n)
+{
+	if (*tail == *size) {
+		*size = *size ? *size * 2 : 64;
+		*queue = realloc(*queue, *size * sizeof(struct sx_name *));
+		if (*queue == NULL)
+			err(1, NULL);
 	}
 
-	return NULL;
+	n->mark = graph_mark;
+	(*queue)[(*tail)++] = n;
 }
 
+/*
+ * Whether set, found at depth, may be expanded by the server in one
+ * query instead of walking it.  None of the sets below it may be
+ * stopped or deeper than -L allows, which takes them all to be known
+ * from earlier walks.  Stopped ASNs are dropped from the reply instead.
+ * On success the sets below are marked as expanding, so the walk does
+ * not visit them again.
+ */
 static int
-bgpq_expanded_macro(char *as, struct bgpq_expander *ex,
-    struct request *req)
+bgpq_graph_clean(struct bgpq_expander *b, char *set, unsigned int depth)
 {
-	bgpq_expander_add_as(ex, as);
+	struct sx_name	**queue = NULL, *n;
+	size_t		 size = 0, head = 0, tail = 0, level, i;
+	char		*members, *m, *last;
+	int		 clean = 1;
+
+	/* nothing but ASNs to keep out */
+	if (!b->usesource && !b->maxdepth && !b->nstopped)
+		return 1;
+
+	/* a new mark for the sets seen by this walk */
+	graph_mark++;
+	bgpq_graph_visit(&queue, &size, &tail, sx_names_get(&b->names, set));
+
+	for (; clean && head < tail; depth++) {
+		if (b->maxdepth && depth >= b->maxdepth) {
+			clean = 0;
+			break;
+		}
 
-	return 1;
+		for (level = tail; clean && head < level; head++) {
+			members = bgpq_graph_lookup(b, queue[head]->name);
+			if (members == NULL)
+				clean = 0;
+
+			for (m = members ? strtok_r(members, " ", &last) :
+			    NULL; clean && m; m = strtok_r(NULL, " ", &last)) {
+				if (b->usesource && strstr(m, "::")) {
+					clean = 0;
+					break;
+				}
+				n = sx_names_get(&b->names, m);
+				if (n->flags & NAME_STOPPED)
+					clean = 0;
+				else if (n->mark != graph_mark)
+					bgpq_graph_visit(&queue, &size, &tail,
+					    n);
+			}
+
+			free(members);
+		}
+	}
+
+	for (i = 0; clean && i < tail; i++)
+		queue[i]->flags |= NAME_EXPANDING;
+
+	free(queue);
+
+	SX_DEBUG(debug_expander > 2, "graph: %s %s\n", set, clean ?
+	    "is expanded by the server" : "needs to be walked");
+
+	return clean;
 }
 
-struct request *
-bgpq_pipeline(struct bgpq_expander *b,
-    int (*callback)(char *, struct bgpq_expander *b, struct request *req),
-    void *udata, char *fmt, ...);
+/*
+ * Expand set, found at depth, one level at a time or, where the graph
+ * allows that, by the server in one query.
+ */
+static void
+bgpq_expand_set(struct bgpq_expander *b, struct bgpq_session *s, char *set,
+    unsigned int depth)
+{
+	struct request	*req;
 
-int
-bgpq_expand_irrd(struct bgpq_expander *b,
-    int (*callback)(char*, struct bgpq_expander *b, struct request *req),
-    void *udata, char *fmt, ...);
+	if (strcmp(s->source->name, bgpq_set_sources(b)) == 0 &&
+	    bgpq_graph_clean(b, set, depth)) {
+		bgpq_pipeline(b, s, bgpq_expanded_macro, NULL,
+		    "!i%s,1\n", set);
+		return;
+	}
+
+	req = bgpq_pipeline(b, s, bgpq_expanded_macro_limit, NULL, "!i%s\n",
+	    set);
+	req->depth = depth;
+
+	/* record the member sets for later expansions */
+	if (b->replies != NULL || b->cachedir != NULL) {
+		if ((req->graph = calloc(1, sizeof(struct bgpq_reply))) == NULL)
+			err(1, NULL);
+	}
+}
 
 static int
 bgpq_expanded_macro_limit(char *as, struct bgpq_expander *b,
     struct request *req)
 {
-	char		*source;
-	struct request	*req1;
+	char			 source[256];
+	struct bgpq_session	*s;
 
-	if (!strncasecmp(as, "AS-", 3) || strchr(as, '-') || strchr(as, ':')) {
-		struct sx_tentry tkey = { .text = as };
+	if (req->graph != NULL && bgpq_member_is_set(as)) {
+		bgpq_reply_append(req->graph, as, strlen(as));
+		bgpq_reply_append(req->graph, " ", 1);
+	}
+
+	if (bgpq_member_is_set(as)) {
+		struct sx_name *n = sx_names_find(&b->names, as);
 
-		if (RB_FIND(tentree, &b->already, &tkey)) {
+		if (n != NULL && (n->flags & NAME_EXPANDING)) {
 			SX_DEBUG(debug_expander > 2, "%s is already expanding, "
 			    "ignore\n", as);
 			return 0;
 		}
 
-		if (RB_FIND(tentree, &b->stoplist, &tkey)) {
+		if (n != NULL && (n->flags & NAME_STOPPED)) {
 			SX_DEBUG(debug_expander > 2, "%s is in the stoplist, "
 			    "ignore\n", as);
 			return 0;
 		}
 
-		if (!b->maxdepth ||
-		    (b->cdepth + 1 < b->maxdepth &&
-		    req->depth + 1 < b->maxdepth)) {
+		if (!b->maxdepth || req->depth + 1 < b->maxdepth) {
 			bgpq_expander_add_already(b, as);
-			if (pipelining) {
-				if (b->usesource) {
-					source = bgpq_get_source(as);
-					if (source) {
-						bgpq_pipeline(b, NULL, NULL,
-						    "!s%s\n", source);
-						free(source);
-					} else {
-						bgpq_pipeline(b, NULL, NULL,
-						    "!s%s\n", b->defaultsources);
-					}
-				}
+			s = bgpq_session_next(b);
+			if (b->usesource)
+				bgpq_session_source(s, bgpq_get_source(as,
+				    source, sizeof(source)) ?
+				    source : b->defaultsources);
+			else
+				bgpq_session_source(s, bgpq_set_sources(b));
 
-				req1 = bgpq_pipeline(b, bgpq_expanded_macro_limit,
-				    NULL, "!i%s\n", bgpq_get_asset(as));
-				req1->depth = req->depth + 1;
-			} else {
-				if (b->usesource) {
-					source = bgpq_get_source(as);
-					if (source) {
-						bgpq_expand_irrd(b, NULL, NULL,
-						    "!s%s\n", source);
-						free(source);
-					} else {
-						bgpq_expand_irrd(b, NULL, NULL,
-						    "!s%s\n", b->defaultsources);
-					}
-				}
-				b->cdepth++;
-				bgpq_expand_irrd(b, bgpq_expanded_macro_limit,
-				    NULL, "!i%s\n", bgpq_get_asset(as));
-				b->cdepth--;
-			}
+			bgpq_expand_set(b, s, bgpq_get_asset(as),
+			    req->depth + 1);
 		} else {
 			SX_DEBUG(debug_expander > 2, "ignoring %s at depth %i\n",
-			    as, b->cdepth ? (b->cdepth + 1) : (req->depth + 1));
+			    as, req->depth + 1);
 		}
 	} else if (!strncasecmp(as, "AS", 2)) {
-		struct sx_tentry tkey = { .text = as };
-
-		if (RB_FIND(tentree, &b->stoplist, &tkey)) {
-			SX_DEBUG(debug_expander > 2,
-			    "%s is in the stoplist, ignore\n", as);
-			return 0;
-		}
-
 		if (bgpq_expander_add_as(b, as)) {
 			SX_DEBUG(debug_expander > 2, ".. added asn %s\n", as);
 		} else {
@@ -424,7 +654,7 @@ bgpq_expanded_prefix(char *as, struct bgpq_expander *ex,
 
 static int
 bgpq_expanded_v6prefix(char *prefix, struct bgpq_expander *ex,
-    struct request *req)
+    struct request *req __attribute__((unused)))
 {
 	char *d = strchr(prefix, '^');
 
@@ -436,96 +666,22 @@ bgpq_expanded_v6prefix(char *prefix, struct bgpq_expander *ex,
 	return 1;
 }
 
-static char *
-bgpq_get_irrd_sources(int fd)
-{
-	char			*query, *response, *sources, *start, *end;
-	const unsigned int	 rsize = 256;
-	unsigned int		 slen;
-	int			 ret, qlen;
-
-	query = "!s-lc\n";
-	qlen = strlen(query);
-
-	if ((response = calloc(1, rsize)) == NULL)
-		err(1, NULL);
-	if ((sources = calloc(1, rsize)) == NULL)
-		err(1, NULL);
-
-	SX_DEBUG(debug_expander, "Requesting source list %s", query);
-	if ((ret = write(fd, query, strlen(query))) != qlen) {
-		sx_report(SX_ERROR, "Partial write of query to "
-			"IRRd: %i bytes, %s\n", ret, strerror(errno));
-		close(fd);
-		free(sources);
-		free(response);
-		exit(1);
-	}
-
-	if (0 < read(fd, response, rsize)) {
-		SX_DEBUG(debug_expander, "Got answer %s", response);
-		if (*(response + strlen(response) - 2) != 'C') {
-			sx_report(SX_ERROR, "Invalid response "
-				"'%s': %s\n", response, query);
-			close(fd);
-			free(sources);
-			free(response);
-			exit(1);
-		}
-	} else {
-		sx_report(SX_ERROR, "failed to read sources\n");
-		close(fd);
-		free(sources);
-		free(response);
-		exit(1);
-	}
-
-	start = strchr(response, '\n');
-	if (start) {
-		start += 1;
-		end = strchr(start, '\n');
-		if (!end) {
-			sx_report(SX_ERROR, "No 2nd newline in response '%s': %s\n",
-				response, query);
-			close(fd);
-			free(sources);
-			free(response);
-			exit(1);
-		}
-		slen = end - start;
-		if (slen > rsize)
-			memcpy(sources, start, rsize - 1);
-		else
-			memcpy(sources, start, slen);
-	} else {
-		sx_report(SX_ERROR, "No 1st newline in response '%s': %s\n",
-			response, query);
-		close(fd);
-		free(sources);
-		free(response);
-		exit(1);
-	}
-
-	free(response);
-	return sources;
-}
-
 static struct request *
 request_alloc(char *request, int (*callback)(char *, struct bgpq_expander *,
     struct request *), void *udata)
 {
-	struct request *bp;
+	struct request	*bp;
+	size_t		 len = strlen(request);
 
-	if ((bp = malloc(sizeof(struct request))) == NULL)
+	/* the query text follows the request, in the same allocation */
+	if ((bp = malloc(sizeof(struct request) + len + 1)) == NULL)
 		err(1, NULL);
 
-	if (!bp)
-		return NULL;
-
 	memset(bp, 0, sizeof(struct request));
-	bp->request = strdup(request);
+	bp->request = (char *)(bp + 1);
+	memcpy(bp->request, request, len + 1);
 	bp->offset = 0;
-	bp->size = strlen(bp->request);
+	bp->size = len;
 	bp->callback = callback;
 	bp->udata = udata;
 
@@ -535,76 +691,353 @@ request_alloc(char *request, int (*callback)(char *, struct bgpq_expander *,
 static void
 request_free(struct request *req)
 {
-	if (req->request)
-		free(req->request);
+	bgpq_cache_abort(req);
+	free(req->cachekey);
+	free(req->cached);
+
+	if (req->graph) {
+		free(req->graph->data);
+		free(req->graph);
+	}
 
 	free(req);
 }
 
-struct request *
-bgpq_pipeline(struct bgpq_expander *b,
-    int (*callback)(char *, struct bgpq_expander *, struct request *),
-    void *udata, char *fmt, ...)
+static void
+bgpq_reply_append(struct bgpq_reply *r, const char *data, size_t len)
 {
-	struct request		*bp = NULL;
-	char			 request[256];
-	int			 ret;
-	va_list			 ap;
+	if (r->len + len > r->size) {
+		r->size = r->size ? r->size * 2 : 1024;
+		if (r->size < r->len + len)
+			r->size = r->len + len;
+		if ((r->data = realloc(r->data, r->size)) == NULL)
+			err(1, NULL);
+	}
 
-	va_start(ap, fmt);
-	vsnprintf(request, sizeof(request), fmt, ap);
-	va_end(ap);
+	memcpy(r->data + r->len, data, len);
+	r->len += len;
+}
 
-	SX_DEBUG(debug_expander,"expander: sending %s", request);
+static void
+bgpq_reply_copy(struct bgpq_reply *r, struct request *req)
+{
+	if ((req->cached = malloc(r->len + 1)) == NULL)
+		err(1, NULL);
 
-	bp = request_alloc(request, callback, udata);
+	if (r->len > 0)
+		memcpy(req->cached, r->data, r->len);
+	req->cached[r->len] = '\0';
+	req->cachedlen = r->len;
+	req->cachedstatus = r->status;
+}
 
-	if (!bp) {
-		sx_report(SX_FATAL,"Unable to allocate %lu bytes: %s\n",
-		    (unsigned long)sizeof(struct request),
-		    strerror(errno));
+static void
+bgpq_reply_free(struct bgpq_replies *replies, struct bgpq_reply *r)
+{
+	RB_REMOVE(bgpq_replies, replies, r);
+	free(r->key);
+	free(r->data);
+	free(r);
+}
+
+/*
+ * Look the query up among the replies shared by the jobs of a batch.
+ * A known reply is replayed, a query still underway waits for its
+ * reply.  Otherwise the request is set up to record its reply and 0 is
+ * returned, so it is sent as usual.
+ */
+static int
+bgpq_reply_lookup(struct bgpq_expander *b, struct bgpq_session *s,
+    struct request *req)
+{
+	struct bgpq_reply	*r, find;
+
+	find.key = bgpq_cache_key(b, req->source->name, req->request);
+
+	if ((r = RB_FIND(bgpq_replies, b->replies, &find)) != NULL &&
+	    r->status != 0 && r->expires <= time(NULL)) {
+		bgpq_reply_free(b->replies, r);
+		r = NULL;
 	}
 
-	if (STAILQ_EMPTY(&b->wq)) {
-		ret = write(b->fd, request, bp->size);
-		if (ret < 0) {
-			if (errno == EAGAIN) {
-				STAILQ_INSERT_TAIL(&b->wq, bp, next);
-				return bp;
-			}
-			sx_report(SX_FATAL, "Error writing request: %s\n",
-			    strerror(errno));
+	if (r != NULL) {
+		free(find.key);
+		if (r->status == 0)
+			STAILQ_INSERT_TAIL(&r->waiting, req, next);
+		else {
+			bgpq_reply_copy(r, req);
+			STAILQ_INSERT_TAIL(&s->cq, req, next);
 		}
+		SX_DEBUG(debug_expander > 2, "batch: %s %s", r->status ?
+		    "reusing reply to" : "waiting for reply to", req->request);
+		return 1;
+	}
 
-		bp->offset=ret;
-
-		if (ret == bp->size)
-			STAILQ_INSERT_TAIL(&b->rq, bp, next);
-		else
-			STAILQ_INSERT_TAIL(&b->wq, bp, next);
+	if ((r = calloc(1, sizeof(struct bgpq_reply))) == NULL)
+		err(1, NULL);
+	r->key = find.key;
+	STAILQ_INIT(&r->waiting);
+	RB_INSERT(bgpq_replies, b->replies, r);
 
-	} else
-		STAILQ_INSERT_TAIL(&b->wq, bp, next);
+	req->reply = r;
 
-	return bp;
+	return 0;
 }
 
+/*
+ * The walk of an as-set got its reply from the server, keep the member
+ * sets for bgpq_graph_clean(), with the graph lifetime.
+ */
 static void
-bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
+bgpq_graph_record(struct request *req, char status)
 {
-	char			*eptr;
-	unsigned long		 asn = 0;
-	struct asn_entry	 find, *res;
+	struct bgpq_expander	*b = req->expander;
+	struct bgpq_reply	*r = req->graph, *old;
+	char			 query[256];
 
-	if (!strncmp(q, "!gas", 4) || !strncmp(q, "!6as", 4)) {
+	if (status != 'A' && status != 'C' && status != 'D')
+		return;
 
-		errno = 0;
-		asn = strtoul(q + 4, &eptr, 10);
-		if (*eptr != '\n') {
-			sx_report(SX_ERROR, "not a number: %s\n", q);
-			return;
-		}
-		if (errno == ERANGE && asn == ULONG_MAX) {
+	snprintf(query, sizeof(query), "graph %.*s",
+	    (int)strcspn(req->request + 2, "\n"), req->request + 2);
+
+	r->key = bgpq_cache_key(b, req->source->name, query);
+	r->status = 'A';
+	r->expires = time(NULL) + b->graphttl;
+	STAILQ_INIT(&r->waiting);
+
+	if (b->cachedir)
+		bgpq_cache_graph_store(b, r->key, r->data ? r->data : "",
+		    r->len);
+
+	if (b->replies) {
+		if ((old = RB_FIND(bgpq_replies, b->replies, r)) != NULL)
+			bgpq_reply_free(b->replies, old);
+		RB_INSERT(bgpq_replies, b->replies, r);
+	} else {
+		free(r->key);
+		free(r->data);
+		free(r);
+	}
+
+	req->graph = NULL;
+}
+
+/*
+ * The reply to req is complete, pass it on to the requests waiting
+ * for it.
+ */
+static void
+bgpq_reply_finish(struct bgpq_session *s, struct request *req, char status)
+{
+	struct bgpq_reply	*r = req->reply;
+	struct request		*w;
+
+	/* replayed replies are as old as their cache entry */
+	if (req->graph != NULL && req->cached == NULL)
+		bgpq_graph_record(req, status);
+
+	if (r == NULL)
+		return;
+
+	r->status = status;
+	r->expires = time(NULL) + (status == 'D' || status == 'F' ?
+	    req->expander->cachenegttl : req->expander->cachettl);
+
+	while ((w = STAILQ_FIRST(&r->waiting)) != NULL) {
+		STAILQ_REMOVE_HEAD(&r->waiting, next);
+		bgpq_reply_copy(r, w);
+		STAILQ_INSERT_TAIL(&s->cq, w, next);
+	}
+
+	req->reply = NULL;
+}
+
+/*
+ * Record a reply taken from the dumps or the cache.
+ */
+static void
+bgpq_reply_store(struct bgpq_session *s, struct request *req)
+{
+	if (req->reply == NULL)
+		return;
+
+	if (req->cachedstatus == 'A')
+		bgpq_reply_append(req->reply, req->cached, req->cachedlen);
+
+	bgpq_reply_finish(s, req, req->cachedstatus);
+}
+
+/*
+ * Forget the replies that outlived the cache ttl (-y), nobody waits for
+ * a complete reply.
+ */
+void
+bgpq_reply_expire(struct bgpq_replies *replies)
+{
+	struct bgpq_reply	*r, *next;
+	time_t			 now = time(NULL);
+
+	for (r = RB_MIN(bgpq_replies, replies); r != NULL; r = next) {
+		next = RB_NEXT(bgpq_replies, replies, r);
+		if (r->status != 0 && r->expires <= now)
+			bgpq_reply_free(replies, r);
+	}
+}
+
+void
+bgpq_reply_freeall(struct bgpq_replies *replies)
+{
+	struct bgpq_reply	*r, *next;
+
+	for (r = RB_MIN(bgpq_replies, replies); r != NULL; r = next) {
+		next = RB_NEXT(bgpq_replies, replies, r);
+		bgpq_reply_free(replies, r);
+	}
+}
+
+static double
+bgpq_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * How many more requests may be sent on the session.  Without
+ * pipelining only one request is allowed to be in flight, the next one
+ * is sent once the reply has been consumed.  Otherwise as many as the
+ * window of the session, the rest wait in wq.
+ */
+static int
+bgpq_session_space(struct bgpq_session *s)
+{
+	if (!pipelining)
+		return STAILQ_EMPTY(&s->rq);
+
+	return (int)s->window - (int)s->inflight;
+}
+
+static void
+bgpq_session_sent(struct bgpq_session *s, struct request *req, double now)
+{
+	req->sent = now;
+	STAILQ_INSERT_TAIL(&s->rq, req, next);
+	s->inflight++;
+}
+
+/*
+ * The reply to req starts arriving, adapt the window to its latency.
+ * Replies taking more than twice as long as the fastest one mean our
+ * queries queue up at the server, which halves the window, once per
+ * round trip.  Otherwise it doubles every round trip up to the last
+ * size that was too large, and grows by one per round trip beyond.
+ */
+static void
+bgpq_session_ack(struct bgpq_session *s, struct request *req)
+{
+	double	now = bgpq_now(), rtt = now - req->sent;
+
+	if (s->rttmin == 0 || rtt < s->rttmin)
+		s->rttmin = rtt;
+
+	if (rtt > 2 * s->rttmin + BGPQ_WINDOW_SLACK) {
+		if (req->sent < s->backoff)
+			return;
+		s->ssthresh = s->window / 2;
+		if (s->ssthresh < 1)
+			s->ssthresh = 1;
+		s->window = s->ssthresh;
+		s->backoff = now;
+		SX_DEBUG(debug_expander > 1, "window %.1f after %.1fms "
+		    "(fastest %.1fms)\n", s->window, rtt * 1000,
+		    s->rttmin * 1000);
+		return;
+	}
+
+	if (s->window < s->ssthresh)
+		s->window += 1;
+	else
+		s->window += 1 / s->window;
+
+	if (s->window > s->windowmax)
+		s->window = s->windowmax;
+}
+
+struct request *
+bgpq_pipeline(struct bgpq_expander *b, struct bgpq_session *s,
+    int (*callback)(char *, struct bgpq_expander *, struct request *),
+    void *udata, char *fmt, ...)
+{
+	struct request		*bp = NULL;
+	char			 request[256];
+	va_list			 ap;
+
+	va_start(ap, fmt);
+	vsnprintf(request, sizeof(request), fmt, ap);
+	va_end(ap);
+
+	SX_DEBUG(debug_expander,"expander: sending %s", request);
+
+	bp = request_alloc(request, callback, udata);
+
+	if (!bp) {
+		sx_report(SX_FATAL,"Unable to allocate %lu bytes: %s\n",
+		    (unsigned long)sizeof(struct request),
+		    strerror(errno));
+	}
+
+	bp->expander = b;
+	bp->source = s->source;
+
+	if (b->replies && bgpq_cache_query(request) &&
+	    bgpq_reply_lookup(b, s, bp)) {
+		b->piped++;
+		return bp;
+	}
+
+	b->piped++;
+
+	if (b->rpsl) {
+		/* answered from the dumps, replayed like a cached reply */
+		bgpq_rpsl_query(b->rpsl, bp->source->name, bp);
+		bgpq_reply_store(s, bp);
+		STAILQ_INSERT_TAIL(&s->cq, bp, next);
+		return bp;
+	} else if (b->cachedir && bgpq_cache_query(request)) {
+		bp->cachekey = bgpq_cache_key(b, bp->source->name, request);
+		if (bgpq_cache_lookup(b, bp)) {
+			bgpq_reply_store(s, bp);
+			STAILQ_INSERT_TAIL(&s->cq, bp, next);
+			return bp;
+		}
+	}
+
+	/* sent along with the others queued until the next wait */
+	STAILQ_INSERT_TAIL(&bp->source->q, bp, next);
+	s->waiting++;
+
+	return bp;
+}
+
+static void
+bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
+{
+	char			*eptr;
+	unsigned long		 asn = 0;
+
+	if (!strncmp(q, "!gas", 4) || !strncmp(q, "!6as", 4)) {
+
+		errno = 0;
+		asn = strtoul(q + 4, &eptr, 10);
+		if (*eptr != '\n') {
+			sx_report(SX_ERROR, "not a number: %s\n", q);
+			return;
+		}
+		if (errno == ERANGE && asn == ULONG_MAX) {
 			sx_report(SX_ERROR, "overflow: %s\n", q);
 			return;
 		}
@@ -617,813 +1050,1499 @@ bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
 			return;
 		}
 
-		find.asn = asn;
-		if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) == NULL) {
-			RB_REMOVE(asn_tree, &b->asnlist, res);
-			free(res);
+		sx_asnset_del(&b->asnlist, asn);
+	}
+}
+
+static int
+bgpq_session_writable(struct bgpq_session *s)
+{
+	if (STAILQ_EMPTY(&s->wq) && s->waiting == 0)
+		return 0;
+
+	return bgpq_session_space(s) > 0;
+}
+
+/*
+ * Move queries waiting for their sources to wq, as many as the session
+ * has room for.  Queries for the sources in effect go first, the session
+ * is switched to other sources only once none of them are left, so that
+ * as many queries as possible follow each switch, or before the first
+ * query of a new connection.  Returns 0 if nothing was waiting.
+ */
+static int
+bgpq_session_plan(struct bgpq_session *s)
+{
+	struct bgpq_source	*src = s->wire;
+	struct request		*req, *bp;
+	char			 request[256];
+	int			 space = bgpq_session_space(s);
+
+	if (s->waiting == 0)
+		return 0;
+
+	if (src == NULL || STAILQ_EMPTY(&src->q)) {
+		STAILQ_FOREACH(src, &s->sources, entry) {
+			if (!STAILQ_EMPTY(&src->q))
+				break;
+		}
+
+		snprintf(request, sizeof(request), "!s%s\n", src->name);
+		SX_DEBUG(debug_expander, "expander: sending %s", request);
+
+		/* on behalf of the first query to follow */
+		req = STAILQ_FIRST(&src->q);
+		bp = request_alloc(request, NULL, NULL);
+		bp->expander = req->expander;
+		bp->source = src;
+		bp->expander->piped++;
+
+		STAILQ_INSERT_TAIL(&s->wq, bp, next);
+		s->wire = src;
+		space--;
+	}
+
+	while (space > 0 && (req = STAILQ_FIRST(&src->q)) != NULL) {
+		STAILQ_REMOVE_HEAD(&src->q, next);
+		STAILQ_INSERT_TAIL(&s->wq, req, next);
+		s->waiting--;
+		space--;
+	}
+
+	return 1;
+}
+
+/*
+ * The server went away: close the session and queue the requests sent
+ * and about to be sent again, they go out once it is connected again.
+ * A reply that was arriving starts over, source switches and the
+ * identification are made anew.
+ */
+static void
+bgpq_session_drop(struct bgpq_session *s)
+{
+	struct request	*req;
+
+	if (s->state != R_STATUS && (req = STAILQ_FIRST(&s->rq)) != NULL) {
+		bgpq_cache_abort(req);
+		if (req->reply != NULL)
+			req->reply->len = 0;
+		if (req->graph != NULL)
+			req->graph->len = 0;
+	}
+
+	STAILQ_CONCAT(&s->rq, &s->wq);
+	while ((req = STAILQ_FIRST(&s->rq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&s->rq, next);
+		if (req->callback == NULL) {
+			req->expander->piped--;
+			request_free(req);
+			continue;
 		}
+		req->offset = 0;
+		STAILQ_INSERT_TAIL(&req->source->q, req, next);
+		s->waiting++;
 	}
+
+	sx_event_del(s->ev, s->fd);
+	close(s->fd);
+	s->fd = -1;
+	s->events = 0;
+	s->inflight = 0;
+	s->buflen = s->bufpos = 0;
+	s->state = R_STATUS;
 }
 
+/*
+ * Send as many of the queued requests as the session has room for,
+ * gathered into a single writev() each time.
+ */
 static void
-bgpq_write(struct bgpq_expander *b)
+bgpq_write(struct bgpq_session *s)
 {
-	while(!STAILQ_EMPTY(&b->wq)) {
-		struct request *req = STAILQ_FIRST(&b->wq);
+	struct iovec	 iov[BGPQ_WRITE_IOV];
+	struct request	*req;
+	ssize_t		 ret;
+	double		 now;
+	int		 n, space;
 
-		int ret = write(b->fd, req->request + req->offset,
-		    req->size-req->offset);
+	while ((space = bgpq_session_space(s)) > 0) {
+		if (STAILQ_EMPTY(&s->wq) && !bgpq_session_plan(s))
+			return;
+		n = 0;
+		STAILQ_FOREACH(req, &s->wq, next) {
+			if (n == space || n == BGPQ_WRITE_IOV)
+				break;
+			iov[n].iov_base = req->request + req->offset;
+			iov[n].iov_len = req->size - req->offset;
+			n++;
+		}
+		if (n == 0)
+			return;
 
+		ret = writev(s->fd, iov, n);
 		if (ret < 0) {
-			if (errno == EAGAIN)
+			if (errno == EAGAIN || errno == EINTR)
 				return;
-			sx_report(SX_FATAL, "error writing data: %s\n",
+			sx_report(SX_ERROR, "Error writing data to IRRd: %s\n",
 			    strerror(errno));
+			bgpq_session_drop(s);
+			s->retries++;
+			return;
 		}
 
-		if (ret == req->size - req->offset) {
-			/* this request was dequeued */
-			STAILQ_REMOVE_HEAD(&b->wq, next);
-			STAILQ_INSERT_TAIL(&b->rq, req, next);
-		} else {
-			req->offset += ret;
+		SX_DEBUG(debug_expander > 5, "wrote %zd bytes of %d requests\n",
+		    ret, n);
+
+		now = bgpq_now();
+		while (ret > 0) {
+			req = STAILQ_FIRST(&s->wq);
+			if (ret < req->size - req->offset) {
+				/* the socket is full */
+				req->offset += ret;
+				return;
+			}
+			ret -= req->size - req->offset;
+			STAILQ_REMOVE_HEAD(&s->wq, next);
+			bgpq_session_sent(s, req, now);
+		}
+	}
+}
+
+static void
+bgpq_request_done(struct bgpq_session *s)
+{
+	struct request	*req = STAILQ_FIRST(&s->rq);
+
+	STAILQ_REMOVE_HEAD(&s->rq, next);
+	s->inflight--;
+	/* source switches are sent again on every reconnect */
+	if (req->callback != NULL)
+		s->retries = 0;
+	req->expander->piped--;
+
+	request_free(req);
+}
+
+static int
+bgpq_reply_token(struct request *req, char *token)
+{
+	if (req->cachef)
+		bgpq_cache_token(req, token);
+
+	if (req->reply) {
+		bgpq_reply_append(req->reply, token, strlen(token));
+		bgpq_reply_append(req->reply, " ", 1);
+	}
+
+	if (req->callback)
+		return req->callback(token, req->expander, req);
+
+	return 1;
+}
+
+static int
+bgpq_reply_nodata(struct bgpq_expander *b, struct request *req, char code)
+{
+	if (code == 'C') {
+		/* No data */
+		SX_DEBUG(debug_expander,"No data expanding %s", req->request);
+		if (b->validate_asns)
+			bgpq_expander_invalidate_asn(b, req->request);
+		return 1;
+	}
+
+	sx_report(SX_ERROR, "Key not found expanding %s", req->request);
+	if (b->validate_asns)
+		bgpq_expander_invalidate_asn(b, req->request);
+
+	return 0;
+}
+
+/*
+ * Replay a reply found in the cache as if it came from the server.
+ */
+static int
+bgpq_cached_reply(struct request *req)
+{
+	char	*c, *e, *end;
+	int	 rval = 1;
+
+	if (req->cachedstatus == 'F') {
+		/* failed for an earlier job of the batch */
+		sx_report(SX_ERROR, "Error expanding %s: %s", req->request,
+		    req->cached);
+		return 0;
+	}
+
+	if (req->cachedstatus != 'A')
+		return bgpq_reply_nodata(req->expander, req,
+		    req->cachedstatus);
+
+	end = req->cached + req->cachedlen;
+
+	for (c = e = req->cached; e < end; e++) {
+		if (*e != ' ' && *e != '\n')
+			continue;
+		*e = '\0';
+		if (e > c && !bgpq_reply_token(req, c))
+			rval = 0;
+		c = e + 1;
+	}
+	/* buffer is NUL-terminated past the last token */
+	if (c < end && !bgpq_reply_token(req, c))
+		rval = 0;
+
+	return rval;
+}
+
+/*
+ * Consume as much of the buffered input as possible.  Data of A-replies
+ * is tokenized in place and every token is passed to the callback as
+ * soon as its delimiter has arrived, so replies are never buffered as
+ * a whole.
+ */
+static int
+bgpq_session_parse(struct bgpq_session *s)
+{
+	struct request	*req;
+	char		*c, *e, *end, *eol, *eon, save;
+	int		 rval = 1;
+
+	while ((req = STAILQ_FIRST(&s->rq)) != NULL) {
+		c = s->buf + s->bufpos;
+		end = s->buf + s->buflen;
+
+		switch (s->state) {
+		case R_STATUS:
+			if ((eol = memchr(c, '\n', end - c)) == NULL)
+				return rval;
+
+			s->bufpos = eol + 1 - s->buf;
+			bgpq_session_ack(s, req);
+
+			if (c[0] == 'A') {
+				s->remain = strtoul(c + 1, &eon, 10);
+				if (eon != eol) {
+					sx_report(SX_ERROR,"A-code finished with "
+					    "wrong char '%c'(%.*s)\n", *eon,
+					    (int)(eol - c), c);
+					/* no telling where the reply ends */
+					bgpq_session_drop(s);
+					s->retries++;
+					return 0;
+				}
+				SX_DEBUG(debug_expander > 2, "expecting %lu bytes"
+				    " in response to %s", s->remain,
+				    req->request);
+				if (req->cachekey)
+					bgpq_cache_begin(req->expander, req, 'A');
+				s->state = s->remain ? R_DATA : R_FINAL;
+				continue;
+			} else if (c[0] == 'C' || c[0] == 'D') {
+				if (req->cachekey) {
+					bgpq_cache_begin(req->expander, req,
+					    c[0]);
+					if (req->cachef)
+						bgpq_cache_commit(req->expander,
+						    req);
+				}
+				bgpq_reply_finish(s, req, c[0]);
+				if (!bgpq_reply_nodata(req->expander, req, c[0]))
+					rval = 0;
+			} else if (c[0] == 'E') {
+				sx_report(SX_ERROR, "Multiple keys expanding "
+				    "%s: %.*s", req->request,
+				    (int)(eol + 1 - c), c);
+				if (req->reply) {
+					bgpq_reply_append(req->reply, c,
+					    eol + 1 - c);
+					bgpq_reply_finish(s, req, 'F');
+				}
+				rval = 0;
+			} else if (c[0] == 'F') {
+				sx_report(SX_ERROR, "Error expanding %s: %.*s",
+				    req->request, (int)(eol + 1 - c), c);
+				if (req->reply) {
+					bgpq_reply_append(req->reply, c,
+					    eol + 1 - c);
+					bgpq_reply_finish(s, req, 'F');
+				}
+				rval = 0;
+			} else {
+				sx_report(SX_ERROR,"Wrong reply: %.*s to %s",
+				    (int)(eol + 1 - c), c, req->request);
+				bgpq_session_drop(s);
+				s->retries++;
+				return 0;
+			}
+			bgpq_request_done(s);
+			break;
+		case R_DATA:
+			if ((unsigned long)(end - c) > s->remain)
+				e = c + s->remain;
+			else
+				e = end;
+
+			for (eol = c; eol < e; eol++) {
+				if (*eol != ' ' && *eol != '\n')
+					continue;
+				*eol = '\0';
+				if (eol > c && !bgpq_reply_token(req, c))
+					rval = 0;
+				c = eol + 1;
+			}
+
+			s->remain -= c - (s->buf + s->bufpos);
+			s->bufpos = c - s->buf;
+
+			if (s->remain == 0) {
+				s->state = R_FINAL;
+				break;
+			}
+
+			/*
+			 * The last token is not followed by a delimiter,
+			 * terminate it temporarily in the first byte of the
+			 * final status line.
+			 */
+			if ((unsigned long)(end - c) <= s->remain)
+				return rval;
+
+			save = c[s->remain];
+			c[s->remain] = '\0';
+			if (!bgpq_reply_token(req, c))
+				rval = 0;
+			c[s->remain] = save;
+
+			s->bufpos += s->remain;
+			s->remain = 0;
+			s->state = R_FINAL;
+			break;
+		case R_FINAL:
+			if ((eol = memchr(c, '\n', end - c)) == NULL)
+				return rval;
+
+			SX_DEBUG(debug_expander > 2, "final code %.*s in "
+			    "response to %s", (int)(eol + 1 - c), c,
+			    req->request);
+
+			s->bufpos = eol + 1 - s->buf;
+			s->state = R_STATUS;
+			if (req->cachef)
+				bgpq_cache_commit(req->expander, req);
+			bgpq_reply_finish(s, req, 'A');
+			bgpq_request_done(s);
 			break;
 		}
 	}
+
+	return rval;
 }
 
 static int
-bgpq_selread(struct bgpq_expander *b, char *buffer, int size)
+bgpq_session_read(struct bgpq_session *s)
+{
+	ssize_t	ret;
+
+	if (s->bufpos > 0) {
+		memmove(s->buf, s->buf + s->bufpos, s->buflen - s->bufpos);
+		s->buflen -= s->bufpos;
+		s->bufpos = 0;
+	}
+
+	if (s->buflen == s->bufsize) {
+		/* single token larger than the whole buffer */
+		s->bufsize *= 2;
+		if ((s->buf = realloc(s->buf, s->bufsize)) == NULL)
+			err(1, NULL);
+	}
+
+	ret = read(s->fd, s->buf + s->buflen, s->bufsize - s->buflen);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+	if (ret <= 0) {
+		sx_report(SX_ERROR, "%s from IRRd, sending the queries "
+		    "again\n", ret == 0 ? "EOF" : strerror(errno));
+		bgpq_session_drop(s);
+		s->retries++;
+		return 1;
+	}
+
+	SX_DEBUG(debug_expander > 5, "got %zd bytes: '%.*s'\n", ret,
+	    (int)ret, s->buf + s->buflen);
+
+	s->buflen += ret;
+
+	return bgpq_session_parse(s);
+}
+
+/*
+ * Replay the replies that did not come from the server.  Their callbacks
+ * may queue more of them, on any session.
+ */
+int
+bgpq_expand_replay(struct bgpq_expander *b)
 {
-	fd_set		rfd, wfd;
-	int		ret;
+	struct bgpq_session	*s;
+	struct request		*req;
+	unsigned int		 i;
+	int			 again, rval = 1;
+
+	do {
+		again = 0;
+		for (i = 0; i < b->nsessions; i++) {
+			s = &b->sessions[i];
+			while ((req = STAILQ_FIRST(&s->cq)) != NULL) {
+				STAILQ_REMOVE_HEAD(&s->cq, next);
+				if (!bgpq_cached_reply(req))
+					rval = 0;
+				req->expander->piped--;
+				request_free(req);
+				again = 1;
+			}
+		}
+	} while (again);
 
-repeat:
-	FD_ZERO(&rfd);
-	FD_SET(b->fd, &rfd);
-	FD_ZERO(&wfd);
+	return rval;
+}
 
-	if (!STAILQ_EMPTY(&b->wq))
-		FD_SET(b->fd, &wfd);
+/*
+ * Data on a session without queries in flight: servers close sessions
+ * that are idle for too long.  It is opened again once it is needed.
+ */
+static void
+bgpq_session_idle(struct bgpq_session *s)
+{
+	char	buf[512];
+	ssize_t	ret;
+
+	ret = read(s->fd, buf, sizeof(buf));
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret > 0) {
+		SX_DEBUG(debug_expander, "Ignoring %zd unexpected bytes from "
+		    "IRRd\n", ret);
+		return;
+	}
 
-	ret = select(b->fd + 1, &rfd, &wfd, NULL, NULL);
+	SX_DEBUG(debug_expander, "IRRd closed idle session\n");
 
-	if (ret == 0)
-		sx_report(SX_FATAL, "select failed\n");
-	else if (ret == -1 && errno == EINTR)
-		goto repeat;
-	else if (ret == -1)
-		sx_report(SX_FATAL, "select error %i: %s\n", errno,
-		    strerror(errno));
+	bgpq_session_drop(s);
+}
+
+static void
+bgpq_session_event(int fd __attribute__((unused)), int events, void *arg)
+{
+	struct bgpq_session	*s = arg;
+
+	if (events & SX_EVENT_WRITE)
+		bgpq_write(s);
+	if (!(events & SX_EVENT_READ) || s->fd == -1)
+		return;
+	if (STAILQ_EMPTY(&s->rq))
+		bgpq_session_idle(s);
+	else if (!bgpq_session_read(s))
+		s->failed = 1;
+}
 
-	if (!STAILQ_EMPTY(&b->wq) && FD_ISSET(b->fd, &wfd))
-		bgpq_write(b);
+/*
+ * Watch the sessions of b for what they wait for: replies to the
+ * queries in flight and room to send the queued ones.  Sessions without
+ * any queries are only watched for the server closing them if idle is
+ * set, and connected again once there are.  Collects the failures since
+ * the last call into rval, returns the number of sessions with queries.
+ */
+int
+bgpq_expand_watch(struct bgpq_expander *b, int idle, int *rval)
+{
+	struct bgpq_session	*s;
+	unsigned int		 i;
+	int			 busy = 0, events;
+
+	for (i = 0; i < b->nsessions; i++) {
+		s = &b->sessions[i];
+		/* queued since the last wait, usually fits right away */
+		if (s->fd != -1 && s->addrs == NULL &&
+		    bgpq_session_writable(s))
+			bgpq_write(s);
+		/* not connected yet, or closed by the server */
+		if (s->fd == -1 && b->rpsl == NULL && s->waiting > 0)
+			bgpq_session_reopen(b, s);
+		if (s->failed) {
+			*rval = 0;
+			s->failed = 0;
+		}
+		if (s->fd == -1)
+			continue;
+		/* bgpq_session_connected() is called back */
+		if (s->addrs != NULL) {
+			busy++;
+			continue;
+		}
+		events = 0;
+		if (STAILQ_EMPTY(&s->wq) && STAILQ_EMPTY(&s->rq) &&
+		    s->waiting == 0) {
+			if (idle)
+				events = SX_EVENT_READ;
+		} else {
+			if (bgpq_session_writable(s))
+				events |= SX_EVENT_WRITE;
+			if (!STAILQ_EMPTY(&s->rq))
+				events |= SX_EVENT_READ;
+			busy++;
+		}
+		if (events != s->events) {
+			sx_event_set(s->ev, s->fd, events, bgpq_session_event,
+			    s);
+			s->events = events;
+		}
+	}
 
-	if (FD_ISSET(b->fd, &rfd))
-		return read(b->fd, buffer, size);
+	return busy;
+}
 
-	goto repeat;
+/*
+ * Wait for the sessions of b and handle whatever they are ready for.
+ * Returns 0 once all queued requests have been answered.
+ */
+static int
+bgpq_poll(struct bgpq_expander *b, int *rval)
+{
+	if (!bgpq_expand_replay(b))
+		*rval = 0;
+
+	if (bgpq_expand_watch(b, 0, rval) == 0)
+		return 0;
+
+	sx_event_wait(b->events, -1);
+
+	return 1;
 }
 
+/*
+ * Run until all queued requests of all sessions have been answered.
+ */
 static int
 bgpq_read(struct bgpq_expander *b)
 {
-	static char response[256];
-	static int off = 0;
-	int rval = 1;
+	int	rval = 1;
 
-	if (!STAILQ_EMPTY(&b->wq))
-		bgpq_write(b);
+	while (bgpq_poll(b, &rval))
+		;
 
-	while(!STAILQ_EMPTY(&b->rq)) {
-		int			 ret = 0;
-		char			*cres;
-		struct request	*req = STAILQ_FIRST(&b->rq);
+	return rval;
+}
 
-		SX_DEBUG(debug_expander > 2, "waiting for answer to %s,"
-		    "init %i '%.*s'\n", req->request, off, off, response);
+static int
+bgpq_connect(struct bgpq_expander *b, struct addrinfo *res)
+{
+	struct addrinfo		*rp;
+	struct linger		 sl;
+	int			 fd = -1, err;
 
-		if ((cres=strchr(response, '\n')) != NULL)
-			goto have;
+	sl.l_onoff = 1;
+	sl.l_linger = 5;
 
-repeat:
-		ret = bgpq_selread(b, response + off, sizeof(response) - off);
-		if (ret < 0) {
-			if (errno == EAGAIN)
-				goto repeat;
-			sx_report(SX_FATAL,"Error reading data from IRRd: "
-			    "%s (dequeue)\n", strerror(errno));
-		} else if (ret == 0) {
-			sx_report(SX_FATAL,"EOF from IRRd (dequeue)\n");
+	for (rp=res; rp; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, 0);
+		if (fd == -1) {
+			if (errno == EPROTONOSUPPORT || errno == EAFNOSUPPORT)
+				continue;
+			sx_report(SX_ERROR,"Unable to create socket: %s\n",
+			    strerror(errno));
+			return -1;
+		}
+		if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &sl,
+		    sizeof(struct linger))) {
+			sx_report(SX_ERROR,"Unable to set linger on socket: "
+			    "%s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		err = connect(fd, rp->ai_addr, rp->ai_addrlen);
+		if (err) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		err = sx_maxsockbuf(fd, SO_SNDBUF);
+		if (err > 0) {
+			SX_DEBUG(debug_expander, "Acquired sendbuf of %i "
+			    "bytes\n", err);
+		} else {
+			close(fd);
+			fd = -1;
+			continue;
 		}
-		off += ret;
+		break;
+	}
 
-		if (!(cres = strchr(response, '\n')))
-			goto repeat;
+	if (fd == -1) {
+		/* all our attempts to connect failed */
+		sx_report(SX_ERROR,"All attempts to connect %s failed, last"
+		    " error: %s\n", b->server, strerror(errno));
+	}
 
-have:
-		SX_DEBUG(debug_expander > 5, "got response of %.*s\n", off,
-		    response);
+	return fd;
+}
 
-		if (response[0] == 'A') {
-			char		*eon, *c;
-			unsigned long	 offset = 0;
-			unsigned long 	 togot = strtoul(response + 1, &eon, 10);
-			char 		*recvbuffer = malloc(togot + 2);
+#define PROBE_AQUERY	0x01	/* !a, whether the A query is supported */
+#define PROBE_SOURCES	0x02	/* !s-lc, the sources the server has */
 
-			if (recvbuffer == NULL)
-				err(1, NULL);
+/*
+ * Start a new connection of session s with an empty pipeline.
+ */
+static void
+bgpq_session_init(struct bgpq_expander *b, struct bgpq_session *s)
+{
+	s->inflight = 0;
+	s->window = BGPQ_WINDOW_INIT;
+	if (s->window > b->window)
+		s->window = b->window;
+	s->windowmax = s->ssthresh = b->window;
+	s->rttmin = s->backoff = 0;
+
+	s->buflen = s->bufpos = 0;
+	s->state = R_STATUS;
+}
 
-			memset(recvbuffer, 0, togot + 2);
+/*
+ * Open one IRRd session and send the whole handshake at once: ask for
+ * the connection to remain open, identify ourselves, ask what is given
+ * in probes and select the sources.  The replies are read by
+ * bgpq_session_handshake() later on, so all sessions share the round
+ * trip.  Returns 0 if the session could not be opened.
+ */
+static int
+bgpq_session_open(struct bgpq_expander *b, struct bgpq_session *s,
+    struct addrinfo *res, int probes)
+{
+	char	*hs;
+	size_t	 size;
+	ssize_t	 ret;
+	int	 len;
 
-			if (!eon || *eon != '\n') {
-				sx_report(SX_ERROR,"A-code finished with wrong"
-				    " char '%c'(%s)\n", eon ? *eon : '0',
-				    response);
-				exit(1);
-			}
+	if ((s->fd = bgpq_connect(b, res)) == -1)
+		return 0;
 
-			if ((unsigned)(off - ((eon + 1) - response)) > togot) {
-				// full response and more data is already in buffer
-				memcpy(recvbuffer, eon + 1, togot);
-				offset = togot;
-				memmove(response, eon + 1 + togot,
-				    off - ((eon + 1) - response) - togot);
-				off -= togot + ((eon + 1) - response);
-				memset(response + off, 0,
-				    sizeof(response) - off);
-			} else {
-				/* response is not yet fully buffered */
-				memcpy(recvbuffer, eon + 1,
-				    off - ((eon + 1) - response));
-				offset = off - ((eon + 1) - response);
-				memset(response, 0, sizeof(response));
-				off = 0;
-			}
+	bgpq_session_init(b, s);
 
-			SX_DEBUG(debug_expander > 5,
-			    "starting read with ready '%.*s', waiting for "
-			    "%lu\n", (int)offset, recvbuffer, togot - offset);
-
-			if (off > 0)
-				goto have3;
-			if (offset == togot)
-				goto reread2;
-
-reread:
-
-			ret = bgpq_selread(b, recvbuffer + offset, togot - offset);
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					goto reread;
-				sx_report(SX_FATAL,"Error reading IRRd: %s "
-				    "(dequeue, result)\n", strerror(errno));
-			} else if (ret == 0) {
-				sx_report(SX_FATAL,"EOF from IRRd (dequeue, "
-				    "result)\n");
-			}
-			SX_DEBUG(debug_expander > 5,
-				"Read1: got '%.*s'\n", ret,
-				    recvbuffer + offset);
-			offset += ret;
-			if (offset < togot) {
-				SX_DEBUG(debug_expander > 5, "expected %lu, got "
-				    "%lu expanding %s", togot,
-				    strlen(recvbuffer), req->request);
-				goto reread;
-			}
+	size = sizeof(PACKAGE_STRING) + 32;
+	if (b->sources)
+		size += strlen(b->sources);
+	if ((hs = malloc(size)) == NULL)
+		err(1, NULL);
 
-reread2:
-			ret = bgpq_selread(b, response + off,
-			    sizeof(response) - off);
-
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					goto reread2;
-				sx_report(SX_FATAL,"Error reading IRRd: %s "
-				    "(dequeue,final)\n", strerror(errno));
-			} else if (ret == 0) {
-				sx_report(SX_FATAL,"EOF from IRRd (dequeue,"
-				    "final)\n");
-			}
+	len = snprintf(hs, size, "!!\n");
+	if (b->identify)
+		len += snprintf(hs + len, size - len, "!n" PACKAGE_STRING "\n");
+	if (probes & PROBE_AQUERY)
+		len += snprintf(hs + len, size - len, "!a\n");
+	if (probes & PROBE_SOURCES)
+		len += snprintf(hs + len, size - len, "!s-lc\n");
+	if (b->sources && b->sources[0] != 0)
+		len += snprintf(hs + len, size - len, "!s%s\n", b->sources);
+
+	SX_DEBUG(debug_expander, "Sending handshake:\n%s", hs);
+
+	ret = write(s->fd, hs, len);
+	free(hs);
+
+	if (ret != len) {
+		sx_report(SX_ERROR, "Partial write of handshake to IRRd: "
+		    "%zd bytes, %s\n", ret, strerror(errno));
+		close(s->fd);
+		s->fd = -1;
+		return 0;
+	}
 
-			SX_DEBUG(debug_expander > 5,
-				"Read2: got '%.*s'\n", ret, response + off);
+	return 1;
+}
 
-			off += ret;
+/*
+ * Read more of the replies to the handshake, the session is still
+ * blocking then.  Returns 0 if the server went away.
+ */
+static int
+bgpq_session_fill(struct bgpq_session *s)
+{
+	ssize_t	ret;
 
-have3:
-			if (!(cres = strchr(response, '\n')))
-				goto reread2;
+	if (s->bufpos > 0) {
+		memmove(s->buf, s->buf + s->bufpos, s->buflen - s->bufpos);
+		s->buflen -= s->bufpos;
+		s->bufpos = 0;
+	}
 
-			SX_DEBUG(debug_expander>=3,"Got %s (%lu bytes of %lu) "
-			    "in response to %sfinal code: %.*s", recvbuffer,
-			    strlen(recvbuffer), togot, req->request,
-			    off, response);
+	if (s->buflen == s->bufsize) {
+		s->bufsize *= 2;
+		if ((s->buf = realloc(s->buf, s->bufsize)) == NULL)
+			err(1, NULL);
+	}
 
-			for (c = recvbuffer; c < recvbuffer + togot;) {
-				size_t spn=strcspn(c," \n");
-				if (spn)
-					c[spn] = 0;
-				if (c[0] == 0)
-					break;
-				if (!req->callback(c, b, req)) rval = 0;
-				c += spn + 1;
+	ret = read(s->fd, s->buf + s->buflen, s->bufsize - s->buflen);
+	if (ret <= 0) {
+		sx_report(SX_ERROR, "Error reading handshake from IRRd: %s\n",
+		    ret == 0 ? "EOF" : strerror(errno));
+		return 0;
+	}
+
+	s->buflen += ret;
+
+	return 1;
+}
+
+/*
+ * Read the reply to a command of the handshake.  Returns its status
+ * line, and the data of an A reply in data if asked for, NULL if the
+ * server went away or sent something else.
+ */
+static char *
+bgpq_session_reply(struct bgpq_session *s, char **data)
+{
+	char		*eol, *line, *eon, *d = NULL;
+	unsigned long	 len;
+
+	while ((eol = memchr(s->buf + s->bufpos, '\n',
+	    s->buflen - s->bufpos)) == NULL) {
+		if (!bgpq_session_fill(s))
+			return NULL;
+	}
+
+	if ((line = strndup(s->buf + s->bufpos,
+	    eol - s->buf - s->bufpos)) == NULL)
+		err(1, NULL);
+	s->bufpos = eol + 1 - s->buf;
+
+	if (line[0] == 'A') {
+		len = strtoul(line + 1, &eon, 10);
+		if (*eon != '\0') {
+			sx_report(SX_ERROR, "Invalid reply from IRRd: %s\n",
+			    line);
+			free(line);
+			return NULL;
+		}
+
+		/* the data and the final C line */
+		while (s->buflen - s->bufpos < len || (eol = memchr(s->buf +
+		    s->bufpos + len, '\n', s->buflen - s->bufpos - len)) ==
+		    NULL) {
+			if (!bgpq_session_fill(s)) {
+				free(line);
+				return NULL;
 			}
-			assert(c == recvbuffer + togot);
-			memset(recvbuffer, 0, togot + 2);
-			free(recvbuffer);
-		} else if (response[0] == 'C') {
-			/* No data */
-			SX_DEBUG(debug_expander,"No data expanding %s",
-			    req->request);
-			if (b->validate_asns)
-				bgpq_expander_invalidate_asn(b, req->request);
-		} else if (response[0] == 'D') {
-			sx_report(SX_ERROR, "Key not found expanding %s",
-			    req->request);
-			if (b->validate_asns)
-				bgpq_expander_invalidate_asn(b, req->request);
-			rval = 0;
-		} else if (response[0] == 'E') {
-			sx_report(SX_ERROR, "Multiple keys expanding %s: %s",
-			    req->request, response);
-			rval = 0;
-		} else if ( response[0] == 'F') {
-			sx_report(SX_ERROR, "Error expanding %s: %s",
-			    req->request, response);
-			rval = 0;
-		} else {
-			sx_report(SX_ERROR,"Wrong reply: %s to %s", response,
-			    req->request);
-			exit(1);
 		}
 
-		memmove(response, cres + 1, off - ((cres + 1) - response));
-		off -= (cres + 1) - response;
-		memset(response + off, 0, sizeof(response) - off);
-		SX_DEBUG(debug_expander > 5,
-		    "fixed response of %i, %.*s\n", off, off, response);
+		if ((d = strndup(s->buf + s->bufpos, len)) == NULL)
+			err(1, NULL);
+		s->bufpos = eol + 1 - s->buf;
+	}
+
+	if (data)
+		*data = d;
+	else
+		free(d);
+
+	return line;
+}
+
+/*
+ * Read the replies to the handshake sent by bgpq_session_open(), with
+ * the same probes.  Returns 0 if the server went away or did not reply
+ * as expected.
+ */
+static int
+bgpq_session_handshake(struct bgpq_expander *b, struct bgpq_session *s,
+    int probes, int *aquery, char **sources)
+{
+	const char	 aresp[] = "F Missing required set name for A query";
+	char		*line, *data;
+
+	if (b->identify) {
+		if ((line = bgpq_session_reply(s, NULL)) == NULL)
+			return 0;
+		SX_DEBUG(debug_expander, "Got answer %s\n", line);
+		free(line);
+	}
 
-		STAILQ_REMOVE_HEAD(&b->rq, next);
-		b->piped--;
+	if (probes & PROBE_AQUERY) {
+		if ((line = bgpq_session_reply(s, NULL)) == NULL)
+			return 0;
+		*aquery = strncmp(line, aresp, strlen(aresp)) == 0;
+		SX_DEBUG(debug_expander, "%s\n", *aquery ?
+		    "Server supports A query" : "No support for A query");
+		free(line);
+	}
 
-		request_free(req);
+	if (probes & PROBE_SOURCES) {
+		if ((line = bgpq_session_reply(s, &data)) == NULL)
+			return 0;
+		if (data == NULL) {
+			sx_report(SX_ERROR, "Invalid response '%s': !s-lc\n",
+			    line);
+			free(line);
+			return 0;
+		}
+		data[strcspn(data, "\r\n")] = '\0';
+		SX_DEBUG(debug_expander, "Got sources %s\n", data);
+		*sources = data;
+		free(line);
 	}
 
-	return rval;
+	if (b->sources && b->sources[0] != 0) {
+		if ((line = bgpq_session_reply(s, NULL)) == NULL)
+			return 0;
+		if (line[0] != 'C') {
+			sx_report(SX_ERROR, "Invalid source(s) '%s': %s\n",
+			    b->sources, line);
+			free(line);
+			return 0;
+		}
+		free(line);
+	}
+
+	return 1;
 }
 
-int
-bgpq_expand_irrd(struct bgpq_expander *b,
-    int (*callback)(char *, struct bgpq_expander *, struct request *),
-    void *udata, char *fmt, ...)
+/*
+ * Switch the session to non-blocking mode, it is ready for the queries
+ * then.
+ */
+static void
+bgpq_session_ready(struct bgpq_expander *b, struct bgpq_session *s)
 {
-	char			 request[256], response[256];
-	va_list			 ap;
-	ssize_t			 ret;
-	int			 off = 0;
-	struct request	*req;
-	int rval = 1;
+	fcntl(s->fd, F_SETFL, O_NONBLOCK|(fcntl(s->fd, F_GETFL)));
+
+	s->source = s->wire = bgpq_session_find_source(s, bgpq_set_sources(b));
+
+	/* armed once there are queries */
+	s->ev = b->events;
+	s->events = 0;
+	sx_event_set(s->ev, s->fd, 0, bgpq_session_event, s);
+}
 
-	va_start(ap, fmt);
-	vsnprintf(request, sizeof(request), fmt, ap);
-	va_end(ap);
+/*
+ * Prepare the sessions to the IRRd for the queries, they connect once
+ * there are queries for them, see bgpq_expand_watch().  Only what the
+ * server supports is asked right away, on the first session, unless it
+ * is known from the cache: a run answered from the cache never
+ * connects.  Returns whether the server supports the A query, if asked
+ * to probe.
+ */
+static int
+bgpq_expand_connect(struct bgpq_expander *b, int probe)
+{
+	struct addrinfo 	 hints, *res = NULL;
+	struct bgpq_session	*s;
+	char			*sources = NULL;
+	unsigned int		 i;
+	int			 error, probes = 0, aquery = 0;
 
-	req = request_alloc(request, callback, udata);
+	if (!pipelining || b->nsessions == 0)
+		b->nsessions = 1;
 
-	SX_DEBUG(debug_expander, "expander sending: %s", request);
+	/* a session closed by IRRd is an error from writev, not a signal */
+	signal(SIGPIPE, SIG_IGN);
 
-	if ((ret = write(b->fd, request, strlen(request)) == 0) || ret == -1) {
-		sx_report(SX_ERROR,
-			"Partial write of request to IRRd: %li bytes, %s\n",
-			ret, strerror(errno));
-		exit(1);
+	if ((b->sessions = calloc(b->nsessions,
+	    sizeof(struct bgpq_session))) == NULL)
+		err(1, NULL);
+	b->nextsession = 0;
+
+	for (i = 0; i < b->nsessions; i++) {
+		s = &b->sessions[i];
+		s->expander = b;
+		s->fd = -1;
+		STAILQ_INIT(&s->sources);
+		STAILQ_INIT(&s->wq);
+		STAILQ_INIT(&s->rq);
+		STAILQ_INIT(&s->cq);
+		/* grown on demand, only a single token has to fit */
+		s->bufsize = 65536;
+		if ((s->buf = malloc(s->bufsize)) == NULL)
+			err(1, NULL);
 	}
 
-	memset(response, 0, sizeof(response));
+	if (probe)
+		probes |= PROBE_AQUERY;
+	if (!b->usesource || !b->sources || b->sources[0] == 0)
+		probes |= PROBE_SOURCES;
 
-repeat:
-	ret = bgpq_selread(b, response+off, sizeof(response)-off);
-	if (ret < 0) {
-		sx_report(SX_ERROR, "Error reading IRRd: %s\n",
-		    strerror(errno));
-		exit(1);
-	} else if (ret == 0) {
-		sx_report(SX_FATAL, "EOF reading IRRd\n");
+	if (probes && b->cachedir) {
+		if (bgpq_cache_caps_lookup(b, &aquery, &sources))
+			probes = 0;
+		else
+			/* all of them, for the runs to come */
+			probes = PROBE_AQUERY | PROBE_SOURCES;
 	}
 
-	off += ret;
+	if (probes) {
+		memset(&hints, 0, sizeof(struct addrinfo));
 
-	if (strchr(response, '\n') == NULL)
-		goto repeat;
+		hints.ai_socktype = SOCK_STREAM;
 
-	SX_DEBUG(debug_expander > 2, "expander: initially got %lu bytes, "
-	    "'%s'\n", (unsigned long)strlen(response), response);
+		error = getaddrinfo(b->server, b->port, &hints, &res);
 
-	if (response[0] == 'A') {
-		char	*eon, *c;
-		long 	 togot = strtoul(response + 1, &eon, 10);
-		char 	*recvbuffer = malloc(togot + 2);
-		int 	 offset = 0;
-
-		if (!recvbuffer) {
-			sx_report(SX_FATAL, "Error allocating %lu bytes: %s\n",
-			    togot + 2, strerror(errno));
+		if (error) {
+			sx_report(SX_ERROR,"Unable to resolve %s: %s\n",
+			    b->server, gai_strerror(error));
+			exit(1);
 		}
 
-		if (eon && *eon != '\n') {
-			sx_report(SX_ERROR,"A-code finished with wrong char "
-			    "'%c' (%s)\n", *eon, response);
+		s = &b->sessions[0];
+		if (!bgpq_session_open(b, s, res, probes) ||
+		    !bgpq_session_handshake(b, s, probes, &aquery, &sources))
 			exit(1);
-		}
 
-		if (off - ((eon + 1) - response) > togot) {
-			memcpy(recvbuffer, eon + 1, togot);
-			offset = togot;
-			memmove(response, eon + 1 + togot,
-			    off - ((eon + 1) - response) - togot);
-			off -= togot + ((eon + 1) - response);
-			memset(response+off, 0, sizeof(response) - off);
-		} else {
-			memcpy(recvbuffer, eon + 1,
-			    off - ((eon + 1) - response));
-			offset = off - ((eon + 1) - response);
-			memset(response, 0, sizeof(response));
-			off = 0;
-		}
+		freeaddrinfo(res);
 
-		if (off > 0)
-			goto have3;
-		if (offset == togot)
-			goto reread2;
-
-reread:
-		ret = bgpq_selread(b, recvbuffer + offset, togot - offset);
-		if (ret == 0) {
-			sx_report(SX_FATAL,"EOF from IRRd (expand,result)\n");
-		} else if (ret < 0) {
-			sx_report(SX_FATAL,"Error reading IRRd: %s "
-			    "(expand,result)\n", strerror(errno));
-		}
-		offset += ret;
-		if (offset < togot)
-			goto reread;
+		SX_DEBUG(debug_expander, "Opened session to %s\n",
+		    b->server);
 
-reread2:
-		ret = bgpq_selread(b, response+off, sizeof(response) - off);
-		if (ret < 0) {
-			sx_report(SX_FATAL, "error reading IRRd: %s\n",
-			    strerror(errno));
-		} else if (ret == 0) {
-			sx_report(SX_FATAL, "eof reading IRRd\n");
+		if (b->cachedir)
+			bgpq_cache_caps_store(b, aquery, sources);
+	}
+
+	if (b->usesource && b->sources && b->sources[0] != 0) {
+		free(sources);
+		if ((b->defaultsources = strdup(b->sources)) == NULL)
+			err(1, NULL);
+	} else
+		b->defaultsources = sources;
+
+	for (i = 0; i < b->nsessions; i++) {
+		s = &b->sessions[i];
+		if (s->fd != -1)
+			bgpq_session_ready(b, s);
+		else {
+			/* bgpq_session_plan() selects them once connected */
+			s->source = bgpq_session_find_source(s,
+			    bgpq_set_sources(b));
+			s->ev = b->events;
 		}
-		off += ret;
-
-have3:
-		if (!strchr(response, '\n'))
-			goto reread2;
-
-		SX_DEBUG(debug_expander > 2,"expander: final reply of %lu bytes,"
-		    " %.*sreturn code %.*s",
-		    (unsigned long)strlen(recvbuffer), offset, recvbuffer, off,
-		    response);
-
-		for (c = recvbuffer; c < recvbuffer + togot;) {
-			size_t spn = strcspn(c, " \n");
-			if (spn)
-				c[spn] = 0;
-			if (c[0] == 0)
-				break;
-			if (callback)
-				if (!callback(c, b, req)) rval = 0;
-			c += spn + 1;
+	}
+
+	return probe && aquery;
+}
+
+/*
+ * Give up the queries waiting for session s, the server can not be
+ * reached.  Their jobs, and those waiting for the same replies, are
+ * marked unreachable.
+ */
+static void
+bgpq_session_fail(struct bgpq_session *s, const char *why)
+{
+	struct bgpq_source	*src;
+	struct bgpq_reply	*r;
+	struct request		*req, *w;
+
+	STAILQ_FOREACH(src, &s->sources, entry) {
+		while ((req = STAILQ_FIRST(&src->q)) != NULL) {
+			STAILQ_REMOVE_HEAD(&src->q, next);
+			sx_report(SX_ERROR, "Unable to expand %.*s: %s\n",
+			    (int)strcspn(req->request, "\n"), req->request,
+			    why);
+			if ((r = req->reply) != NULL) {
+				while ((w = STAILQ_FIRST(&r->waiting)) !=
+				    NULL) {
+					STAILQ_REMOVE_HEAD(&r->waiting, next);
+					w->expander->unreachable = 1;
+					w->expander->piped--;
+					request_free(w);
+				}
+				/* not kept, the next query may get through */
+				bgpq_reply_free(req->expander->replies, r);
+			}
+			req->expander->unreachable = 1;
+			req->expander->piped--;
+			request_free(req);
 		}
-		memset(recvbuffer, 0, togot + 2);
-		free(recvbuffer);
-	} else if (response[0] == 'C') {
-		/* no data */
-		if (b->validate_asns)
-			bgpq_expander_invalidate_asn(b, request);
-	} else if (response[0] == 'D') {
-		sx_report(SX_ERROR, "Key not found expanding %s",
-			req->request);
-		if (b->validate_asns)
-			bgpq_expander_invalidate_asn(b, request);
-		rval = 0;
-	} else if (response[0] == 'E') {
-		/* XXXXXX */
-	} else if (response[0] == 'F') {
-		sx_report(SX_ERROR, "Error expanding %s: %s",
-			request, response);
-		rval = 0;
-	} else {
-		sx_report(SX_ERROR,"Wrong reply: %s", response);
-		exit(1);
 	}
-	request_free(req);
 
-	return rval;
+	s->waiting = 0;
+	s->retries = 0;
+	s->failed = 1;
 }
 
-int
-bgpq_expand(struct bgpq_expander *b)
+/*
+ * Connect session s to the next of the addresses of the server, without
+ * waiting for it.  The queries waiting for s are given up once none of
+ * the addresses are left.
+ */
+static void
+bgpq_session_dial(struct bgpq_session *s)
 {
-	char			*source;
-	struct slentry		*mc;
-	struct addrinfo 	 hints, *res = NULL, *rp;
+	struct bgpq_expander	*b = s->expander;
 	struct linger		 sl;
-	struct asn_entry	*asne;
-	int			 fd = -1, err, ret, aquery = 0;
-	int			 slen;
+	int			 fd;
 
 	sl.l_onoff = 1;
 	sl.l_linger = 5;
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-
-	hints.ai_socktype = SOCK_STREAM;
-
-	err=getaddrinfo(b->server, b->port, &hints, &res);
-
-	if (err) {
-		sx_report(SX_ERROR,"Unable to resolve %s: %s\n", b->server,
-		    gai_strerror(err));
-		exit(1);
-	}
-
-	for (rp=res; rp; rp = rp->ai_next) {
-		fd = socket(rp->ai_family, rp->ai_socktype, 0);
-		if (fd == -1) {
-			if (errno == EPROTONOSUPPORT || errno == EAFNOSUPPORT)
-				continue;
-			sx_report(SX_ERROR,"Unable to create socket: %s\n",
-			    strerror(errno));
-			exit(1);
-		}
+	for (; s->addr != NULL; s->addr = s->addr->ai_next) {
+		fd = socket(s->addr->ai_family, s->addr->ai_socktype, 0);
+		if (fd == -1)
+			continue;
 		if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &sl,
-		    sizeof(struct linger))) {
-			sx_report(SX_ERROR,"Unable to set linger on socket: "
-			    "%s\n", strerror(errno));
-			close(fd);
-			exit(1);
-		}
-		err = connect(fd, rp->ai_addr, rp->ai_addrlen);
-		if (err) {
+		    sizeof(struct linger)) == -1 ||
+		    fcntl(fd, F_SETFL, O_NONBLOCK|fcntl(fd, F_GETFL)) == -1) {
 			close(fd);
-			fd = -1;
 			continue;
 		}
-		err = sx_maxsockbuf(fd, SO_SNDBUF);
-		if (err > 0) {
-			SX_DEBUG(debug_expander, "Acquired sendbuf of %i "
-			    "bytes\n", err);
-		} else {
-			close(fd);
-			fd = -1;
-			continue;
+		if (connect(fd, s->addr->ai_addr, s->addr->ai_addrlen) == 0 ||
+		    errno == EINPROGRESS) {
+			s->fd = fd;
+			s->ev = b->events;
+			s->events = SX_EVENT_WRITE;
+			sx_event_set(s->ev, fd, SX_EVENT_WRITE,
+			    bgpq_session_connected, s);
+			return;
 		}
-		break;
+		close(fd);
 	}
 
-	freeaddrinfo(res);
+	sx_report(SX_ERROR,"All attempts to connect %s failed, last error: "
+	    "%s\n", b->server, strerror(errno));
 
-	if (fd == -1) {
-		/* all our attempts to connect failed */
-		sx_report(SX_ERROR,"All attempts to connect %s failed, last"
-		    " error: %s\n", b->server, strerror(errno));
-		exit(1);
-	}
+	freeaddrinfo(s->addrs);
+	s->addrs = NULL;
 
-	b->fd = fd;
+	bgpq_session_fail(s, "unable to connect to IRRd");
+}
 
-	SX_DEBUG(debug_expander, "Sending '!!' to server to request for the"
-	    " connection to remain open\n");
-	if ((ret = write(fd, "!!\n", 3)) != 3) {
-		sx_report(SX_ERROR, "Partial write of multiple command mode "
-		    "to IRRd: %i bytes, %s\n", ret, strerror(errno));
+/*
+ * The connection of session s is established or has failed.  An
+ * established one only needs to be asked to stay open, the sources are
+ * selected by bgpq_session_plan() before the first query and the
+ * identification is the first query itself.
+ */
+static void
+bgpq_session_connected(int fd, int events __attribute__((unused)),
+    void *arg)
+{
+	struct bgpq_session	*s = arg;
+	struct bgpq_expander	*b = s->expander;
+	struct bgpq_source	*src;
+	struct request		*req;
+	char			 identify[] = "!n" PACKAGE_STRING "\n";
+	socklen_t		 len = sizeof(int);
+	int			 error = 0;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+	else if (error == 0 && write(fd, "!!\n", 3) != 3)
+		error = errno;
+
+	sx_event_del(s->ev, fd);
+
+	if (error != 0) {
 		close(fd);
-		exit(1);
+		s->fd = -1;
+		s->events = 0;
+		s->addr = s->addr->ai_next;
+		errno = error;
+		bgpq_session_dial(s);
+		return;
 	}
 
+	freeaddrinfo(s->addrs);
+	s->addrs = s->addr = NULL;
+
+	sx_maxsockbuf(fd, SO_SNDBUF);
+	bgpq_session_init(b, s);
+	s->wire = NULL;
+
 	if (b->identify) {
-		SX_DEBUG(debug_expander, "b->identify: Sending '!n "
-		    PACKAGE_STRING "' to server.\n");
-		char ident[128];
-		int ilen = snprintf(ident, sizeof(ident), "!n" PACKAGE_STRING "\n");
-		if (ilen > 0) {
-			if ((ret = write(fd, ident, ilen)) != ilen) {
-				sx_report(SX_ERROR, "Partial write of "
-				    "identifier to IRRd: %i bytes, %s\n",
-				    ret, strerror(errno));
-				close(fd);
-				exit(1);
-			}
-			memset(ident, 0, sizeof(ident));
-			if (0 < read(fd, ident, sizeof(ident))) {
-				SX_DEBUG(debug_expander, "Got answer %s", ident);
-			} else {
-				sx_report(SX_ERROR, "ident, failed read from IRRd\n");
-				close(fd);
-				exit(1);
-			}
-		} else {
-			sx_report(SX_ERROR, "snprintf(ident) failed\n");
-			close(fd);
-			exit(1);
+		STAILQ_FOREACH(src, &s->sources, entry) {
+			if (!STAILQ_EMPTY(&src->q))
+				break;
+		}
+		/* on behalf of the first query waiting, like !s */
+		if (src != NULL) {
+			req = request_alloc(identify, NULL, NULL);
+			req->expander = STAILQ_FIRST(&src->q)->expander;
+			req->source = src;
+			req->expander->piped++;
+			STAILQ_INSERT_HEAD(&s->wq, req, next);
 		}
 	}
 
-	/* Test whether the server has support for the A query */
-	if (b->generation >= T_PREFIXLIST && !STAILQ_EMPTY(&b->macroses)) {
-		char aret[128];
-		char aresp[] = "F Missing required set name for A query";
-		SX_DEBUG(debug_expander, "Testing support for A queries\n");
-		if ((ret = write(fd, "!a\n", 3)) != 3) {
-			sx_report(SX_ERROR, "Partial write of '!a' test query "
-			    "to IRRd: %i bytes, %s\n", ret, strerror(errno));
-			close(fd);
-			exit(1);
-		}
-		memset(aret, 0, sizeof(aret));
-		if (0 < read(fd, aret, sizeof(aret))) {
-			if (strncmp(aret, aresp, strlen(aresp)) == 0) {
-				SX_DEBUG(debug_expander, "Server supports A query\n");
-				aquery = 1;
-			} else {
-				SX_DEBUG(debug_expander, "No support for A query\n");
-			}
-		} else {
-			sx_report(SX_ERROR, "A query test failed read from IRRd\n");
-			close(fd);
-			exit(1);
-		}
+	/* armed by bgpq_expand_watch() */
+	s->events = 0;
+	sx_event_set(s->ev, fd, 0, bgpq_session_event, s);
+
+	SX_DEBUG(debug_expander, "Connected session to %s\n", b->server);
+}
+
+/*
+ * Connect a session that got queries, for the first time or after the
+ * server closed it.  The queries waiting for it are given up if that
+ * fails, or if the server keeps failing the session before any reply.
+ */
+static void
+bgpq_session_reopen(struct bgpq_expander *b, struct bgpq_session *s)
+{
+	struct addrinfo 	 hints;
+	int			 error;
+
+	if (s->retries > BGPQ_RETRIES) {
+		bgpq_session_fail(s, "IRRd keeps failing the session");
+		return;
 	}
 
-	if (b->usesource) {
-		if (b->sources && b->sources[0] != 0) {
-			b->defaultsources = (char*)calloc(1, strlen(b->sources));
-			strlcpy(b->defaultsources, b->sources,
-			    sizeof(b->defaultsources));
-		} else {
-			b->defaultsources = bgpq_get_irrd_sources(b->fd);
-		}
-	} else {
-		b->defaultsources = bgpq_get_irrd_sources(b->fd);
+	memset(&hints, 0, sizeof(struct addrinfo));
+
+	hints.ai_socktype = SOCK_STREAM;
+
+	error = getaddrinfo(b->server, b->port, &hints, &s->addrs);
+
+	if (error) {
+		sx_report(SX_ERROR,"Unable to resolve %s: %s\n", b->server,
+		    gai_strerror(error));
+		s->addrs = NULL;
+		bgpq_session_fail(s, "unable to resolve IRRd");
+		return;
 	}
 
-	if (b->sources && b->sources[0] != 0) {
-		slen = strlen(b->sources) + 4;
-		if (slen < 256)
-			slen = 256;
-		char sources[slen];
-		slen = snprintf(sources, sizeof(sources), "!s%s\n", b->sources);
-		if (slen > 0) {
-			SX_DEBUG(debug_expander, "Requesting sources %s", sources);
-			if ((ret = write(fd, sources, slen)) != slen) {
-				sx_report(SX_ERROR, "Partial write of sources to "
-				    "IRRd: %i bytes, %s\n", ret, strerror(errno));
-				close(fd);
-				exit(1);
-			}
-			memset(sources, 0, sizeof(sources));
-			if (0 < read(fd, sources, sizeof(sources))) {
-				SX_DEBUG(debug_expander, "Got answer %s", sources);
-				if (sources[0] != 'C') {
-					sx_report(SX_ERROR, "Invalid source(s) "
-					    "'%s': %s\n", b->sources, sources);
-					close(fd);
-					exit(1);
-				}
+	s->addr = s->addrs;
+	bgpq_session_dial(s);
+}
+
+/*
+ * Without a server all queries are answered from the dumps as soon as
+ * they are made, a single session keeps track of the sources.
+ */
+static void
+bgpq_expand_offline(struct bgpq_expander *b)
+{
+	struct bgpq_session	*s;
+
+	if (b->rpsl == NULL)
+		b->rpsl = bgpq_rpsl_load(&b->dumps);
+
+	b->nsessions = 1;
+	if ((b->sessions = calloc(1, sizeof(struct bgpq_session))) == NULL)
+		err(1, NULL);
+	b->nextsession = 0;
+
+	s = &b->sessions[0];
+	s->fd = -1;
+	STAILQ_INIT(&s->sources);
+	STAILQ_INIT(&s->wq);
+	STAILQ_INIT(&s->rq);
+	STAILQ_INIT(&s->cq);
+
+	if (b->sources && b->sources[0] != 0)
+		bgpq_rpsl_check_sources(b->rpsl, b->sources);
+
+	if (b->usesource && b->sources && b->sources[0] != 0) {
+		if ((b->defaultsources = strdup(b->sources)) == NULL)
+			err(1, NULL);
+	} else
+		b->defaultsources = bgpq_rpsl_sources(b->rpsl);
+
+	s->source = s->wire = bgpq_session_find_source(s, bgpq_set_sources(b));
+}
+
+/*
+ * Open the sessions of b, to the server or to the dumps.  Returns whether
+ * the server supports the A query, if asked to probe.
+ */
+int
+bgpq_expand_open(struct bgpq_expander *b, int probe)
+{
+	b->events = sx_event_new();
+
+	if (!STAILQ_EMPTY(&b->dumps)) {
+		bgpq_expand_offline(b);
+		return 0;
+	}
+
+	return bgpq_expand_connect(b, probe);
+}
+
+/*
+ * Whether expanding the as-sets of b may use the A query.
+ */
+static int
+bgpq_expand_aquery(struct bgpq_expander *b)
+{
+	return b->generation >= T_PREFIXLIST && !STAILQ_EMPTY(&b->macroses);
+}
+
+/*
+ * Queue the queries for the objects given, the replies queue the rest.
+ */
+static void
+bgpq_expand_start(struct bgpq_expander *b, int aquery)
+{
+	char			 buf[256], *source;
+	struct slentry		*mc;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
+	struct bgpq_session	*s;
+
+	/* ASNs given before EXCEPT were added before the stoplist */
+	sx_asnset_diff(&b->asnlist, &b->stopasns);
+
+	/*
+	 * Route-sets and ASNs given on the command line do not depend on
+	 * anything else, get them going first.  ASNs found while expanding
+	 * the as-sets are queried as soon as they are discovered, so the
+	 * pipeline stays full of both kinds of queries.
+	 */
+	if (b->generation >= T_PREFIXLIST || b->validate_asns) {
+		STAILQ_FOREACH(mc, &b->rsets, entry) {
+			s = bgpq_session_next(b);
+			if (b->usesource) {
+				source = bgpq_get_source(mc->text, buf,
+				    sizeof(buf));
+				if (source)
+					SX_DEBUG(debug_expander, "Checking %s\n",
+					    bgpq_get_rset(mc->text));
+				bgpq_session_source(s,
+				    source ? source : b->defaultsources);
+				bgpq_pipeline(b, s, b->family == AF_INET ?
+				    bgpq_expanded_prefix : bgpq_expanded_v6prefix,
+				    NULL, "!i%s\n", bgpq_get_rset(mc->text));
 			} else {
-				sx_report(SX_ERROR, "failed to read sources\n");
-				close(fd);
-				exit(1);
+				bgpq_session_source(s, b->defaultsources);
+				bgpq_pipeline(b, s, b->family == AF_INET ?
+				    bgpq_expanded_prefix : bgpq_expanded_v6prefix,
+				    NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
 			}
-		} else {
-			sx_report(SX_ERROR, "snprintf(sources) failed\n");
-			close(fd);
-			exit(1);
 		}
-	}
 
-	if (pipelining)
-		fcntl(fd, F_SETFL, O_NONBLOCK|(fcntl(fd, F_GETFL)));
+		SX_ASNSET_FOREACH(asn, it, &b->asnlist)
+			bgpq_expander_query_asn(b, asn);
+	}
 
 	STAILQ_FOREACH(mc, &b->macroses, entry) {
-		if (!b->maxdepth && RB_EMPTY(&b->stoplist)) {
-			if (b->usesource) {
-				source = bgpq_get_source(mc->text);
-				if (source){
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n", source);
-						bgpq_pipeline(b, bgpq_expanded_macro_limit, b,
-							"!i%s\n", bgpq_get_asset(mc->text));
-					} else {
-						bgpq_expand_irrd(b, NULL, NULL, "!s%s\n", source);
-						bgpq_expand_irrd(b, bgpq_expanded_macro_limit,
-							b, "!i%s\n", bgpq_get_asset(mc->text));
-					}
-					free(source);
-				} else {
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n",
-							b->defaultsources);
-						bgpq_pipeline(b, bgpq_expanded_macro_limit, b,
-							"!i%s\n", bgpq_get_asset(mc->text));
-					} else {
-						bgpq_expand_irrd(b, NULL, NULL, "!s%s\n",
-							b->defaultsources);
-						bgpq_expand_irrd(b, bgpq_expanded_macro_limit, b,
-							"!i%s\n", bgpq_get_asset(mc->text));
-					}
-				}
-			} else if (aquery)
-				bgpq_expand_irrd(b, bgpq_expanded_prefix, b,
+		s = bgpq_session_next(b);
+		if (b->usesource) {
+			source = bgpq_get_source(mc->text, buf, sizeof(buf));
+			bgpq_session_source(s,
+			    source ? source : b->defaultsources);
+		} else
+			bgpq_session_source(s, bgpq_set_sources(b));
+
+		if (!b->maxdepth && !b->nstopped &&
+		    sx_asnset_empty(&b->stopasns)) {
+			if (b->usesource)
+				bgpq_pipeline(b, s, bgpq_expanded_macro_limit, b,
+				    "!i%s\n", bgpq_get_asset(mc->text));
+			else if (aquery)
+				bgpq_pipeline(b, s, bgpq_expanded_prefix, b,
 				    "!a%s%s\n",
 				    b->family == AF_INET ? "4" : "6",
 				    bgpq_get_asset(mc->text));
 			else
-				bgpq_expand_irrd(b, bgpq_expanded_macro, b,
+				bgpq_pipeline(b, s, bgpq_expanded_macro, b,
 				    "!i%s,1\n", bgpq_get_asset(mc->text));
 		} else {
 			bgpq_expander_add_already(b, bgpq_get_asset(mc->text));
-			if (pipelining)
-				bgpq_pipeline(b, bgpq_expanded_macro_limit,
-				    NULL, "!i%s\n", bgpq_get_asset(mc->text));
-			else
-				bgpq_expand_irrd(b, bgpq_expanded_macro_limit,
-				    NULL, "!i%s\n", bgpq_get_asset(mc->text));
+			bgpq_expand_set(b, s, bgpq_get_asset(mc->text), 0);
 		}
 	}
+}
 
-	if (pipelining){
-		bgpq_pipeline(b, NULL, NULL, "!s%s\n", b->defaultsources);
-	} else {
-		bgpq_expand_irrd(b, NULL, NULL, "!s%s\n", b->defaultsources);
-	}
-
-	if (pipelining) {
-		if (!STAILQ_EMPTY(&b->wq))
-			bgpq_write(b);
-		if (!STAILQ_EMPTY(&b->rq))
-			bgpq_read(b);
-	}
+/*
+ * Build the tree from the prefixes collected while expanding.
+ */
+static void
+bgpq_expand_finish(struct bgpq_expander *b)
+{
+	sx_radix_tree_insert_bulk(b->tree, b->prefixes, b->nprefixes);
+	free(b->prefixes);
+	b->prefixes = NULL;
+	b->nprefixes = b->prefixessize = 0;
+}
 
-	if (b->generation >= T_PREFIXLIST || b->validate_asns) {
-		STAILQ_FOREACH(mc, &b->rsets, entry) {
-			if (b->usesource) {
-				source = bgpq_get_source(mc->text);
-				if (source){
-					if (pipelining){
-						printf("Checking %s\n", bgpq_get_rset(mc->text));
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n", source);
-						if (b->family == AF_INET)
-							bgpq_pipeline(b, bgpq_expanded_prefix,
-				    			NULL, "!i%s\n", bgpq_get_rset(mc->text));
-						else
-							bgpq_pipeline(b, bgpq_expanded_v6prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-					} else {
-						bgpq_expand_irrd(b, NULL, NULL, "!s%s\n", source);
-						if (b->family == AF_INET)
-							bgpq_expand_irrd(b, bgpq_expanded_prefix,
-				    			NULL, "!i%s\n", bgpq_get_rset(mc->text));
-						else
-							bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-					}
-					free(source);
-				} else {
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n",
-							b->defaultsources);
-						if (b->family == AF_INET)
-							bgpq_pipeline(b, bgpq_expanded_prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-						else
-							bgpq_pipeline(b, bgpq_expanded_v6prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-					} else {
-						bgpq_expand_irrd(b, NULL, NULL, "!s%s\n",
-							b->defaultsources);
-						if (b->family == AF_INET)
-							bgpq_expand_irrd(b, bgpq_expanded_prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-						else
-							bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
-								NULL, "!i%s\n", bgpq_get_rset(mc->text));
-					}
-				}
-			} else {
-				if (pipelining){
-					bgpq_pipeline(b, NULL, NULL, "!s%s\n",
-						b->defaultsources);
-					if (b->family == AF_INET)
-						bgpq_pipeline(b, bgpq_expanded_prefix,
-							NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
-					else
-						bgpq_pipeline(b, bgpq_expanded_v6prefix,
-							NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
-				} else {
-					bgpq_expand_irrd(b, NULL, NULL, "!s%s\n",
-						b->defaultsources);
-					if (b->family == AF_INET)
-						bgpq_expand_irrd(b, bgpq_expanded_prefix,
-							NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
-					else
-						bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
-							NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
-				}
-			}
+void
+bgpq_expand_close(struct bgpq_expander *b)
+{
+	struct bgpq_source	*src;
+	unsigned int		 i;
+	int			 fd, ret;
+
+	for (i = 0; i < b->nsessions; i++) {
+		/* not connected yet */
+		if (b->sessions[i].addrs != NULL) {
+			sx_event_del(b->events, b->sessions[i].fd);
+			close(b->sessions[i].fd);
+			b->sessions[i].fd = -1;
+			freeaddrinfo(b->sessions[i].addrs);
 		}
-
-		RB_FOREACH(asne, asn_tree, &b->asnlist) {
-			if (b->family == AF_INET6) {
-				if (!pipelining) {
-					bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
-					    NULL, "!6as%" PRIu32 "\n", asne->asn);
-				} else {
-					bgpq_pipeline(b, bgpq_expanded_v6prefix,
-					    NULL, "!6as%" PRIu32 "\n", asne->asn);
-				}
-			} else {
-				if (!pipelining) {
-					bgpq_expand_irrd(b, bgpq_expanded_prefix,
-					    NULL, "!gas%" PRIu32 "\n", asne->asn);
-				} else {
-					bgpq_pipeline(b, bgpq_expanded_prefix,
-					    NULL, "!gas%" PRIu32 "\n", asne->asn);
-				}
+		/* offline sessions have no connection */
+		if ((fd = b->sessions[i].fd) != -1) {
+			sx_event_del(b->events, fd);
+
+			if ((ret = write(fd, "!q\n", 3)) != 3) {
+				sx_report(SX_ERROR, "Partial write of quit to "
+				    "IRRd: %i bytes, %s\n", ret,
+				    strerror(errno));
+				// not worth exiting due to this
 			}
-		}
 
-		if (pipelining) {
-			if (!STAILQ_EMPTY(&b->wq))
-				bgpq_write(b);
-			if (!STAILQ_EMPTY(&b->rq))
-				bgpq_read(b);
-		}
-	}
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
-	if ((ret = write(fd, "!q\n", 3)) != 3) {
-		sx_report(SX_ERROR, "Partial write of quit to IRRd: %i bytes, %s\n",
-		    ret, strerror(errno));
-		// not worth exiting due to this
-	}
-	if (pipelining) {
-		int fl = fcntl(fd, F_GETFL);
-		fl &= ~O_NONBLOCK;
-		fcntl(fd, F_SETFL, fl);
+			close(fd);
+		}
+		free(b->sessions[i].buf);
+		while ((src = STAILQ_FIRST(&b->sessions[i].sources)) != NULL) {
+			STAILQ_REMOVE_HEAD(&b->sessions[i].sources, entry);
+			free(src->name);
+			free(src);
+		}
 	}
 
-	close(fd);
+	free(b->sessions);
+	b->sessions = NULL;
 	free(b->defaultsources);
+	b->defaultsources = NULL;
 
-	return 1;
+	sx_event_free(b->events);
+	b->events = NULL;
 }
 
-void
-sx_radix_node_freeall(struct sx_radix_node *n)
+int
+bgpq_expand(struct bgpq_expander *b)
 {
-	if (n->l != NULL)
-		sx_radix_node_freeall(n->l);
+	int	aquery;
+
+	aquery = bgpq_expand_open(b, bgpq_expand_aquery(b));
 
-	if (n->r != NULL)
-		sx_radix_node_freeall(n->r);
+	bgpq_expand_start(b, aquery);
 
-	if (n->son != NULL)
-		sx_radix_node_freeall(n->son);
+	bgpq_read(b);
 
-	if (n->payload)
-		free(n->payload);
+	bgpq_expand_finish(b);
+	bgpq_expand_close(b);
+
+	/* no filter rather than one missing what IRRd did not send */
+	return !b->unreachable;
+}
+
+/*
+ * Start expanding job j over the sessions and the shared replies of b.
+ */
+void
+bgpq_expand_job(struct bgpq_expander *b, struct bgpq_job *j, int aquery)
+{
+	struct bgpq_expander	*jb = &j->expander;
+
+	jb->sessions = b->sessions;
+	jb->nsessions = b->nsessions;
+	jb->nextsession = 0;
+	jb->server = b->server;
+	jb->port = b->port;
+	jb->cachedir = b->cachedir;
+	jb->cachettl = b->cachettl;
+	jb->cachenegttl = b->cachenegttl;
+	jb->graphttl = b->graphttl;
+	jb->rpsl = b->rpsl;
+	jb->replies = b->replies;
+
+	if (jb->rpsl && jb->sources && jb->sources[0] != 0)
+		bgpq_rpsl_check_sources(jb->rpsl, jb->sources);
+
+	if (jb->usesource && jb->sources && jb->sources[0] != 0)
+		jb->defaultsources = strdup(jb->sources);
+	else
+		jb->defaultsources = strdup(b->defaultsources);
+	if (jb->defaultsources == NULL)
+		err(1, NULL);
 
-	sx_prefix_free(n->prefix);
+	SX_DEBUG(debug_expander, "batch: starting job %u\n", j->line);
 
-	free(n);
+	bgpq_expand_start(jb, aquery && bgpq_expand_aquery(jb));
 }
 
+/*
+ * Job j is expanded, detach it from the sessions and replies.
+ */
 void
-sx_radix_tree_freeall(struct sx_radix_tree *t)
+bgpq_expand_job_done(struct bgpq_job *j)
 {
-	if (t->head != NULL)
-		sx_radix_node_freeall(t->head);
+	struct bgpq_expander	*jb = &j->expander;
+
+	bgpq_expand_finish(jb);
 
-	free(t);
+	/* all of these are shared */
+	jb->sessions = NULL;
+	jb->nsessions = 0;
+	jb->rpsl = NULL;
+	jb->replies = NULL;
+
+	free(jb->defaultsources);
+	jb->defaultsources = NULL;
+
+	SX_DEBUG(debug_expander, "batch: job %u done\n", j->line);
 }
 
-/* XXX: needs cleaning up / figuring out */
+/*
+ * Expand the jobs over the sessions of b, up to BGPQ_BATCH_JOBS at the
+ * same time.  Queries of all running jobs share the pipeline, and every
+ * query is sent only once for the whole batch.  Jobs are passed to done
+ * as soon as they are expanded.
+ */
 void
-bgpq_prequest_freeall(struct bgpq_prequest *bpr)
+bgpq_expand_batch(struct bgpq_expander *b, struct bgpq_jobs *jobs,
+    void (*done)(struct bgpq_job *))
 {
+	struct bgpq_replies	 replies = RB_INITIALIZER(&replies);
+	struct bgpq_jobs	 running = STAILQ_HEAD_INITIALIZER(running);
+	struct bgpq_job		*j, *next;
+	unsigned int		 nrunning = 0;
+	int			 aquery, probe = 0, rval = 1, busy;
+
+	STAILQ_FOREACH(j, jobs, entry) {
+		if (bgpq_expand_aquery(&j->expander))
+			probe = 1;
+	}
+
+	aquery = bgpq_expand_open(b, probe);
+
+	b->replies = &replies;
+
+	for (;;) {
+		while (nrunning < BGPQ_BATCH_JOBS &&
+		    (j = STAILQ_FIRST(jobs)) != NULL) {
+			STAILQ_REMOVE_HEAD(jobs, entry);
+			STAILQ_INSERT_TAIL(&running, j, entry);
+			nrunning++;
+			bgpq_expand_job(b, j, aquery);
+		}
+
+		if (nrunning == 0)
+			break;
+
+		busy = bgpq_poll(b, &rval);
+
+		for (j = STAILQ_FIRST(&running); j != NULL; j = next) {
+			next = STAILQ_NEXT(j, entry);
+			if (busy && j->expander.piped > 0)
+				continue;
+			STAILQ_REMOVE(&running, j, bgpq_job, entry);
+			nrunning--;
+			bgpq_expand_job_done(j);
+			if (j->expander.unreachable)
+				b->unreachable = 1;
+			done(j);
+		}
+	}
+
+	bgpq_reply_freeall(&replies);
+	b->replies = NULL;
+
+	bgpq_expand_close(b);
 }
 
 void
 expander_freeall(struct bgpq_expander *expander)
 {
-	struct sx_tentry	*var, *nxt;
-	struct asn_entry	*asne, *asne_next;
-
 	while (!STAILQ_EMPTY(&expander->macroses)) {
 		struct slentry *n1 = STAILQ_FIRST(&expander->macroses);
 		STAILQ_REMOVE_HEAD(&expander->macroses, entry);
@@ -1438,29 +2557,19 @@ expander_freeall(struct bgpq_expander *expander)
 		free(n1);
 	}
 
-	for (var = RB_MIN(tentree, &expander->already); var != NULL; var = nxt) {
-		nxt = RB_NEXT(tentree, &expander->already, var);
-		RB_REMOVE(tentree, &expander->already, var);
-		free(var->text);
-		free(var);
-	}
-
-	for (var = RB_MIN(tentree, &expander->stoplist); var != NULL; var = nxt) {
-		nxt = RB_NEXT(tentree, &expander->stoplist, var);
-		RB_REMOVE(tentree, &expander->stoplist, var);
-		free(var->text);
-		free(var);
+	while (!STAILQ_EMPTY(&expander->dumps)) {
+		struct slentry *n1 = STAILQ_FIRST(&expander->dumps);
+		STAILQ_REMOVE_HEAD(&expander->dumps, entry);
+		free(n1->text);
+		free(n1);
 	}
 
-	for (asne = RB_MIN(asn_tree, &expander->asnlist);
-	    asne != NULL; asne = asne_next) {
-		asne_next = RB_NEXT(asn_tree, &expander->asnlist, asne);
-		RB_REMOVE(asn_tree, &expander->asnlist, asne);
-		free(asne);
-	}
+	bgpq_rpsl_free(expander->rpsl);
 
-	sx_radix_tree_freeall(expander->tree);
+	sx_names_clear(&expander->names);
+	sx_asnset_clear(&expander->asnlist);
+	sx_asnset_clear(&expander->stopasns);
 
-	bgpq_prequest_freeall(expander->firstpipe);
-	bgpq_prequest_freeall(expander->lastpipe);
+	sx_radix_tree_free(expander->tree);
+	free(expander->prefixes);
 }
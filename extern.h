@@ -27,6 +27,9 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 
+#include "sx_asnset.h"
+#include "sx_event.h"
+#include "sx_names.h"
 #include "sx_prefix.h"
 
 struct slentry {
@@ -36,18 +39,6 @@ struct slentry {
 
 struct slentry		*sx_slentry_new(char *text);
 
-struct sx_tentry {
-	RB_ENTRY(sx_tentry)	 entry;
-	char			*text;
-};
-
-struct sx_tentry	*sx_tentry_new(char *text);
-
-struct asn_entry {
-	RB_ENTRY(asn_entry)	entry;
-	uint32_t		asn;
-};
-
 typedef enum {
 	V_CISCO = 0,
 	V_JUNIPER,
@@ -77,6 +68,9 @@ typedef enum {
 } bgpq_gen_t;
 
 struct bgpq_expander;
+struct bgpq_rpsl;
+
+struct bgpq_reply;
 
 struct request {
 	STAILQ_ENTRY(request)	 next;
@@ -86,10 +80,79 @@ struct request {
 	unsigned int	 	 depth;
 	int	 	 	 (*callback)(char *, struct bgpq_expander *,
 				    struct request *);
+	struct bgpq_expander	*expander;
+	struct bgpq_source	*source;
+	struct bgpq_reply	*reply;
+	struct bgpq_reply	*graph;		/* member sets of a walk */
+	char			*cachekey;
+	FILE			*cachef;
+	char			*cachetmp;
+	char			*cached;
+	size_t			 cachedlen;
+	char			 cachedstatus;
+	double			 sent;
+};
+
+STAILQ_HEAD(requests, request);
+
+/* sources of a session, with the queries waiting to be sent to them */
+struct bgpq_source {
+	STAILQ_ENTRY(bgpq_source)	 entry;
+	char				*name;
+	struct requests			 q;
+};
+
+STAILQ_HEAD(bgpq_sources, bgpq_source);
+
+/*
+ * Replies shared by the jobs of a batch or a daemon, so every query is
+ * sent to the server only once per cache ttl.  Requests made while the
+ * reply is still underway wait for it.
+ */
+struct bgpq_reply {
+	RB_ENTRY(bgpq_reply)	 entry;
+	char			*key;
+	char			 status;	/* 0 while underway */
+	time_t			 expires;
+	char			*data;
+	size_t			 len, size;
+	struct requests		 waiting;
+};
+
+RB_HEAD(bgpq_replies, bgpq_reply);
+
+typedef enum {
+	R_STATUS = 0,
+	R_DATA,
+	R_FINAL
+} bgpq_rstate_t;
+
+struct bgpq_session {
+	struct bgpq_expander	*expander;	/* the sessions belong to */
+	int			 fd;
+	struct addrinfo		*addrs, *addr;	/* while connecting */
+	char			*buf;
+	size_t			 bufsize, buflen, bufpos;
+	bgpq_rstate_t		 state;
+	unsigned long		 remain;
+	struct bgpq_sources	 sources;
+	struct bgpq_source	*source;	/* of the queries to come */
+	struct bgpq_source	*wire;		/* in effect at the server */
+	unsigned int		 waiting;	/* queries in sources */
+	struct requests		 wq, rq, cq;
+	struct sx_event		*ev;
+	int			 events;	/* watched for */
+	int			 failed;	/* a reply could not be parsed */
+	unsigned int		 retries;	/* reconnects without a reply */
+	unsigned int		 inflight;	/* requests in rq */
+	double			 window, windowmax, ssthresh;
+	double			 rttmin, backoff;
 };
 
 struct bgpq_expander {
 	struct sx_radix_tree	 	*tree;
+	struct sx_prefix		*prefixes;
+	size_t				 nprefixes, prefixessize;
 	int			 	 family;
 	char				*sources;
 	char				*defaultsources;
@@ -102,28 +165,74 @@ struct bgpq_expander {
 	int			 	 identify;
 	int			 	 sequence;
 	unsigned int		 	 maxdepth;
-	unsigned int		 	 cdepth;
 	int			 	 validate_asns;
-	struct bgpq_prequest		*firstpipe, *lastpipe;
 	int 			 	 piped;
+	int				 unreachable;	/* queries given up */
 	char				*match;
 	char				*server;
 	char				*port;
 	char				*format;
 	unsigned int		 	 maxlen;
-	int			 	 fd;
-	RB_HEAD(asn_tree, asn_entry)	 asnlist;
-	STAILQ_HEAD(requests, request)	 wq, rq;
-	STAILQ_HEAD(slentries, slentry)	 macroses, rsets;
-	RB_HEAD(tentree, sx_tentry)	 already, stoplist;
+	struct bgpq_session		*sessions;
+	unsigned int			 nsessions, nextsession;
+	unsigned int			 window;
+	struct sx_event			*events;
+	char				*cachedir;
+	unsigned int			 cachettl, cachenegttl, graphttl;
+	struct bgpq_replies		*replies;
+	struct bgpq_rpsl		*rpsl;
+	struct sx_asnset		 asnlist, stopasns;
+	STAILQ_HEAD(slentries, slentry)	 macroses, rsets, dumps;
+	struct sx_names			 names;	/* sets seen */
+	unsigned int			 nstopped;
+};
+
+/* jobs of a batch expanded at the same time */
+#define BGPQ_BATCH_JOBS	32
+
+/*
+ * Requests in flight per session, to begin with and at most (-q), and
+ * the delay in seconds replies may take beyond twice the fastest one
+ * before the window shrinks.
+ */
+#define BGPQ_WINDOW_INIT	4
+#define BGPQ_WINDOW_MAX		256
+#define BGPQ_WINDOW_SLACK	0.005
+
+/* requests gathered into a single write */
+#define BGPQ_WRITE_IOV		128
+
+/* reconnects of a session before its queries are given up */
+#define BGPQ_RETRIES		3
+
+#define OPTIONS		"467a:AbBc:C:dDEeF:S:i:I:jJk:Kf:l:L:m:M:NnOo:pW:r:R:" \
+			"G:H:q:tTh:UuwXsvx:y:zZ:"
+
+/* options that apply to a whole batch (-x) or daemon (-Z), not to jobs */
+#define GLOBAL_OPTIONS	"cCdhikpqTvxyZ"
+
+/* one filter of a batch (-x), or the only one otherwise */
+struct bgpq_job {
+	STAILQ_ENTRY(bgpq_job)		 entry;
+	struct bgpq_expander		 expander;
+	char				*output;
+	unsigned int			 line;
+	int				 aggregate, optimal;
+	unsigned int			 refine, refineLow;
+	unsigned long			 maxlen;
+	int				 selectedipv4, widthSet;
+	char				*snapshotin, *snapshotout;
+	char				*args;
+	char				**argv;
+	int				 client;	/* of a daemon */
 };
 
-int asn_cmp(struct asn_entry *, struct asn_entry *);
-RB_PROTOTYPE(asn_tree, asn_entry, entry, asn_cmp);
+STAILQ_HEAD(bgpq_jobs, bgpq_job);
 
 int bgpq_expander_init(struct bgpq_expander *b, int af);
 int bgpq_expander_add_asset(struct bgpq_expander *b, char *set);
 int bgpq_expander_add_rset(struct bgpq_expander *b, char *set);
+int bgpq_expander_add_dump(struct bgpq_expander *b, char *file);
 int bgpq_expander_add_as(struct bgpq_expander *b, char *as);
 int bgpq_expander_add_prefix(struct bgpq_expander *b, char *prefix);
 int bgpq_expander_add_prefix_range(struct bgpq_expander *b, char *prefix);
@@ -131,9 +240,61 @@ int bgpq_expander_add_stop(struct bgpq_expander *b, char *object);
 
 char* bgpq_get_asset(char *object);
 char* bgpq_get_rset(char *object);
-char* bgpq_get_source(char *object);
+char* bgpq_get_source(char *object, char *buf, size_t len);
 
 int bgpq_expand(struct bgpq_expander *b);
+int bgpq_expand_open(struct bgpq_expander *b, int probe);
+void bgpq_expand_close(struct bgpq_expander *b);
+void bgpq_expand_job(struct bgpq_expander *b, struct bgpq_job *j, int aquery);
+void bgpq_expand_job_done(struct bgpq_job *j);
+int bgpq_expand_replay(struct bgpq_expander *b);
+int bgpq_expand_watch(struct bgpq_expander *b, int idle, int *rval);
+void bgpq_expand_batch(struct bgpq_expander *b, struct bgpq_jobs *jobs,
+    void (*done)(struct bgpq_job *));
+void bgpq_reply_expire(struct bgpq_replies *replies);
+void bgpq_reply_freeall(struct bgpq_replies *replies);
+
+struct bgpq_job *bgpq_job_new(char *line, size_t len);
+int bgpq_job_parse(struct bgpq_job *j, struct bgpq_expander *m, int output);
+int bgpq_job_option(struct bgpq_job *j, int c, char *arg);
+void bgpq_job_check(struct bgpq_job *j);
+void bgpq_job_objects(struct bgpq_job *j, int argc, char **argv);
+void bgpq_job_render(struct bgpq_job *j, FILE *f);
+void bgpq_job_write(struct bgpq_job *j);
+void bgpq_job_free(struct bgpq_job *j);
+void bgpq_jobs_read(struct bgpq_jobs *jobs, const char *file,
+    struct bgpq_expander *m);
+
+void bgpq_daemon(struct bgpq_expander *b, const char *path);
+
+void bgpq_cache_init(struct bgpq_expander *b);
+int bgpq_cache_query(const char *query);
+char *bgpq_cache_key(struct bgpq_expander *b, const char *sources,
+    const char *query);
+int bgpq_cache_lookup(struct bgpq_expander *b, struct request *req);
+void bgpq_cache_begin(struct bgpq_expander *b, struct request *req,
+    char status);
+void bgpq_cache_token(struct request *req, const char *token);
+void bgpq_cache_commit(struct bgpq_expander *b, struct request *req);
+void bgpq_cache_abort(struct request *req);
+int bgpq_cache_caps_lookup(struct bgpq_expander *b, int *aquery,
+    char **sources);
+void bgpq_cache_caps_store(struct bgpq_expander *b, int aquery,
+    const char *sources);
+char *bgpq_cache_graph_lookup(struct bgpq_expander *b, const char *key,
+    size_t *len);
+void bgpq_cache_graph_store(struct bgpq_expander *b, const char *key,
+    const char *members, size_t len);
+
+struct bgpq_rpsl *bgpq_rpsl_load(struct slentries *files);
+char *bgpq_rpsl_sources(struct bgpq_rpsl *r);
+void bgpq_rpsl_check_sources(struct bgpq_rpsl *r, const char *sources);
+void bgpq_rpsl_query(struct bgpq_rpsl *r, const char *sources,
+    struct request *req);
+void bgpq_rpsl_free(struct bgpq_rpsl *r);
+
+void bgpq_snapshot_write(struct bgpq_expander *b, const char *path);
+void bgpq_snapshot_read(struct bgpq_expander *b, const char *path);
 
 void bgpq4_print_prefixlist(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_eacl(FILE *f, struct bgpq_expander *b);
@@ -143,9 +304,6 @@ void bgpq4_print_oaspath(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_aslist(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_route_filter_list(FILE *f, struct bgpq_expander *b);
 
-void sx_radix_node_freeall(struct sx_radix_node *n);
-void sx_radix_tree_freeall(struct sx_radix_tree *t);
-void bgpq_prequest_freeall(struct bgpq_prequest *bpr);
 void expander_freeall(struct bgpq_expander *expander);
 
 /* s - number of opened socket, dir is either SO_SNDBUF or SO_RCVBUF */
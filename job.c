@@ -0,0 +1,989 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <limits.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+extern int debug_expander;
+extern int debug_aggregation;
+
+#ifdef HAVE_PTHREAD_H
+/* the printers keep state in static variables */
+static pthread_mutex_t printlock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+exclusive(void)
+{
+	sx_report(SX_FATAL, "-E, -F, -K , -f <asnum>, -G <asnum>, and -t are "
+	    "mutually exclusive\n");
+}
+
+static void
+vendor_exclusive(void)
+{
+	sx_report(SX_FATAL, "-b (BIRD), -B (OpenBGPD), -F (formatted), -J (Junos),"
+	    " -j (JSON), -K[7] (Microtik ROS), -N (Nokia SR OS Classic),"
+	    " -n (Nokia SR OS MD-CLI), -U (Huawei), -u (Huawei XPL),"
+	    "-e (Arista) and -X (IOS XR) options are mutually exclusive\n");
+}
+
+static int
+parseasnumber(struct bgpq_expander *expander, char *asnstr)
+{
+	char	*eon = NULL;
+
+	expander->asnumber = strtoul(asnstr, &eon, 10);
+	if (expander->asnumber < 1 || expander->asnumber > (65535ul * 65535)) {
+		sx_report(SX_FATAL, "Invalid AS number: %s\n", asnstr);
+		exit(1);
+	}
+	if (eon && *eon == '.') {
+		/* -f 3.3, for example */
+		uint32_t loas = strtoul(eon + 1, &eon, 10);
+		if (expander->asnumber > 65535) {
+			/* should prevent incorrect numbers like 65537.1 */
+			sx_report(SX_FATAL,"Invalid AS number: %s\n", asnstr);
+			exit(1);
+		}
+		if (loas < 1 || loas > 65535) {
+			sx_report(SX_FATAL,"Invalid AS number: %s\n", asnstr);
+			exit(1);
+		}
+		if (eon && *eon) {
+			sx_report(SX_FATAL,"Invalid symbol in AS number: "
+			    "%c (%s)\n", *eon, asnstr);
+			exit(1);
+		}
+		expander->asnumber=(expander->asnumber << 16) + loas;
+	} else if (eon && *eon) {
+		sx_report(SX_FATAL,"Invalid symbol in AS number: %c (%s)\n",
+			*eon, asnstr);
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Options describing the filter to generate, as opposed to the ones
+ * saying where to get the data from.  Returns 0 for options it does not
+ * know about.
+ */
+int
+bgpq_job_option(struct bgpq_job *j, int c, char *arg)
+{
+	switch (c) {
+	case '4':
+		/* do nothing, expander already configured for IPv4 */
+		if (j->expander.family == AF_INET6) {
+			sx_report(SX_FATAL, "-4 and -6 are mutually "
+			    "exclusive\n");
+			exit(1);
+		}
+		j->selectedipv4 = 1;
+		break;
+	case '6':
+		if (j->selectedipv4) {
+			sx_report(SX_FATAL, "-4 and -6 are mutually "
+			    "exclusive\n");
+			exit(1);
+		}
+		j->expander.family = AF_INET6;
+		j->expander.tree->family = AF_INET6;
+		break;
+	case '7':
+		if (j->expander.vendor != V_MIKROTIK6) {
+			sx_report(SX_FATAL, "'7' can only be used after -K\n");
+			exit(1);
+		}
+		j->expander.vendor = V_MIKROTIK7;
+		break;
+	case 'a':
+		parseasnumber(&j->expander, arg);
+		break;
+	case 'A':
+		if (j->aggregate)
+			debug_aggregation++;
+		j->aggregate = 1;
+		break;
+	case 'b':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_BIRD;
+		break;
+	case 'B':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_OPENBGPD;
+		break;
+	case 'E':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_EACL;
+		break;
+	case 'e':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_ARISTA;
+		j->expander.sequence = 1;
+		break;
+	case 'F':
+		if (j->expander.vendor)
+			exclusive();
+		j->expander.vendor = V_FORMAT;
+		j->expander.format = arg;
+		break;
+	case 'f':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_ASPATH;
+		parseasnumber(&j->expander, arg);
+		break;
+	case 'G':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_OASPATH;
+		parseasnumber(&j->expander, arg);
+		break;
+	case 'H':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_ASLIST;
+		parseasnumber(&j->expander, arg);
+		break;
+	case 'I':
+		j->snapshotin = arg;
+		break;
+	case 'J':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_JUNIPER;
+		break;
+	case 'j':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_JSON;
+		break;
+	case 'K':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_MIKROTIK6;
+		break;
+	case 'r':
+		j->refineLow = strtoul(arg, NULL, 10);
+		if (!j->refineLow) {
+			sx_report(SX_FATAL, "Invalid refineLow value:"
+			    " %s\n", arg);
+			exit(1);
+		}
+		break;
+	case 'R':
+		j->refine = strtoul(arg, NULL, 10);
+		if (!j->refine) {
+			sx_report(SX_FATAL,"Invalid refine length:"
+			    " %s\n", arg);
+			exit(1);
+		}
+		break;
+	case 'l':
+		j->expander.name = arg;
+		break;
+	case 'L':
+		j->expander.maxdepth = strtol(arg, NULL, 10);
+		if (j->expander.maxdepth < 1) {
+			sx_report(SX_FATAL, "Invalid maximum recursion"
+			    " (-L): %s\n", arg);
+			exit(1);
+		}
+		break;
+	case 'm':
+		j->maxlen=strtoul(arg, NULL, 10);
+		if (!j->maxlen) {
+			sx_report(SX_FATAL, "Invalid maxlen (-m): %s\n",
+			    arg);
+			exit(1);
+		}
+		break;
+	case 'M':
+		{
+			char	*mc, *md;
+			j->expander.match = strdup(arg);
+			mc = md = j->expander.match;
+			while (*mc) {
+				if (*mc == '\\') {
+					if (*(mc + 1) == '\n') {
+						*md = '\n';
+						md++;
+						mc += 2;
+					} else if (*(mc + 1) == 'r') {
+						*md = '\r';
+						md++;
+						mc += 2;
+					} else if (*(mc + 1) == 't') {
+						*md = '\t';
+						md++;
+						mc += 2;
+					} else if (*(mc + 1) == '\\') {
+						*md = '\\';
+						md++;
+						mc += 2;
+					} else {
+						sx_report(SX_FATAL, "Unsupported"
+						    " escape \%c (0x%2.2x) in "
+						    "'%s'\n",
+						    isprint(*mc) ? *mc : 20,
+						    *mc, arg);
+						exit(1);
+					}
+				} else {
+					if (mc != md) {
+						*md = *mc;
+					}
+					md++;
+					mc++;
+				}
+			}
+			*md = 0;
+		}
+		break;
+	case 'N':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_NOKIA;
+		break;
+	case 'n':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_NOKIA_MD;
+		break;
+	case 'O':
+		j->optimal = 1;
+		break;
+	case 'o':
+		j->snapshotout = arg;
+		break;
+	case 't':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_ASSET;
+		break;
+	case 's':
+		j->expander.sequence = 1;
+		break;
+	case 'S':
+		j->expander.sources = arg;
+		break;
+	case 'U':
+		if (j->expander.vendor)
+			exclusive();
+		j->expander.vendor = V_HUAWEI;
+		break;
+	case 'u':
+		if (j->expander.vendor)
+			exclusive();
+		j->expander.vendor = V_HUAWEI_XPL;
+		break;
+	case 'W':
+		j->expander.aswidth = atoi(arg);
+		if (j->expander.aswidth < 0) {
+			sx_report(SX_FATAL,"Invalid as-width: %s\n", arg);
+			exit(1);
+		}
+		j->widthSet = 1;
+		break;
+	case 'w':
+		j->expander.validate_asns = 1;
+		break;
+	case 'X':
+		if (j->expander.vendor)
+			vendor_exclusive();
+		j->expander.vendor = V_CISCO_XR;
+		break;
+	case 'z':
+		if (j->expander.generation)
+			exclusive();
+		j->expander.generation = T_ROUTE_FILTER_LIST;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Fill in the defaults and refuse combinations that make no sense, once
+ * all options of a job are known.
+ */
+void
+bgpq_job_check(struct bgpq_job *j)
+{
+	struct bgpq_expander	*b = &j->expander;
+
+	if (j->optimal)
+		j->aggregate = 1;
+
+	if (!j->widthSet) {
+		if (b->generation == T_ASPATH) {
+			int vendor = b->vendor;
+			switch (vendor) {
+			case V_ARISTA:
+			case V_CISCO:
+			case V_MIKROTIK6:
+			case V_MIKROTIK7:
+				b->aswidth = 4;
+				break;
+			case V_CISCO_XR:
+				b->aswidth = 6;
+				break;
+			case V_JUNIPER:
+			case V_NOKIA:
+			case V_NOKIA_MD:
+				b->aswidth = 8;
+				break;
+			case V_BIRD:
+				b->aswidth = 10;
+				break;
+			}
+		} else if (b->generation == T_OASPATH) {
+			int vendor = b->vendor;
+			switch (vendor) {
+			case V_ARISTA:
+			case V_CISCO:
+				b->aswidth = 5;
+				break;
+			case V_CISCO_XR:
+				b->aswidth = 7;
+				break;
+			case V_JUNIPER:
+			case V_NOKIA:
+			case V_NOKIA_MD:
+				b->aswidth = 8;
+				break;
+			}
+		} else if (b->generation == T_ASLIST) {
+			int vendor = b->vendor;
+			switch (vendor) {
+			case V_JUNIPER:
+				b->aswidth = 8;
+				break;
+			}
+		}
+	}
+
+	if (!b->generation)
+		b->generation = T_PREFIXLIST;
+
+	if (b->vendor == V_CISCO_XR
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_OASPATH) {
+		sx_report(SX_FATAL, "Sorry, only prefix-sets and as-paths "
+		    "supported for IOS XR\n");
+	}
+	if (b->vendor == V_BIRD
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_ASSET) {
+		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
+		    "supported for BIRD output\n");
+	}
+	if (b->vendor == V_JSON
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_ASSET) {
+		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
+		    "supported for JSON output\n");
+	}
+
+	if (b->vendor == V_FORMAT
+	    && b->generation != T_PREFIXLIST)
+		sx_report(SX_FATAL, "Sorry, only prefix-lists supported in formatted "
+		    "output\n");
+
+	if (b->vendor == V_HUAWEI
+	    && b->generation != T_ASPATH
+	    && b->generation != T_OASPATH
+	    && b->generation != T_PREFIXLIST)
+		sx_report(SX_FATAL, "Sorry, only as-paths and prefix-lists supported "
+		    "for Huawei output\n");
+
+	if (b->generation == T_ROUTE_FILTER_LIST
+	    && b->vendor != V_JUNIPER)
+		sx_report(SX_FATAL, "Route-filter-lists (-z) supported for Juniper (-J)"
+		    " output only\n");
+
+	if (b->generation == T_ASSET
+	    && b->vendor != V_JSON
+	    && b->vendor != V_OPENBGPD
+	    && b->vendor != V_BIRD)
+		sx_report(SX_FATAL, "As-Sets (-t) supported for JSON (-j), OpenBGPD "
+		    "(-B) and BIRD (-b) output only\n");
+
+	if (b->generation == T_ASLIST
+	    && b->vendor != V_JUNIPER)
+		sx_report(SX_FATAL, "As-lists (-H) supported for Juniper (-J) "
+		    "output only\n");
+
+	if ((b->vendor == V_MIKROTIK6 || b->vendor == V_MIKROTIK7)
+	    && b->generation != T_PREFIXLIST)
+		sx_report(SX_FATAL, "Sorry, only prefix-lists supported for "
+		    "MikroTik output\n");
+
+	if (b->generation == T_OASPATH
+	    && (b->vendor == V_JSON || b->vendor == V_BIRD))
+		sx_report(SX_FATAL, "Sorry, output as-paths (-G) not supported "
+		    "for JSON and BIRD output\n");
+
+	if (b->generation == T_EACL
+	    && b->vendor == V_HUAWEI_XPL)
+		sx_report(SX_FATAL, "Sorry, route-filters (-E) not supported "
+		    "for Huawei XPL output\n");
+
+	if (j->aggregate
+	    && b->vendor == V_JUNIPER
+	    && b->generation == T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, aggregation (-A) does not work in"
+		    " Juniper prefix-lists\nYou can try route-filters (-E) "
+		    "or route-filter-lists (-z) instead of prefix-lists\n.");
+		exit(1);
+	}
+
+	if (j->aggregate
+	    && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA)
+	    && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, aggregation (-A) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (j->refine
+	    && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA)
+	    && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, more-specifics (-R) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (j->refineLow
+	     && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA)
+	     && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, more-specifics (-r) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (j->aggregate && b->generation < T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, aggregation (-A) used only for prefix-"
+		    "lists, extended access-lists and route-filters\n");
+		exit(1);
+	}
+
+	if (b->sequence
+	    && (b->vendor != V_CISCO && b->vendor != V_ARISTA)) {
+		sx_report(SX_FATAL, "Sorry, prefix-lists sequencing (-s) supported"
+		    " only for IOS and EOS\n");
+		exit(1);
+	}
+
+	if (b->sequence && b->generation < T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, prefix-lists sequencing (-s) can't be "
+		    " used for non prefix-list\n");
+		exit(1);
+	}
+
+	if (j->refineLow && !j->refine) {
+		if (b->family == AF_INET)
+			j->refine = 32;
+		else
+			j->refine = 128;
+	}
+
+	if (j->refineLow && j->refineLow > j->refine)
+		sx_report(SX_FATAL, "Incompatible values for -r %u and -R %u\n",
+		    j->refineLow, j->refine);
+
+	if (j->refine || j->refineLow) {
+		if (b->family == AF_INET6 && j->refine > 128) {
+			sx_report(SX_FATAL, "Invalid value for refine(-R): %u (1-128 for"
+			    " IPv6)\n", j->refine);
+		} else if (b->family == AF_INET6 && j->refineLow > 128) {
+			sx_report(SX_FATAL, "Invalid value for refineLow(-r): %u (1-128 for"
+			    " IPv6)\n", j->refineLow);
+		} else if (b->family == AF_INET && j->refine > 32) {
+			sx_report(SX_FATAL, "Invalid value for refine(-R): %u (1-32 for"
+			    " IPv4)\n", j->refine);
+		} else if (b->family == AF_INET && j->refineLow > 32) {
+			sx_report(SX_FATAL, "Invalid value for refineLow(-r): %u (1-32 for"
+			    " IPv4)\n", j->refineLow);
+		}
+
+		if (b->vendor == V_JUNIPER && b->generation == T_PREFIXLIST) {
+			if (j->refine) {
+				sx_report(SX_FATAL, "Sorry, more-specific filters (-R %u) "
+				    "is not supported for Juniper prefix-lists.\n"
+				    "Use router-filters (-E) or route-filter-lists (-z) "
+				    "instead\n", j->refine);
+			} else {
+				sx_report(SX_FATAL, "Sorry, more-specific filters (-r %u) "
+				    "is not supported for Juniper prefix-lists.\n"
+				    "Use route-filters (-E) or route-filter-lists (-z) "
+				    "instead\n", j->refineLow);
+			}
+		}
+
+		if (b->generation < T_PREFIXLIST) {
+			if (j->refine)
+				sx_report(SX_FATAL, "Sorry, more-specific filter (-R %u) "
+				    "supported only with prefix-list generation\n", j->refine);
+			else
+				sx_report(SX_FATAL, "Sorry, more-specific filter (-r %u) "
+				    "supported only with prefix-list generation\n", j->refineLow);
+		}
+	}
+
+	if (j->maxlen) {
+		if ((b->family == AF_INET6 && j->maxlen > 128)
+		   || (b->family == AF_INET && j->maxlen > 32)) {
+			sx_report(SX_FATAL, "Invalid value for max-prefixlen: %lu (1-128 "
+			    "for IPv6, 1-32 for IPv4)\n", j->maxlen);
+			exit(1);
+		} else if ((b->family == AF_INET6 && j->maxlen < 128)
+		    || (b->family == AF_INET  && j->maxlen < 32)) {
+			/*
+			 * inet6/128 and inet4/32 does not make sense - all
+			 * routes will be accepted, so save some CPU cycles :)
+			 */
+			b->maxlen = j->maxlen;
+		}
+	} else if (b->family == AF_INET)
+		b->maxlen = 32;
+	else if (b->family == AF_INET6)
+		b->maxlen = 128;
+
+	if (b->generation == T_EACL && b->vendor == V_CISCO
+	    && b->family == AF_INET6) {
+		sx_report(SX_FATAL,"Sorry, ipv6 access-lists not supported "
+		    "for Cisco yet.\n");
+	}
+
+	if (b->match != NULL
+	    && (b->vendor != V_JUNIPER || b->generation != T_EACL)) {
+		sx_report(SX_FATAL, "Sorry, extra match conditions (-M) can be used "
+		    "only with Juniper route-filters\n");
+	}
+
+	if ((b->generation == T_ASPATH
+	    || b->generation == T_OASPATH
+	    || b->generation == T_ASLIST)
+	    && b->family != AF_INET && !b->validate_asns) {
+		sx_report(SX_FATAL, "Sorry, -6 makes no sense with as-path (-f/-G) or as-list (-H) "
+		    "generation\n");
+	}
+
+	if (b->validate_asns
+	    && b->generation != T_ASPATH
+	    && b->generation != T_OASPATH
+	    && b->generation != T_ASLIST) {
+		sx_report(SX_FATAL, "Sorry, -w makes sense only for as-path "
+		    "(-f/-G) generation\n");
+	}
+}
+
+void
+bgpq_job_objects(struct bgpq_job *j, int argc, char **argv)
+{
+	struct bgpq_expander	*b = &j->expander;
+	int			 exceptmode = 0;
+
+	while (argv[0]) {
+		char *obj = argv[0];
+		char *delim = strstr(argv[0], "::");
+		if (delim) {
+			b->usesource = 1;
+			obj = delim + 2;
+		}
+		if (!strcmp(argv[0], "EXCEPT")) {
+			exceptmode = 1;
+		} else if (exceptmode) {
+			bgpq_expander_add_stop(b, argv[0]);
+		} else if (!strncasecmp(obj, "AS-", 3)) {
+			bgpq_expander_add_asset(b, argv[0]);
+		} else if (!strncasecmp(obj, "RS-", 3)) {
+			bgpq_expander_add_rset(b, argv[0]);
+		} else if (!strncasecmp(obj, "AS", 2)) {
+			char *ec;
+			if ((ec = strchr(obj, ':'))) {
+				if (!strncasecmp(ec + 1, "AS-", 3)) {
+					bgpq_expander_add_asset(b, argv[0]);
+				} else if (!strncasecmp(ec + 1, "RS-", 3)) {
+					bgpq_expander_add_rset(b, argv[0]);
+				} else {
+					SX_DEBUG(debug_expander,"Unknown sub-as"
+					    " object %s\n", argv[0]);
+				}
+			} else {
+				bgpq_expander_add_as(b, argv[0]);
+			}
+		} else {
+			char *ec = strchr(argv[0], '^');
+			if (!ec && !bgpq_expander_add_prefix(b, argv[0])) {
+				sx_report(SX_FATAL, "Unable to add prefix %s "
+				    "(bad prefix or address-family)\n", argv[0]);
+			} else if (ec && !bgpq_expander_add_prefix_range(b,
+				    argv[0])) {
+				sx_report(SX_FATAL, "Unable to add prefix-range "
+				    "%s (bad range or address-family)\n",
+				    argv[0]);
+			}
+		}
+		argv++;
+		argc--;
+	}
+}
+
+void
+bgpq_job_render(struct bgpq_job *j, FILE *f)
+{
+	struct bgpq_expander	*b = &j->expander;
+
+	if (j->snapshotout)
+		bgpq_snapshot_write(b, j->snapshotout);
+
+	if (j->refine)
+		sx_radix_tree_refine(b->tree, j->refine);
+
+	if (j->refineLow)
+		sx_radix_tree_refineLow(b->tree, j->refineLow);
+
+	if (j->optimal)
+		sx_radix_tree_aggregate_optimal(b->tree);
+	else if (j->aggregate)
+		sx_radix_tree_aggregate(b->tree);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&printlock);
+#endif
+
+	switch (b->generation) {
+		case T_NONE:
+			sx_report(SX_FATAL,"Unreachable point");
+			exit(1);
+		case T_ASPATH:
+			bgpq4_print_aspath(f, b);
+			break;
+		case T_OASPATH:
+			bgpq4_print_oaspath(f, b);
+			break;
+		case T_ASLIST:
+			bgpq4_print_aslist(f, b);
+			break;
+		case T_ASSET:
+			bgpq4_print_asset(f, b);
+			break;
+		case T_PREFIXLIST:
+			bgpq4_print_prefixlist(f, b);
+			break;
+		case T_EACL:
+			bgpq4_print_eacl(f, b);
+			break;
+		case T_ROUTE_FILTER_LIST:
+			bgpq4_print_route_filter_list(f, b);
+			break;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&printlock);
+#endif
+}
+
+void
+bgpq_job_free(struct bgpq_job *j)
+{
+	expander_freeall(&j->expander);
+	free(j->expander.match);
+	free(j->args);
+	free(j->argv);
+	free(j);
+}
+
+/*
+ * Write a job of a batch to its output file, which is replaced only
+ * once it is complete.
+ */
+void
+bgpq_job_write(struct bgpq_job *j)
+{
+	char	 tmp[PATH_MAX];
+	FILE	*f;
+	int	 fd, failed;
+
+	/* a filter missing some of the objects is worse than the last one */
+	if (j->expander.unreachable) {
+		sx_report(SX_ERROR, "IRRd could not be reached, %s not "
+		    "written\n", j->output);
+		bgpq_job_free(j);
+		return;
+	}
+
+	if (strcmp(j->output, "-") == 0) {
+		bgpq_job_render(j, stdout);
+		fflush(stdout);
+		bgpq_job_free(j);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", j->output);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		sx_report(SX_FATAL, "Unable to create %s: %s\n", tmp,
+		    strerror(errno));
+
+	/* mkstemp creates the file 0600 */
+	fchmod(fd, 0644);
+
+	if ((f = fdopen(fd, "w")) == NULL)
+		err(1, NULL);
+
+	bgpq_job_render(j, f);
+
+	failed = ferror(f);
+	if (fclose(f) != 0)
+		failed = 1;
+
+	if (failed || rename(tmp, j->output) == -1) {
+		unlink(tmp);
+		sx_report(SX_FATAL, "Unable to write %s: %s\n", j->output,
+		    strerror(errno));
+	}
+
+	SX_DEBUG(debug_expander, "batch: wrote %s\n", j->output);
+
+	bgpq_job_free(j);
+}
+
+/*
+ * Split a job line into words, in place.  Words are separated by blanks
+ * unless quoted, a # at the start of a word begins a comment.  Returns
+ * the number of words or -1 if a quote is left open.
+ */
+static int
+jobsplit(char *line, char **argv)
+{
+	char	*c = line, *d, quote, sep;
+	int	 argc = 0;
+
+	for (;;) {
+		while (isspace((unsigned char)*c))
+			c++;
+		if (*c == '\0' || *c == '#')
+			break;
+
+		argv[argc++] = d = c;
+		quote = 0;
+
+		for (; *c != '\0'; c++) {
+			if (quote) {
+				if (*c == quote) {
+					quote = 0;
+					continue;
+				}
+			} else if (*c == '"' || *c == '\'') {
+				quote = *c;
+				continue;
+			} else if (isspace((unsigned char)*c))
+				break;
+			*d++ = *c;
+		}
+
+		if (quote)
+			return -1;
+
+		sep = *c;
+		*d = '\0';
+		if (sep != '\0')
+			c++;
+	}
+
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+/*
+ * A new job for the words of line, the line is kept with the job.
+ */
+struct bgpq_job *
+bgpq_job_new(char *line, size_t len)
+{
+	struct bgpq_job	*j;
+
+	if ((j = calloc(1, sizeof(struct bgpq_job))) == NULL)
+		err(1, NULL);
+	if ((j->argv = calloc(len / 2 + 3, sizeof(char *))) == NULL)
+		err(1, NULL);
+
+	j->args = line;
+
+	bgpq_expander_init(&j->expander, AF_INET);
+
+	return j;
+}
+
+/*
+ * Parse the words of a job: the output file if output is set, then the
+ * options and objects as they would be given to bgpq4.  Options of the
+ * whole run are taken from m.  Returns 0 for a job without any words.
+ */
+int
+bgpq_job_parse(struct bgpq_job *j, struct bgpq_expander *m, int output)
+{
+	char	**argv = j->argv;
+	int	  argc, c;
+
+	/* getopt skips the first word, the output file or this */
+	if (!output)
+		*argv++ = PACKAGE_NAME;
+
+	if ((argc = jobsplit(j->args, argv)) == -1)
+		sx_report(SX_FATAL, "Unbalanced quotes\n");
+
+	if (argc == 0)
+		return 0;
+
+	if (output)
+		j->output = j->argv[0];
+	else
+		argc++;
+
+	j->expander.sources = m->sources;
+
+	/* the output file takes the place of the program name */
+#if HAVE_DECL_OPTRESET
+	optreset = 1;
+	optind = 1;
+#else
+	optind = 0;
+#endif
+	opterr = 0;
+	while ((c = getopt(argc, j->argv, OPTIONS)) != -1) {
+		if (c == '?')
+			sx_report(SX_FATAL, "Invalid option or missing "
+			    "argument: -%c\n", optopt);
+		if (strchr(GLOBAL_OPTIONS, c) != NULL)
+			sx_report(SX_FATAL, "-%c can not be used in a "
+			    "job, only on the command line\n", c);
+		if (!bgpq_job_option(j, c, optarg))
+			sx_report(SX_FATAL, "Invalid job\n");
+	}
+
+	bgpq_job_check(j);
+
+	if (j->snapshotin && j->argv[optind])
+		sx_report(SX_FATAL, "Objects can not be given with a "
+		    "snapshot (-I)\n");
+
+	if (!j->argv[optind] && !j->snapshotin)
+		sx_report(SX_FATAL, "No objects to expand\n");
+
+	bgpq_job_objects(j, argc - optind, j->argv + optind);
+
+	return argc;
+}
+
+/*
+ * Read the jobs of a batch, one per line: the output file followed by
+ * the options and objects as they would be given to bgpq4.  Output
+ * file - stands for the standard output.
+ */
+void
+bgpq_jobs_read(struct bgpq_jobs *jobs, const char *file, struct bgpq_expander *m)
+{
+	struct bgpq_job	*j;
+	FILE		*f;
+	char		*line = NULL, where[PATH_MAX + 16];
+	size_t		 linesize = 0;
+	ssize_t		 len;
+	unsigned int	 lineno = 0;
+	int		 argc;
+
+	if ((f = fopen(file, "r")) == NULL)
+		sx_report(SX_FATAL, "Unable to open %s: %s\n", file,
+		    strerror(errno));
+
+	while ((len = getline(&line, &linesize, f)) != -1) {
+		lineno++;
+
+		j = bgpq_job_new(line, len);
+		line = NULL;
+		linesize = 0;
+
+		snprintf(where, sizeof(where), "%s:%u: ", file, lineno);
+		sx_report_context(where);
+
+		argc = bgpq_job_parse(j, m, 1);
+
+		sx_report_context(NULL);
+
+		if (argc == 0) {
+			bgpq_job_free(j);
+			continue;
+		}
+
+		j->line = lineno;
+
+		STAILQ_INSERT_TAIL(jobs, j, entry);
+	}
+
+	if (ferror(f))
+		sx_report(SX_FATAL, "Unable to read %s: %s\n", file,
+		    strerror(errno));
+
+	free(line);
+	fclose(f);
+}
@@ -44,29 +44,28 @@ static void
 bgpq4_print_cisco_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "no ip as-path access-list %s\n", b->name);
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "ip as-path access-list %s deny .*\n", b->name);
 		return;
 	}
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "ip as-path access-list %s permit ^%u(_%u)*$\n",
-		    b->name, res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    b->name, b->asnumber, b->asnumber);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc)
 			fprintf(f, "ip as-path access-list %s permit"
 			    " ^%u(_[0-9]+)*_(%u", b->name, b->asnumber,
-			    asne->asn);
+			    asn);
 		else
-			fprintf(f,"|%u", asne->asn);
+			fprintf(f,"|%u", asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -83,25 +82,25 @@ static void
 bgpq4_print_cisco_xr_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0, comma = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "as-path-set %s", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "\n  ios-regex '^%u(_%u)*$'", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "\n  ios-regex '^%u(_%u)*$'", b->asnumber,
+		    b->asnumber);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "%s\n  ios-regex '^%u(_[0-9]+)*_(%u",
 			    comma ? "," : "",
 			    b->asnumber,
-			    asne->asn);
+			    asn);
 			comma = 1;
 		} else
-			fprintf(f, "|%u", asne->asn);
+			fprintf(f, "|%u", asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -120,28 +119,27 @@ static void
 bgpq4_print_cisco_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "no ip as-path access-list %s\n", b->name);
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "ip as-path access-list %s deny .*\n", b->name);
 		return;
 	}
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "ip as-path access-list %s permit ^(_%u)*$\n",
-		    b->name, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    b->name, b->asnumber);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc)
 			fprintf(f,"ip as-path access-list %s permit"
-			    " ^(_[0-9]+)*_(%u", b->name, asne->asn);
+			    " ^(_[0-9]+)*_(%u", b->name, asn);
 		else
-			fprintf(f,"|%u",asne->asn);
+			fprintf(f,"|%u",asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -159,24 +157,23 @@ static void
 bgpq4_print_cisco_xr_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0, comma = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "as-path-set %s", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "\n  ios-regex '^(_%u)*$'", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "\n  ios-regex '^(_%u)*$'", b->asnumber);
 		comma = 1;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"%s\n  ios-regex '^(_[0-9]+)*_(%u",
-			    comma ? "," : "", asne->asn);
+			    comma ? "," : "", asn);
 			comma = 1;
 		} else
-			fprintf(f,"|%u",asne->asn);
+			fprintf(f,"|%u",asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -195,25 +192,25 @@ static void
 bgpq4_print_juniper_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f,"policy-options {\nreplace:\n as-path-group %s {\n",
 	    b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "  as-path a0 \"^%u(%u)*$\";\n", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "  as-path a0 \"^%u(%u)*$\";\n", b->asnumber,
+		    b->asnumber);
 		lineNo++;
 	}
 	
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "  as-path a%u \"^%u(.)*(%u",
 			    lineNo, b->asnumber,
-			    asne->asn);
+			    asn);
 		} else {
-			fprintf(f,"|%u", asne->asn);
+			fprintf(f,"|%u", asn);
 		}
 
 		nc++;
@@ -237,25 +234,24 @@ static void
 bgpq4_print_juniper_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0, lineNo = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f,"policy-options {\nreplace:\n as-path-group %s {\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "  as-path a%u \"^%u(%u)*$\";\n", lineNo,
-		    res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    b->asnumber, b->asnumber);
 		lineNo++;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"  as-path a%u \"^(.)*(%u",
 			    lineNo,
-			    asne->asn);
+			    asn);
 		} else {
-			fprintf(f, "|%u", asne->asn);
+			fprintf(f, "|%u", asn);
 		}
 
 		nc++;
@@ -278,24 +274,23 @@ static void
 bgpq4_print_juniper_aslist(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f,"policy-options {\nreplace:\n as-list-group %s {\n",
 	    b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "  as-list a0 members %u;\n", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "  as-list a0 members %u;\n", b->asnumber);
 		lineNo++;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "  as-list a%u members [ %u",
-			    lineNo, asne->asn);
+			    lineNo, asn);
 		} else {
-			fprintf(f," %u", asne->asn);
+			fprintf(f," %u", asn);
 		}
 
 		nc++;
@@ -316,41 +311,41 @@ bgpq4_print_juniper_aslist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_openbgpd_oaspath(FILE *f, struct bgpq_expander *b)
 {
-	struct asn_entry	*asne;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "deny to AS %u\n", b->asnumber);
 		return;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist)
-		fprintf(f, "allow to AS %u AS %u\n", b->asnumber, asne->asn);
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist)
+		fprintf(f, "allow to AS %u AS %u\n", b->asnumber, asn);
 }
 
 static void 
 bgpq4_print_nokia_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "configure router policy-options\n"
 	    "begin\nno as-path-group \"%s\"\n", b->name);
 
 	fprintf(f, "as-path-group \"%s\"\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "  entry 1 expression \"%u+\"\n", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "  entry 1 expression \"%u+\"\n", b->asnumber);
 		lineNo++;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"  entry %u expression \"%u.*[%u",
-			    lineNo, b->asnumber, asne->asn);
+			    lineNo, b->asnumber, asn);
 		} else {
-			fprintf(f, " %u", asne->asn);
+			fprintf(f, " %u", asn);
 		}
 
 		nc++;
@@ -371,26 +366,25 @@ static void
 bgpq4_print_nokia_md_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f,"/configure policy-options\ndelete as-path-group \"%s\"\n",
 	    b->name);
 	fprintf(f,"as-path-group \"%s\" {\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f,"  entry 1 {\n    expression \"%u+\"\n  }\n",
-		    res->asn);
+		    b->asnumber);
 		lineNo++;
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"  entry %u {\n    expression \"%u.*[%u",
-			    lineNo, b->asnumber, asne->asn);
+			    lineNo, b->asnumber, asn);
 		} else {
-			fprintf(f, " %u", asne->asn);
+			fprintf(f, " %u", asn);
 		}
 
 		nc++;
@@ -411,28 +405,27 @@ static void
 bgpq4_print_huawei_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "undo ip as-path-filter %s\n", b->name);
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f,"ip as-path-filter %s deny .*\n", b->name);
 		return;
 	}
 	
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "ip as-path-filter %s permit ^%u(_%u)*$\n",
-		    b->name, res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    b->name, b->asnumber, b->asnumber);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc)
 			fprintf(f, "ip as-path-filter %s permit ^%u(_[0-9]+)*"
-			    "_(%u", b->name, b->asnumber, asne->asn);
+			    "_(%u", b->name, b->asnumber, asn);
 		else
-			fprintf(f, "|%u", asne->asn);
+			fprintf(f, "|%u", asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -449,25 +442,24 @@ static void
 bgpq4_print_huawei_xpl_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0, comma = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "xpl as-path-list %s", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "\n  regular ^%u(_%u)*$", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "\n  regular ^%u(_%u)*$", b->asnumber, b->asnumber);
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "%s\n  regular ^%u(_[0-9]+)*_(%u",
 			    comma ? "," : "",
 			    b->asnumber,
-			    asne->asn);
+			    asn);
 			comma = 1;
 		} else
-			fprintf(f, "|%u", asne->asn);
+			fprintf(f, "|%u", asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -486,28 +478,27 @@ static void
 bgpq4_print_huawei_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f,"undo ip as-path-filter %s\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f,"ip as-path-filter %s permit ^(_%u)*$\n",
-		    b->name, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    b->name, b->asnumber);
 	}
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "ip as-path-filter %s deny .*\n", b->name);
 		return;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "ip as-path-filter %s permit ^(_[0-9]+)*_(%u",
-			    b->name, asne->asn);
+			    b->name, asn);
 		} else {
-			fprintf(f, "|%u", asne->asn);
+			fprintf(f, "|%u", asn);
 		}
 
 		nc++;
@@ -525,24 +516,23 @@ static void
 bgpq4_print_huawei_xpl_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int 			 nc = 0, comma = 0;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "xpl as-path-list %s", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
-		fprintf(f, "\n  regular ^(_%u)*$", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
+		fprintf(f, "\n  regular ^(_%u)*$", b->asnumber);
 		comma = 1;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"%s\n  regular ^(_[0-9]+)*_(%u",
-			    comma ? "," : "", asne->asn);
+			    comma ? "," : "", asn);
 			comma = 1;
 		} else
-			fprintf(f,"|%u",asne->asn);
+			fprintf(f,"|%u",asn);
 
 		nc++;
 		if (nc == b->aswidth) {
@@ -561,26 +551,25 @@ static void
 bgpq4_print_nokia_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "configure router policy-options\nbegin\nno as-path-group"
 	    "\"%s\"\n", b->name);
 	fprintf(f, "as-path-group \"%s\"\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "  entry %u expression \"%u+\"\n", lineNo,
 		    b->asnumber);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"  entry %u expression \".*[%u",
-			    lineNo, asne->asn);
+			    lineNo, asn);
 		} else {
-			fprintf(f," %u", asne->asn);
+			fprintf(f," %u", asn);
 		}
 
 		nc++;
@@ -599,26 +588,25 @@ static void
 bgpq4_print_nokia_md_oaspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0, lineNo = 1;
-	struct asn_entry	*asne, find, *res;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "/configure policy-options\ndelete as-path-group \"%s\"\n",
 		b->name);
 	fprintf(f, "as-path-group \"%s\" {\n", b->name);
 
-	find.asn = b->asnumber;
-	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
+	if (sx_asnset_del(&b->asnlist, b->asnumber)) {
 		fprintf(f, "  entry %u {\n    expression \"%u+\"\n  }\n",
-		    lineNo, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
+		    lineNo, b->asnumber);
 		lineNo++;
 	}
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f,"  entry %u {\n    expression \".*[%u",
-			    lineNo, asne->asn);
+			    lineNo, asn);
 		} else {
-			fprintf(f, " %u", asne->asn);
+			fprintf(f, " %u", asn);
 		}
 
 		nc++;
@@ -636,19 +624,36 @@ bgpq4_print_nokia_md_oaspath(FILE *f, struct bgpq_expander *b)
 }
 
 static void
-bgpq4_print_jprefix(struct sx_radix_node *n, void *ff)
+bgpq4_print_jprefix_specific(struct sx_prefix *p, void *ff)
 {
 	char 	 prefix[128];
 	FILE	*f = (FILE*)ff;
 
+	sx_prefix_snprintf(p, prefix, sizeof(prefix));
+	fprintf(f,"    %s;\n", prefix);
+}
+
+static void
+bgpq4_print_jprefix(struct sx_radix_node *n, void *ff)
+{
+	FILE	*f = (FILE*)ff;
+
 	if (n->isGlue)
-		return;
+		goto checkSon;
 
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
-	fprintf(f,"    %s;\n", prefix);
+	/* prefix-lists can't express ranges, list every specific */
+	if (n->isAggregate)
+		sx_prefix_range_foreach(&n->prefix, n->aggregateLow,
+		    n->aggregateHi, bgpq4_print_jprefix_specific, f);
+	else
+		bgpq4_print_jprefix_specific(&n->prefix, f);
+
+checkSon:
+	if (n->son)
+		bgpq4_print_jprefix(n->son, ff);
 }
 
 static int   needscomma = 0;
@@ -665,12 +670,12 @@ bgpq4_print_json_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_jsnprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_jsnprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": true }",
 		    needscomma ? "," : "", prefix);
-	} else if (n->aggregateLow > n->prefix->masklen) {
+	} else if (n->aggregateLow > n->prefix.masklen) {
 		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": false,\n"
 		    "      \"greater-equal\": %u, \"less-equal\": %u }",
 		    needscomma ? "," : "", prefix, n->aggregateLow,
@@ -692,20 +697,21 @@ static void
 bgpq4_print_json_aspath(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "{\"%s\": [", b->name);
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "%s\n  %u",
 			    needscomma ? "," : "",
-			    asne->asn);
+			    asn);
 			needscomma = 1;
 		} else {
 			fprintf(f, "%s%u",
 			    needscomma ? "," : "",
-			    asne->asn);
+			    asn);
 			needscomma = 1;
 		}
 
@@ -729,16 +735,16 @@ bgpq4_print_bird_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "%s\n    %s", needscomma ? "," : "", prefix);
-	} else if (n->aggregateLow > n->prefix->masklen) {
+	} else if (n->aggregateLow > n->prefix.masklen) {
 		fprintf(f, "%s\n    %s{%u,%u}", needscomma ? "," : "", prefix,
 		    n->aggregateLow, n->aggregateHi);
 	} else {
 		fprintf(f, "%s\n    %s{%u,%u}", needscomma ? "," : "", prefix,
-		    n->prefix->masklen, n->aggregateHi);
+		    n->prefix.masklen, n->aggregateHi);
 	}
 
 	needscomma = 1;
@@ -752,22 +758,23 @@ static void
 bgpq4_print_bird_aspath(FILE* f, struct bgpq_expander* b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "%s = [", b->name);
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "];\n");
 		return;
 	}
 	
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
 		if (!nc) {
 			fprintf(f, "%s\n    %u", needscomma ? "," : "",
-			    asne->asn);
+			    asn);
 			needscomma = 1;
 		} else {
-			fprintf(f, ", %u", asne->asn);
+			fprintf(f, ", %u", asn);
 			needscomma = 1;
 		}
 
@@ -791,18 +798,18 @@ bgpq4_print_openbgpd_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "\n\t%s", prefix);
 	} else if (n->aggregateLow == n->aggregateHi) {
 		fprintf(f, "\n\t%s prefixlen = %u", prefix, n->aggregateHi);
-	} else if (n->aggregateLow > n->prefix->masklen) {
+	} else if (n->aggregateLow > n->prefix.masklen) {
 		fprintf(f, "\n\t%s prefixlen %u - %u",
 		    prefix, n->aggregateLow, n->aggregateHi);
 	} else {
 		fprintf(f, "\n\t%s prefixlen %u - %u",
-		    prefix, n->prefix->masklen, n->aggregateHi);
+		    prefix, n->prefix.masklen, n->aggregateHi);
 	}
 
 checkSon:
@@ -814,12 +821,13 @@ static void
 bgpq4_print_openbgpd_asset(FILE *f, struct bgpq_expander *b)
 {
 	int			 nc = 0;
-	struct asn_entry	*asne;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
 	fprintf(f, "as-set %s {", b->name);
 
-	RB_FOREACH(asne, asn_tree, &b->asnlist) {
-		fprintf(f, "%s%u", nc == 0 ? "\n\t" : " ", asne->asn);
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist) {
+		fprintf(f, "%s%u", nc == 0 ? "\n\t" : " ", asn);
 
 		nc++;
 		if (nc == b->aswidth)
@@ -832,20 +840,24 @@ bgpq4_print_openbgpd_asset(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_openbgpd_aspath(FILE *f, struct bgpq_expander *b)
 {
-	struct asn_entry	*asne;
+	struct sx_asnset_iter	 it;
+	uint32_t		 asn;
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (sx_asnset_empty(&b->asnlist)) {
 		fprintf(f, "deny from AS %u\n", b->asnumber);
 		return;
 	}
 	
-	RB_FOREACH(asne, asn_tree, &b->asnlist)
-		fprintf(f, "allow from AS %u AS %u\n", b->asnumber, asne->asn);
+	SX_ASNSET_FOREACH(asn, it, &b->asnlist)
+		fprintf(f, "allow from AS %u AS %u\n", b->asnumber, asn);
 }
 
 void
 bgpq4_print_aspath(FILE *f, struct bgpq_expander *b)
 {
+	/* a batch prints several filters */
+	needscomma = 0;
+
 	switch (b->vendor) {
 	case V_JUNIPER:
 		bgpq4_print_juniper_aspath(f, b);
@@ -932,6 +944,9 @@ bgpq4_print_aslist(FILE *f, struct bgpq_expander *b)
 void
 bgpq4_print_asset(FILE *f, struct bgpq_expander *b)
 {
+	/* a batch prints several filters */
+	needscomma = 0;
+
 	switch (b->vendor) {
 	case V_JSON:
 		bgpq4_print_json_aspath(f, b);
@@ -962,13 +977,13 @@ bgpq4_print_jrfilter(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "    %s%s exact;\n",
 		    jrfilter_prefixed ? "route-filter " : "", prefix);
 	} else {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"    %s%s prefix-length-range /%u-/%u;\n",
 			    jrfilter_prefixed ? "route-filter " : "",
 			    prefix, n->aggregateLow, n->aggregateHi);
@@ -999,26 +1014,26 @@ bgpq4_print_cprefix(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (seq)
 		snprintf(seqno, sizeof(seqno), " seq %i", seq++);
 
 	if (n->isAggregate) {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"%s prefix-list %s%s permit %s ge %u le %u\n",
-			    n->prefix->family == AF_INET ? "ip" : "ipv6",
+			    n->prefix.family == AF_INET ? "ip" : "ipv6",
 			    bname ? bname : "NN", seqno, prefix,
 			    n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"%s prefix-list %s%s permit %s le %u\n",
-			    n->prefix->family == AF_INET ? "ip" : "ipv6",
+			    n->prefix.family == AF_INET ? "ip" : "ipv6",
 			    bname?bname:"NN", seqno, prefix,
 			    n->aggregateHi);
 		}
 	} else {
 		fprintf(f,"%s prefix-list %s%s permit %s\n",
-		    (n->prefix->family == AF_INET) ? "ip" : "ipv6",
+		    (n->prefix.family == AF_INET) ? "ip" : "ipv6",
 		    bname ? bname : "NN", seqno, prefix);
 	}
 
@@ -1039,10 +1054,10 @@ bgpq4_print_cprefixxr(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (n->isAggregate) {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"%s%s ge %u le %u",
 			    needscomma ? ",\n " : " ",
 			    prefix, n->aggregateLow, n->aggregateHi);
@@ -1076,24 +1091,24 @@ bgpq4_print_hprefix(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf_sep(n->prefix, prefix, sizeof(prefix), " ");
+	sx_prefix_snprintf_sep(&n->prefix, prefix, sizeof(prefix), " ");
 
 	if (n->isAggregate) {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"ip %s-prefix %s permit %s greater-equal %u "
 			    "less-equal %u\n",
-			    n->prefix->family == AF_INET ? "ip" : "ipv6",
+			    n->prefix.family == AF_INET ? "ip" : "ipv6",
 			    bname ? bname : "NN",
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"ip %s-prefix %s permit %s less-equal %u\n",
-			    n->prefix->family == AF_INET ? "ip" : "ipv6",
+			    n->prefix.family == AF_INET ? "ip" : "ipv6",
 			    bname ? bname : "NN",
 			    prefix, n->aggregateHi);
 		}
 	} else {
 		fprintf(f,"ip %s-prefix %s permit %s\n",
-		    n->prefix->family == AF_INET ? "ip" : "ipv6",
+		    n->prefix.family == AF_INET ? "ip" : "ipv6",
 		    bname ? bname : "NN",
 		    prefix);
 	}
@@ -1115,10 +1130,10 @@ bgpq4_print_hprefixxpl(struct sx_radix_node* n, void* ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf_sep(n->prefix, prefix, sizeof(prefix), " ");
+	sx_prefix_snprintf_sep(&n->prefix, prefix, sizeof(prefix), " ");
 
 	if (n->isAggregate) {
-		if (n->aggregateLow>n->prefix->masklen) {
+		if (n->aggregateLow>n->prefix.masklen) {
 			fprintf(f,"%s %s ge %u le %u",
 			    needscomma ? ",\n " : " ",
 			    prefix, n->aggregateLow, n->aggregateHi);
@@ -1152,12 +1167,12 @@ bgpq4_print_eprefix(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	snprintf(seqno, sizeof(seqno), " seq %i", seq++);
 
 	if (n->isAggregate) {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"   %s permit %s ge %u le %u\n",
 			    seqno, prefix, n->aggregateLow, n->aggregateHi);
 		} else {
@@ -1189,17 +1204,17 @@ bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	c = strchr(prefix, '/');
 
 	if (c)
 		*c = 0;
 
-	if (n->prefix->masklen == 32)
+	if (n->prefix.masklen == 32)
 		netmask.s_addr = 0;
 	else {
-	 	netmask.s_addr <<= (32 - n->prefix->masklen);
+	 	netmask.s_addr <<= (32 - n->prefix.masklen);
 		netmask.s_addr &= 0xfffffffful;
 	}
 
@@ -1210,7 +1225,7 @@ bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 		int		masklen = n->aggregateLow;
 
 		mask.s_addr = 0xfffffffful;
-		wildaddr.s_addr = 0xfffffffful >> n->prefix->masklen;
+		wildaddr.s_addr = 0xfffffffful >> n->prefix.masklen;
 
 		if (n->aggregateHi == 32)
 			wild2addr.s_addr = 0;
@@ -1238,11 +1253,11 @@ bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 
 		if (wildaddr.s_addr) {
 			fprintf(f, " permit ip %s ",
-			    inet_ntoa(n->prefix->addr.addr));
+			    inet_ntoa(n->prefix.addr.addr));
 			fprintf(f, "%s ", inet_ntoa(wildaddr));
 		} else {
 			fprintf(f, " permit ip host %s ",
-			    inet_ntoa(n->prefix->addr.addr));
+			    inet_ntoa(n->prefix.addr.addr));
 		}
 
 		if (wildmask.s_addr) {
@@ -1262,20 +1277,32 @@ checkSon:
 }
 
 static void
-bgpq4_print_nokia_ipfilter(struct sx_radix_node *n, void *ff)
+bgpq4_print_nokia_ipfilter_specific(struct sx_prefix *p, void *ff)
 {
 	char 	 prefix[128];
 	FILE	*f = (FILE*)ff;
 
+	sx_prefix_snprintf(p, prefix, sizeof(prefix));
+
+	fprintf(f, "    prefix %s\n", prefix);
+}
+
+static void
+bgpq4_print_nokia_ipfilter(struct sx_radix_node *n, void *ff)
+{
+	FILE	*f = (FILE*)ff;
+
 	if (n->isGlue)
 		goto checkSon;
 
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
-
-	fprintf(f, "    prefix %s\n", prefix);
+	if (n->isAggregate)
+		sx_prefix_range_foreach(&n->prefix, n->aggregateLow,
+		    n->aggregateHi, bgpq4_print_nokia_ipfilter_specific, f);
+	else
+		bgpq4_print_nokia_ipfilter_specific(&n->prefix, f);
 
 checkSon:
 	if (n->son)
@@ -1283,20 +1310,32 @@ checkSon:
 }
 
 static void
-bgpq4_print_nokia_md_ipfilter(struct sx_radix_node *n, void *ff)
+bgpq4_print_nokia_md_ipfilter_specific(struct sx_prefix *p, void *ff)
 {
 	char 	 prefix[128];
 	FILE	*f = (FILE*)ff;
 
+	sx_prefix_snprintf(p, prefix, sizeof(prefix));
+
+	fprintf(f, "    prefix %s { }\n", prefix);
+}
+
+static void
+bgpq4_print_nokia_md_ipfilter(struct sx_radix_node *n, void *ff)
+{
+	FILE	*f = (FILE*)ff;
+
 	if (n->isGlue)
 		goto checkSon;
 
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
-
-	fprintf(f, "    prefix %s { }\n", prefix);
+	if (n->isAggregate)
+		sx_prefix_range_foreach(&n->prefix, n->aggregateLow,
+		    n->aggregateHi, bgpq4_print_nokia_md_ipfilter_specific, f);
+	else
+		bgpq4_print_nokia_md_ipfilter_specific(&n->prefix, f);
 
 checkSon:
 	if (n->son)
@@ -1315,17 +1354,17 @@ bgpq4_print_nokia_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "    prefix %s exact\n", prefix);
 	} else {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"    prefix %s prefix-length-range %u-%u\n",
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"    prefix %s prefix-length-range %u-%u\n",
-			    prefix, n->prefix->masklen, n->aggregateHi);
+			    prefix, n->prefix.masklen, n->aggregateHi);
 		}
 	}
 
@@ -1347,12 +1386,12 @@ bgpq4_print_nokia_md_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+	sx_prefix_snprintf(&n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
 		fprintf(f, "    prefix %s type exact {\n    }\n", prefix);
 	} else {
-		if (n->aggregateLow > n->prefix->masklen) {
+		if (n->aggregateLow > n->prefix.masklen) {
 			fprintf(f,"    prefix %s type range {\n"
 			    "        start-length %u\n"
 			    "        end-length %u\n    }\n",
@@ -1577,8 +1616,35 @@ bgpq4_print_arista_prefixlist(FILE *f, struct bgpq_expander *b)
 struct fpcbdata {
 	FILE			*f;
 	struct bgpq_expander	*b;
+	int			 ranges;	/* format has %a or %A */
 };
 
+static int
+bgpq4_format_ranges(const char *format)
+{
+	const char	*c;
+
+	for (c = format; *c; c++) {
+		if (*c != '%' || *(c + 1) == '\0')
+			continue;
+		c++;
+		if (*c == 'a' || *c == 'A')
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+bgpq4_print_format_specific(struct sx_prefix *p, void *ff)
+{
+	struct fpcbdata		*fpc = (struct fpcbdata*)ff;
+	struct bgpq_expander	*b = fpc->b;
+
+	sx_prefix_snprintf_fmt(p, fpc->f, b->name ? b->name : "NN",
+	    b->format, p->masklen, p->masklen);
+}
+
 static void
 bgpq4_print_format_prefix(struct sx_radix_node *n, void *ff)
 {
@@ -1592,23 +1658,27 @@ bgpq4_print_format_prefix(struct sx_radix_node *n, void *ff)
 	if (!f)
 		f = stdout;
 
-	if (!n->isAggregate) {
-		sx_prefix_snprintf_fmt(n->prefix, f,
+	/* without %a/%A a range can only be given as its specifics */
+	if (n->isAggregate && !fpc->ranges) {
+		sx_prefix_range_foreach(&n->prefix, n->aggregateLow,
+		    n->aggregateHi, bgpq4_print_format_specific, fpc);
+	} else if (!n->isAggregate) {
+		sx_prefix_snprintf_fmt(&n->prefix, f,
 		    b->name ? b->name : "NN",
 		    b->format,
-		    n->prefix->masklen,
-		    n->prefix->masklen);
-	} else if (n->aggregateLow > n->prefix->masklen) {
-		sx_prefix_snprintf_fmt(n->prefix, f,
+		    n->prefix.masklen,
+		    n->prefix.masklen);
+	} else if (n->aggregateLow > n->prefix.masklen) {
+		sx_prefix_snprintf_fmt(&n->prefix, f,
 		    b->name ? b->name : "NN",
 		    b->format,
 		    n->aggregateLow,
 		    n->aggregateHi);
 	} else {
-		sx_prefix_snprintf_fmt(n->prefix, f,
+		sx_prefix_snprintf_fmt(&n->prefix, f,
 		    b->name ? b->name : "NN",
 		    b->format,
-		    n->prefix->masklen,
+		    n->prefix.masklen,
 		    n->aggregateHi);
 	}
 
@@ -1623,6 +1693,8 @@ bgpq4_print_format_prefixlist(FILE *f, struct bgpq_expander *b)
 	struct fpcbdata ff = {.f=f, .b=b};
 	int len = strlen(b->format);
 
+	ff.ranges = bgpq4_format_ranges(b->format);
+
 	sx_radix_tree_foreach(b->tree, bgpq4_print_format_prefix, &ff);
 
 	// Add newline if format doesn't already end with one.
@@ -1728,19 +1800,19 @@ bgpq4_print_k6prefix(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf_sep(n->prefix, prefix, sizeof(prefix), "/");
+	sx_prefix_snprintf_sep(&n->prefix, prefix, sizeof(prefix), "/");
 
 	if (n->isAggregate)
 		fprintf(f,"/routing filter add action=accept chain=\""
 		    "%s-%s\" prefix=%s prefix-length=%d-%d\n",
 		    bname ? bname : "NN",
-		    n->prefix->family == AF_INET ? "V4" : "V6",
+		    n->prefix.family == AF_INET ? "V4" : "V6",
 		    prefix, n->aggregateLow, n->aggregateHi);
 	else
 		fprintf(f,"/routing filter add action=accept chain=\""
 		    "%s-%s\" prefix=%s\n",
 		    bname ? bname : "NN",
-		    n->prefix->family == AF_INET ? "V4" : "V6",
+		    n->prefix.family == AF_INET ? "V4" : "V6",
 		    prefix);
 
 checkSon:
@@ -1760,19 +1832,19 @@ bgpq4_print_k7prefix(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf_sep(n->prefix, prefix, sizeof(prefix), "/");
+	sx_prefix_snprintf_sep(&n->prefix, prefix, sizeof(prefix), "/");
 
 	if (n->isAggregate)
 		fprintf(f,"/routing filter rule add chain=\""
 		    "%s-%s\"  rule=\"if (dst in %s && dst-len in %d-%d) {accept}\"\n",
 		    bname ? bname : "NN",
-		    n->prefix->family == AF_INET ? "V4" : "V6",
+		    n->prefix.family == AF_INET ? "V4" : "V6",
 		    prefix, n->aggregateLow, n->aggregateHi);
 	else
 		fprintf(f,"/routing filter rule add chain=\""
 		    "%s-%s\" rule=\"if (dst=%s) {accept}\"\n",
 		    bname ? bname : "NN",
-		    n->prefix->family == AF_INET ? "V4" : "V6",
+		    n->prefix.family == AF_INET ? "V4" : "V6",
 		    prefix);
 
 checkSon:
@@ -1799,6 +1871,9 @@ bgpq4_print_mikrotik_prefixlist(FILE *f, struct bgpq_expander *b)
 void
 bgpq4_print_prefixlist(FILE *f, struct bgpq_expander *b)
 {
+	/* a batch prints several filters */
+	needscomma = 0;
+
 	switch (b->vendor) {
 	case V_JUNIPER:
 		bgpq4_print_juniper_prefixlist(f, b);
@@ -0,0 +1,1172 @@
+/*
+ * Copyright (c) 2019-2022 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Offline mode: answer the queries of the expander from local RPSL
+ * dumps instead of an IRRd.
+ *
+ * Plain dumps are mapped, gzip compressed ones are inflated into memory.
+ * Every dump is cut at blank lines (object boundaries) into chunks which
+ * are parsed independently, on several threads when -k asks for them.
+ * Only as-set, route-set, route, route6 and aut-num objects are kept:
+ * members of the sets are indexed by set name, routes by origin AS.
+ * Membership claimed with member-of is added to the sets once all dumps
+ * are loaded, if the set allows it with mbrs-by-ref.
+ *
+ * Replies are built the way IRRd would send them and handed back in the
+ * request, where they are replayed like replies found in the cache.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
+
+#include "extern.h"
+#include "sx_report.h"
+
+extern int debug_expander;
+
+/* smallest piece of a dump worth handing to a thread of its own */
+#define RPSL_CHUNK	(1024 * 1024)
+
+enum {
+	RPSL_NONE = 0,
+	RPSL_ASSET,
+	RPSL_ROUTESET,
+	RPSL_ROUTE,
+	RPSL_ROUTE6,
+	RPSL_AUTNUM
+};
+
+enum {
+	RPSL_A_NONE = 0,
+	RPSL_A_KEY,
+	RPSL_A_MEMBERS,
+	RPSL_A_MBRSBYREF,
+	RPSL_A_MEMBEROF,
+	RPSL_A_MNTBY,
+	RPSL_A_ORIGIN,
+	RPSL_A_SOURCE
+};
+
+struct rpsl_list {
+	char	**v;
+	size_t	  n, size;
+};
+
+/* object as found by the parser, before it is merged into the indices */
+struct rpsl_object {
+	struct rpsl_object	*next;
+	int			 class;
+	char			*key;
+	char			*source;
+	char			*origin;
+	struct rpsl_list	 members, mbrsbyref, memberof, mntby;
+};
+
+struct rpsl_set {
+	RB_ENTRY(rpsl_set)	 entry;
+	char			*name;
+	int			 class;
+	unsigned int		 source;
+	unsigned int		 mark;
+	struct rpsl_list	 members, mbrsbyref;
+	struct rpsl_set		*next;	/* same name, later sources */
+};
+
+struct rpsl_route {
+	char		*prefix;
+	unsigned int	 source;
+};
+
+struct rpsl_origin {
+	RB_ENTRY(rpsl_origin)	 entry;
+	uint32_t		 asn;
+	struct rpsl_route	*routes;
+	size_t			 nroutes, routessize;
+};
+
+struct rpsl_file {
+	char	*data;
+	size_t	 len;
+	int	 mapped;
+};
+
+struct rpsl_chunk {
+	const char		*start, *end;
+	struct rpsl_object	*head, **tail;
+};
+
+struct rpsl_seen {
+	RB_ENTRY(rpsl_seen)	 entry;
+	char			*text;
+};
+
+RB_HEAD(rpsl_seens, rpsl_seen);
+
+struct rpsl_buf {
+	char	*data;
+	size_t	 len, size;
+};
+
+/* state of a single query */
+struct rpsl_reply {
+	struct bgpq_rpsl	*r;
+	unsigned int		*sel;
+	unsigned int		 nsel;
+	struct rpsl_buf		 buf;
+	struct rpsl_seens	 seen;
+};
+
+struct bgpq_rpsl {
+	RB_HEAD(rpsl_sets, rpsl_set)		 sets;
+	RB_HEAD(rpsl_origins, rpsl_origin)	 origins;
+	char					**sources;
+	unsigned int				 nsources;
+	unsigned int				 mark;
+	struct rpsl_object			*memberof;
+};
+
+static int
+rpsl_set_cmp(struct rpsl_set *a, struct rpsl_set *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+RB_GENERATE_STATIC(rpsl_sets, rpsl_set, entry, rpsl_set_cmp);
+
+static int
+rpsl_origin_cmp(struct rpsl_origin *a, struct rpsl_origin *b)
+{
+	return (a->asn < b->asn ? -1 : a->asn > b->asn);
+}
+
+RB_GENERATE_STATIC(rpsl_origins, rpsl_origin, entry, rpsl_origin_cmp);
+
+static int
+rpsl_seen_cmp(struct rpsl_seen *a, struct rpsl_seen *b)
+{
+	return strcmp(a->text, b->text);
+}
+
+RB_GENERATE_STATIC(rpsl_seens, rpsl_seen, entry, rpsl_seen_cmp);
+
+static void
+bgpq_rpsl_list_add(struct rpsl_list *l, char *text)
+{
+	if (l->n == l->size) {
+		l->size = l->size ? l->size * 2 : 8;
+		if ((l->v = realloc(l->v, l->size * sizeof(char *))) == NULL)
+			err(1, NULL);
+	}
+	l->v[l->n++] = text;
+}
+
+static void
+bgpq_rpsl_list_free(struct rpsl_list *l)
+{
+	size_t	i;
+
+	for (i = 0; i < l->n; i++)
+		free(l->v[i]);
+	free(l->v);
+	memset(l, 0, sizeof(struct rpsl_list));
+}
+
+static void
+bgpq_rpsl_object_free(struct rpsl_object *o)
+{
+	free(o->key);
+	free(o->source);
+	free(o->origin);
+	bgpq_rpsl_list_free(&o->members);
+	bgpq_rpsl_list_free(&o->mbrsbyref);
+	bgpq_rpsl_list_free(&o->memberof);
+	bgpq_rpsl_list_free(&o->mntby);
+	free(o);
+}
+
+static int
+bgpq_rpsl_class(const char *name, size_t len)
+{
+	if (len == 6 && !strncasecmp(name, "as-set", 6))
+		return RPSL_ASSET;
+	if (len == 9 && !strncasecmp(name, "route-set", 9))
+		return RPSL_ROUTESET;
+	if (len == 5 && !strncasecmp(name, "route", 5))
+		return RPSL_ROUTE;
+	if (len == 6 && !strncasecmp(name, "route6", 6))
+		return RPSL_ROUTE6;
+	if (len == 7 && !strncasecmp(name, "aut-num", 7))
+		return RPSL_AUTNUM;
+
+	return RPSL_NONE;
+}
+
+static int
+bgpq_rpsl_attr(int class, const char *name, size_t len)
+{
+	int	set = class == RPSL_ASSET || class == RPSL_ROUTESET;
+
+	if (len == 6 && !strncasecmp(name, "source", 6))
+		return RPSL_A_SOURCE;
+	if (len == 6 && !strncasecmp(name, "mnt-by", 6))
+		return RPSL_A_MNTBY;
+	if (set && len == 7 && !strncasecmp(name, "members", 7))
+		return RPSL_A_MEMBERS;
+	if (set && len == 10 && !strncasecmp(name, "mp-members", 10))
+		return RPSL_A_MEMBERS;
+	if (set && len == 11 && !strncasecmp(name, "mbrs-by-ref", 11))
+		return RPSL_A_MBRSBYREF;
+	if (!set && len == 9 && !strncasecmp(name, "member-of", 9))
+		return RPSL_A_MEMBEROF;
+	if ((class == RPSL_ROUTE || class == RPSL_ROUTE6) && len == 6 &&
+	    !strncasecmp(name, "origin", 6))
+		return RPSL_A_ORIGIN;
+
+	return RPSL_A_NONE;
+}
+
+static int
+bgpq_rpsl_blank(const char *p, const char *eol)
+{
+	for (; p < eol; p++)
+		if (*p != ' ' && *p != '\t' && *p != '\r')
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Next token of an attribute value, lists are separated by commas and
+ * whitespace and the value ends with a comment.
+ */
+static const char *
+bgpq_rpsl_token(const char **pp, const char *eol, size_t *len)
+{
+	const char	*p = *pp, *t;
+
+	while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r' ||
+	    *p == ','))
+		p++;
+
+	if (p == eol || *p == '#') {
+		*pp = eol;
+		return NULL;
+	}
+
+	for (t = p; p < eol; p++)
+		if (*p == ' ' || *p == '\t' || *p == '\r' || *p == ',' ||
+		    *p == '#')
+			break;
+
+	*pp = p;
+	*len = p - t;
+
+	return t;
+}
+
+/*
+ * Names are case insensitive and kept in upper case, prefixes are kept
+ * as they are.
+ */
+static char *
+bgpq_rpsl_strndup(const char *t, size_t len)
+{
+	char	*s;
+	size_t	 i;
+
+	if ((s = strndup(t, len)) == NULL)
+		err(1, NULL);
+
+	if (memchr(s, '/', len) == NULL)
+		for (i = 0; i < len; i++)
+			s[i] = toupper((unsigned char)s[i]);
+
+	return s;
+}
+
+static void
+bgpq_rpsl_value(struct rpsl_object *o, int attr, const char *v,
+    const char *eol)
+{
+	const char	*t;
+	size_t		 len;
+	char		**single = NULL;
+	struct rpsl_list *list = NULL;
+
+	switch (attr) {
+	case RPSL_A_KEY:
+		single = &o->key;
+		break;
+	case RPSL_A_SOURCE:
+		single = &o->source;
+		break;
+	case RPSL_A_ORIGIN:
+		single = &o->origin;
+		break;
+	case RPSL_A_MEMBERS:
+		list = &o->members;
+		break;
+	case RPSL_A_MBRSBYREF:
+		list = &o->mbrsbyref;
+		break;
+	case RPSL_A_MEMBEROF:
+		list = &o->memberof;
+		break;
+	case RPSL_A_MNTBY:
+		list = &o->mntby;
+		break;
+	default:
+		return;
+	}
+
+	while ((t = bgpq_rpsl_token(&v, eol, &len)) != NULL) {
+		if (list)
+			bgpq_rpsl_list_add(list, bgpq_rpsl_strndup(t, len));
+		else if (*single == NULL)
+			*single = bgpq_rpsl_strndup(t, len);
+	}
+}
+
+static void
+bgpq_rpsl_finish(struct rpsl_chunk *c, struct rpsl_object *o)
+{
+	if (o->key == NULL || o->source == NULL ||
+	    ((o->class == RPSL_ROUTE || o->class == RPSL_ROUTE6) &&
+	    o->origin == NULL) ||
+	    (o->class == RPSL_AUTNUM && o->memberof.n == 0)) {
+		bgpq_rpsl_object_free(o);
+		return;
+	}
+
+	*c->tail = o;
+	c->tail = &o->next;
+}
+
+static void
+bgpq_rpsl_parse(struct rpsl_chunk *c)
+{
+	struct rpsl_object	*o = NULL;
+	const char		*p, *eol, *v, *colon;
+	int			 attr = RPSL_A_NONE, skip = 0, class;
+
+	for (p = c->start; p < c->end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', c->end - p)) == NULL)
+			eol = c->end;
+
+		if (bgpq_rpsl_blank(p, eol)) {
+			if (o)
+				bgpq_rpsl_finish(c, o);
+			o = NULL;
+			skip = 0;
+			continue;
+		}
+
+		if (skip || *p == '%' || *p == '#')
+			continue;
+
+		if (*p == ' ' || *p == '\t' || *p == '+') {
+			/* continuation of the previous attribute */
+			if (o == NULL)
+				continue;
+			v = p + 1;
+		} else {
+			if ((colon = memchr(p, ':', eol - p)) == NULL)
+				continue;
+			if (o == NULL) {
+				/* the first attribute names the class */
+				class = bgpq_rpsl_class(p, colon - p);
+				if (class == RPSL_NONE) {
+					skip = 1;
+					continue;
+				}
+				if ((o = calloc(1, sizeof(*o))) == NULL)
+					err(1, NULL);
+				o->class = class;
+				attr = RPSL_A_KEY;
+			} else
+				attr = bgpq_rpsl_attr(o->class, p, colon - p);
+			v = colon + 1;
+		}
+
+		bgpq_rpsl_value(o, attr, v, eol);
+	}
+
+	if (o)
+		bgpq_rpsl_finish(c, o);
+}
+
+static void
+bgpq_rpsl_read(const char *path, struct rpsl_file *f)
+{
+	unsigned char	 magic[2];
+	struct stat	 st;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		sx_report(SX_FATAL, "Unable to open %s: %s\n", path,
+		    strerror(errno));
+
+	if (fstat(fd, &st) == -1)
+		sx_report(SX_FATAL, "Unable to stat %s: %s\n", path,
+		    strerror(errno));
+
+	if (st.st_size >= 2 && pread(fd, magic, 2, 0) == 2 &&
+	    magic[0] == 0x1f && magic[1] == 0x8b) {
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+		gzFile	 gz;
+		size_t	 size = st.st_size * 4;
+		int	 ret;
+
+		if ((gz = gzdopen(fd, "rb")) == NULL)
+			err(1, NULL);
+
+		if ((f->data = malloc(size)) == NULL)
+			err(1, NULL);
+
+		while ((ret = gzread(gz, f->data + f->len,
+		    size - f->len > (1 << 30) ? (1 << 30) :
+		    size - f->len)) > 0) {
+			f->len += ret;
+			if (f->len < size)
+				continue;
+			size *= 2;
+			if ((f->data = realloc(f->data, size)) == NULL)
+				err(1, NULL);
+		}
+		if (ret < 0)
+			sx_report(SX_FATAL, "Unable to decompress %s: %s\n",
+			    path, gzerror(gz, &ret));
+
+		/* closes fd as well */
+		gzclose(gz);
+		return;
+#else
+		sx_report(SX_FATAL, "%s is compressed, but bgpq4 was built "
+		    "without zlib\n", path);
+#endif
+	}
+
+	if (st.st_size > 0) {
+		f->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (f->data == MAP_FAILED)
+			sx_report(SX_FATAL, "Unable to map %s: %s\n", path,
+			    strerror(errno));
+		f->len = st.st_size;
+		f->mapped = 1;
+	}
+
+	close(fd);
+}
+
+/*
+ * Cut the dump into about n chunks, each of them ending right after a
+ * blank line so no object is split.
+ */
+static void
+bgpq_rpsl_split(struct rpsl_file *f, size_t n, struct rpsl_chunk **chunks,
+    size_t *nchunks, size_t *chunkssize)
+{
+	const char	*start = f->data, *end = f->data + f->len;
+	const char	*p, *eol, *nl;
+	size_t		 i;
+
+	if (f->len == 0)
+		return;
+
+	if (n > f->len / RPSL_CHUNK)
+		n = f->len / RPSL_CHUNK;
+	if (n == 0)
+		n = 1;
+
+	for (i = 1; i <= n; i++) {
+		p = i == n ? end : f->data + f->len / n * i;
+		if (p < start)
+			continue;
+		for (; p < end; p = eol + 1) {
+			eol = memchr(p, '\n', end - p);
+			if (eol == NULL ||
+			    (nl = memchr(eol + 1, '\n', end - eol - 1)) == NULL) {
+				p = end;
+				break;
+			}
+			if (bgpq_rpsl_blank(eol + 1, nl)) {
+				p = nl + 1;
+				break;
+			}
+		}
+
+		if (*nchunks == *chunkssize) {
+			*chunkssize = *chunkssize ? *chunkssize * 2 : 16;
+			*chunks = realloc(*chunks, *chunkssize *
+			    sizeof(struct rpsl_chunk));
+			if (*chunks == NULL)
+				err(1, NULL);
+		}
+		(*chunks)[*nchunks].start = start;
+		(*chunks)[*nchunks].end = p;
+		(*chunks)[*nchunks].head = NULL;
+		(*chunks)[*nchunks].tail = &(*chunks)[*nchunks].head;
+		(*nchunks)++;
+
+		if ((start = p) == end)
+			break;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+struct rpsl_pool {
+	struct rpsl_chunk	*chunks;
+	size_t			 nchunks, next;
+	pthread_mutex_t		 lock;
+};
+
+static void *
+bgpq_rpsl_worker(void *arg)
+{
+	struct rpsl_pool	*pool = arg;
+	size_t			 i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->nchunks)
+			break;
+
+		bgpq_rpsl_parse(&pool->chunks[i]);
+	}
+
+	return NULL;
+}
+#endif
+
+static void
+bgpq_rpsl_parse_all(struct rpsl_chunk *chunks, size_t nchunks)
+{
+	size_t		 i;
+#ifdef HAVE_PTHREAD_H
+	struct rpsl_pool pool = { chunks, nchunks, 0,
+	    PTHREAD_MUTEX_INITIALIZER };
+	pthread_t	*threads;
+	unsigned int	 nthreads = sx_radix_threads, n;
+
+	if (nthreads > nchunks)
+		nthreads = nchunks;
+
+	if (nthreads > 1) {
+		if ((threads = calloc(nthreads, sizeof(pthread_t))) == NULL)
+			err(1, NULL);
+
+		for (n = 0; n < nthreads - 1; n++) {
+			if (pthread_create(&threads[n], NULL,
+			    bgpq_rpsl_worker, &pool) != 0)
+				break;
+		}
+
+		/* this thread is one of the workers */
+		bgpq_rpsl_worker(&pool);
+
+		for (i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+
+		free(threads);
+		return;
+	}
+#endif
+
+	for (i = 0; i < nchunks; i++)
+		bgpq_rpsl_parse(&chunks[i]);
+}
+
+static unsigned int
+bgpq_rpsl_source(struct bgpq_rpsl *r, const char *name)
+{
+	unsigned int	i;
+
+	for (i = 0; i < r->nsources; i++)
+		if (!strcmp(r->sources[i], name))
+			return i;
+
+	r->sources = realloc(r->sources, (r->nsources + 1) * sizeof(char *));
+	if (r->sources == NULL)
+		err(1, NULL);
+	if ((r->sources[r->nsources] = strdup(name)) == NULL)
+		err(1, NULL);
+
+	return r->nsources++;
+}
+
+static struct rpsl_set *
+bgpq_rpsl_set_source(struct bgpq_rpsl *r, const char *name,
+    unsigned int source)
+{
+	struct rpsl_set	 key, *set;
+
+	key.name = (char *)name;
+	for (set = RB_FIND(rpsl_sets, &r->sets, &key); set; set = set->next)
+		if (set->source == source)
+			return set;
+
+	return NULL;
+}
+
+static void
+bgpq_rpsl_merge_set(struct bgpq_rpsl *r, struct rpsl_object *o,
+    unsigned int source)
+{
+	struct rpsl_set	*set, *prev;
+
+	if ((set = calloc(1, sizeof(struct rpsl_set))) == NULL)
+		err(1, NULL);
+
+	set->name = o->key;
+	set->class = o->class;
+	set->source = source;
+	set->members = o->members;
+	set->mbrsbyref = o->mbrsbyref;
+	o->key = NULL;
+	memset(&o->members, 0, sizeof(struct rpsl_list));
+	memset(&o->mbrsbyref, 0, sizeof(struct rpsl_list));
+
+	if ((prev = RB_INSERT(rpsl_sets, &r->sets, set)) == NULL)
+		return;
+
+	/* known from an earlier source, or a duplicate to be ignored */
+	for (;; prev = prev->next) {
+		if (prev->source == source) {
+			SX_DEBUG(debug_expander, "rpsl: duplicate %s in %s\n",
+			    set->name, r->sources[source]);
+			free(set->name);
+			bgpq_rpsl_list_free(&set->members);
+			bgpq_rpsl_list_free(&set->mbrsbyref);
+			free(set);
+			return;
+		}
+		if (prev->next == NULL)
+			break;
+	}
+	prev->next = set;
+}
+
+static int
+bgpq_rpsl_asn(const char *text, uint32_t *asn)
+{
+	char		*eon;
+	unsigned long	 n;
+
+	if (strncmp(text, "AS", 2) != 0 || !isdigit((unsigned char)text[2]))
+		return 0;
+
+	errno = 0;
+	n = strtoul(text + 2, &eon, 10);
+	if (*eon != '\0' || errno != 0 || n > UINT32_MAX)
+		return 0;
+
+	*asn = n;
+	return 1;
+}
+
+static void
+bgpq_rpsl_merge_route(struct bgpq_rpsl *r, struct rpsl_object *o,
+    unsigned int source)
+{
+	struct rpsl_origin	 key, *origin;
+
+	if (!bgpq_rpsl_asn(o->origin, &key.asn)) {
+		SX_DEBUG(debug_expander, "rpsl: invalid origin %s of %s\n",
+		    o->origin, o->key);
+		return;
+	}
+
+	if ((origin = RB_FIND(rpsl_origins, &r->origins, &key)) == NULL) {
+		if ((origin = calloc(1, sizeof(struct rpsl_origin))) == NULL)
+			err(1, NULL);
+		origin->asn = key.asn;
+		RB_INSERT(rpsl_origins, &r->origins, origin);
+	}
+
+	if (origin->nroutes == origin->routessize) {
+		origin->routessize = origin->routessize ?
+		    origin->routessize * 2 : 4;
+		origin->routes = realloc(origin->routes,
+		    origin->routessize * sizeof(struct rpsl_route));
+		if (origin->routes == NULL)
+			err(1, NULL);
+	}
+
+	origin->routes[origin->nroutes].source = source;
+	if ((origin->routes[origin->nroutes].prefix = strdup(o->key)) == NULL)
+		err(1, NULL);
+	origin->nroutes++;
+}
+
+/*
+ * Move the objects found in a chunk into the indices.  Objects claiming
+ * membership in sets are kept until all sets are known.
+ */
+static void
+bgpq_rpsl_merge(struct bgpq_rpsl *r, struct rpsl_chunk *c)
+{
+	struct rpsl_object	*o, *next;
+	unsigned int		 source;
+
+	for (o = c->head; o; o = next) {
+		next = o->next;
+		source = bgpq_rpsl_source(r, o->source);
+
+		switch (o->class) {
+		case RPSL_ASSET:
+		case RPSL_ROUTESET:
+			bgpq_rpsl_merge_set(r, o, source);
+			break;
+		case RPSL_ROUTE:
+		case RPSL_ROUTE6:
+			bgpq_rpsl_merge_route(r, o, source);
+			break;
+		}
+
+		if (o->memberof.n > 0) {
+			o->next = r->memberof;
+			r->memberof = o;
+		} else
+			bgpq_rpsl_object_free(o);
+	}
+}
+
+static int
+bgpq_rpsl_byref(struct rpsl_set *set, struct rpsl_object *o)
+{
+	size_t	i, j;
+
+	for (i = 0; i < set->mbrsbyref.n; i++) {
+		if (!strcmp(set->mbrsbyref.v[i], "ANY"))
+			return 1;
+		for (j = 0; j < o->mntby.n; j++)
+			if (!strcmp(set->mbrsbyref.v[i], o->mntby.v[j]))
+				return 1;
+	}
+
+	return 0;
+}
+
+static void
+bgpq_rpsl_resolve(struct bgpq_rpsl *r)
+{
+	struct rpsl_object	*o, *next;
+	struct rpsl_set		*set;
+	char			*member;
+	size_t			 i;
+
+	for (o = r->memberof; o; o = next) {
+		next = o->next;
+		for (i = 0; i < o->memberof.n; i++) {
+			set = bgpq_rpsl_set_source(r, o->memberof.v[i],
+			    bgpq_rpsl_source(r, o->source));
+			if (set == NULL || !bgpq_rpsl_byref(set, o) ||
+			    (set->class == RPSL_ASSET) !=
+			    (o->class == RPSL_AUTNUM)) {
+				SX_DEBUG(debug_expander > 2, "rpsl: %s is not"
+				    " a member of %s\n", o->key,
+				    o->memberof.v[i]);
+				continue;
+			}
+			if ((member = strdup(o->key)) == NULL)
+				err(1, NULL);
+			bgpq_rpsl_list_add(&set->members, member);
+		}
+		bgpq_rpsl_object_free(o);
+	}
+
+	r->memberof = NULL;
+}
+
+struct bgpq_rpsl *
+bgpq_rpsl_load(struct slentries *files)
+{
+	struct bgpq_rpsl	*r;
+	struct rpsl_file	*f;
+	struct rpsl_chunk	*chunks = NULL;
+	struct slentry		*se;
+	size_t			 nfiles = 0, nchunks = 0, chunkssize = 0, i;
+
+	if ((r = calloc(1, sizeof(struct bgpq_rpsl))) == NULL)
+		err(1, NULL);
+
+	RB_INIT(&r->sets);
+	RB_INIT(&r->origins);
+
+	STAILQ_FOREACH(se, files, entry)
+		nfiles++;
+
+	if ((f = calloc(nfiles, sizeof(struct rpsl_file))) == NULL)
+		err(1, NULL);
+
+	i = 0;
+	STAILQ_FOREACH(se, files, entry) {
+		bgpq_rpsl_read(se->text, &f[i]);
+		bgpq_rpsl_split(&f[i], sx_radix_threads, &chunks, &nchunks,
+		    &chunkssize);
+		i++;
+	}
+
+	bgpq_rpsl_parse_all(chunks, nchunks);
+
+	/* in order, so sources are ranked as they appear in the dumps */
+	for (i = 0; i < nchunks; i++)
+		bgpq_rpsl_merge(r, &chunks[i]);
+
+	bgpq_rpsl_resolve(r);
+
+	for (i = 0; i < nfiles; i++) {
+		if (f[i].mapped)
+			munmap(f[i].data, f[i].len);
+		else
+			free(f[i].data);
+	}
+	free(f);
+	free(chunks);
+
+	SX_DEBUG(debug_expander, "rpsl: loaded %zu file(s) in %zu chunk(s), "
+	    "%u source(s)\n", nfiles, nchunks, r->nsources);
+
+	return r;
+}
+
+/*
+ * All sources found in the dumps, in the order of their first appearance.
+ */
+char *
+bgpq_rpsl_sources(struct bgpq_rpsl *r)
+{
+	char		*sources;
+	size_t		 len = 1, off = 0;
+	unsigned int	 i;
+
+	for (i = 0; i < r->nsources; i++)
+		len += strlen(r->sources[i]) + 1;
+
+	if ((sources = calloc(1, len)) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < r->nsources; i++)
+		off += snprintf(sources + off, len - off, "%s%s",
+		    i > 0 ? "," : "", r->sources[i]);
+
+	return sources;
+}
+
+/*
+ * Map a comma separated list of sources to their index.  Returns the
+ * number of sources found, the first unknown one is stored in unknown.
+ */
+static unsigned int
+bgpq_rpsl_select(struct bgpq_rpsl *r, const char *sources, unsigned int *sel,
+    char *unknown, size_t unknownlen)
+{
+	const char	*t;
+	size_t		 len;
+	unsigned int	 i, n = 0;
+
+	while ((t = bgpq_rpsl_token(&sources, sources + strlen(sources),
+	    &len)) != NULL) {
+		for (i = 0; i < r->nsources; i++)
+			if (strlen(r->sources[i]) == len &&
+			    !strncasecmp(r->sources[i], t, len))
+				break;
+		if (i < r->nsources)
+			sel[n++] = i;
+		else if (unknown && unknown[0] == '\0')
+			snprintf(unknown, unknownlen, "%.*s", (int)len, t);
+	}
+
+	return n;
+}
+
+void
+bgpq_rpsl_check_sources(struct bgpq_rpsl *r, const char *sources)
+{
+	unsigned int	sel[r->nsources + 1];
+	char		unknown[128] = "";
+
+	bgpq_rpsl_select(r, sources, sel, unknown, sizeof(unknown));
+
+	if (unknown[0] != '\0')
+		sx_report(SX_FATAL, "Invalid source(s) '%s': %s not found in "
+		    "the dumps\n", sources, unknown);
+}
+
+static void
+bgpq_rpsl_emit(struct rpsl_reply *q, const char *text, const char *op)
+{
+	struct rpsl_seen	*seen;
+	size_t			 len;
+
+	len = strlen(text) + (op ? strlen(op) : 0);
+
+	if ((seen = malloc(sizeof(struct rpsl_seen))) == NULL)
+		err(1, NULL);
+	if ((seen->text = malloc(len + 1)) == NULL)
+		err(1, NULL);
+	snprintf(seen->text, len + 1, "%s%s", text, op ? op : "");
+
+	if (RB_INSERT(rpsl_seens, &q->seen, seen) != NULL) {
+		free(seen->text);
+		free(seen);
+		return;
+	}
+
+	if (q->buf.len + len + 2 > q->buf.size) {
+		q->buf.size = q->buf.size * 2 + len + 2;
+		if ((q->buf.data = realloc(q->buf.data, q->buf.size)) == NULL)
+			err(1, NULL);
+	}
+	memcpy(q->buf.data + q->buf.len, seen->text, len);
+	q->buf.len += len;
+	q->buf.data[q->buf.len++] = ' ';
+	q->buf.data[q->buf.len] = '\0';
+}
+
+/* the set of the first selected source that has one */
+static struct rpsl_set *
+bgpq_rpsl_find(struct rpsl_reply *q, const char *name)
+{
+	struct rpsl_set	*set;
+	unsigned int	 i;
+
+	for (i = 0; i < q->nsel; i++)
+		if ((set = bgpq_rpsl_set_source(q->r, name, q->sel[i])) != NULL)
+			return set;
+
+	return NULL;
+}
+
+static int
+bgpq_rpsl_routes(struct rpsl_reply *q, uint32_t asn, int family,
+    const char *op)
+{
+	struct rpsl_origin	 key, *origin;
+	size_t			 i;
+	unsigned int		 j;
+	int			 v6, found = 0;
+
+	key.asn = asn;
+	if ((origin = RB_FIND(rpsl_origins, &q->r->origins, &key)) == NULL)
+		return 0;
+
+	for (i = 0; i < origin->nroutes; i++) {
+		v6 = strchr(origin->routes[i].prefix, ':') != NULL;
+		if (family != AF_UNSPEC && (family == AF_INET6) != v6)
+			continue;
+		for (j = 0; j < q->nsel; j++)
+			if (q->sel[j] == origin->routes[i].source)
+				break;
+		if (j == q->nsel)
+			continue;
+		bgpq_rpsl_emit(q, origin->routes[i].prefix, op);
+		found = 1;
+	}
+
+	return found;
+}
+
+/*
+ * Expand a set recursively: as-sets to their AS numbers, or to the routes
+ * these originate when called for a route-set, and route-sets to their
+ * prefixes, with the range operator of the member or of the reference to
+ * the set applied.
+ */
+static void
+bgpq_rpsl_expand(struct rpsl_reply *q, struct rpsl_set *set, int routes,
+    const char *op)
+{
+	struct rpsl_set	*sub;
+	const char	*mop;
+	char		 name[256], *member;
+	uint32_t	 asn;
+	size_t		 i;
+
+	set->mark = q->r->mark;
+
+	for (i = 0; i < set->members.n; i++) {
+		member = set->members.v[i];
+
+		if (set->class == RPSL_ROUTESET &&
+		    (mop = strchr(member, '^')) != NULL) {
+			snprintf(name, sizeof(name), "%.*s",
+			    (int)(mop - member), member);
+		} else {
+			mop = op;
+			strlcpy(name, member, sizeof(name));
+		}
+
+		if (strchr(name, '/') != NULL) {
+			bgpq_rpsl_emit(q, name, mop);
+		} else if (bgpq_rpsl_asn(name, &asn)) {
+			if (routes || set->class == RPSL_ROUTESET)
+				bgpq_rpsl_routes(q, asn, AF_UNSPEC, mop);
+			else
+				bgpq_rpsl_emit(q, name, NULL);
+		} else if ((sub = bgpq_rpsl_find(q, name)) != NULL &&
+		    sub->mark != q->r->mark) {
+			bgpq_rpsl_expand(q, sub,
+			    routes || set->class == RPSL_ROUTESET, mop);
+		}
+	}
+}
+
+void
+bgpq_rpsl_query(struct bgpq_rpsl *r, const char *sources,
+    struct request *req)
+{
+	struct rpsl_reply	 q;
+	struct rpsl_seen	*seen, *next;
+	struct rpsl_set		*set;
+	unsigned int		 sel[r->nsources + 1];
+	char			 text[256], *c;
+	uint32_t		 asn;
+	size_t			 i;
+	int			 family, recursive = 0;
+
+	memset(&q, 0, sizeof(q));
+	q.r = r;
+	q.sel = sel;
+	q.nsel = bgpq_rpsl_select(r, sources, sel, NULL, 0);
+	RB_INIT(&q.seen);
+
+	snprintf(text, sizeof(text), "%.*s", (int)strcspn(req->request, "\n"),
+	    req->request);
+
+	req->cachedstatus = 'A';
+
+	if (!strncmp(text, "!gas", 4) || !strncmp(text, "!6as", 4)) {
+		family = text[1] == 'g' ? AF_INET : AF_INET6;
+		text[2] = 'A';
+		text[3] = 'S';
+		if (!bgpq_rpsl_asn(text + 2, &asn) ||
+		    !bgpq_rpsl_routes(&q, asn, family, NULL))
+			req->cachedstatus = 'C';
+	} else if (!strncmp(text, "!i", 2)) {
+		if ((c = strrchr(text, ',')) != NULL && !strcmp(c, ",1")) {
+			*c = '\0';
+			recursive = 1;
+		}
+		for (c = text + 2; *c; c++)
+			*c = toupper((unsigned char)*c);
+		r->mark++;
+		if ((set = bgpq_rpsl_find(&q, text + 2)) == NULL)
+			req->cachedstatus = 'D';
+		else if (recursive)
+			bgpq_rpsl_expand(&q, set, 0, NULL);
+		else {
+			for (i = 0; i < set->members.n; i++)
+				bgpq_rpsl_emit(&q, set->members.v[i], NULL);
+		}
+	} else {
+		sx_report(SX_ERROR, "Query %s is not supported with dumps\n",
+		    text);
+		req->cachedstatus = 'D';
+	}
+
+	if (req->cachedstatus == 'A' && q.buf.len == 0)
+		req->cachedstatus = 'C';
+
+	if (q.buf.data == NULL && (q.buf.data = strdup("")) == NULL)
+		err(1, NULL);
+
+	req->cached = q.buf.data;
+	req->cachedlen = q.buf.len;
+
+	for (seen = RB_MIN(rpsl_seens, &q.seen); seen; seen = next) {
+		next = RB_NEXT(rpsl_seens, &q.seen, seen);
+		RB_REMOVE(rpsl_seens, &q.seen, seen);
+		free(seen->text);
+		free(seen);
+	}
+
+	SX_DEBUG(debug_expander > 2, "rpsl: %s answered with %c, %zu bytes\n",
+	    text, req->cachedstatus, req->cachedlen);
+}
+
+void
+bgpq_rpsl_free(struct bgpq_rpsl *r)
+{
+	struct rpsl_set		*set, *snext, *chain;
+	struct rpsl_origin	*origin, *onext;
+	size_t			 i;
+
+	if (r == NULL)
+		return;
+
+	for (set = RB_MIN(rpsl_sets, &r->sets); set; set = snext) {
+		snext = RB_NEXT(rpsl_sets, &r->sets, set);
+		RB_REMOVE(rpsl_sets, &r->sets, set);
+		for (; set; set = chain) {
+			chain = set->next;
+			free(set->name);
+			bgpq_rpsl_list_free(&set->members);
+			bgpq_rpsl_list_free(&set->mbrsbyref);
+			free(set);
+		}
+	}
+
+	for (origin = RB_MIN(rpsl_origins, &r->origins); origin;
+	    origin = onext) {
+		onext = RB_NEXT(rpsl_origins, &r->origins, origin);
+		RB_REMOVE(rpsl_origins, &r->origins, origin);
+		for (i = 0; i < origin->nroutes; i++)
+			free(origin->routes[i].prefix);
+		free(origin->routes);
+		free(origin);
+	}
+
+	for (i = 0; i < r->nsources; i++)
+		free(r->sources[i]);
+	free(r->sources);
+	free(r);
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2019-2022 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Snapshots of expansion results.
+ *
+ * The ASNs and the prefix tree as they are right after expansion, before
+ * refine and aggregation, so a snapshot can be rendered with any output
+ * options later on.  Readers map the file and rebuild the tree from its
+ * records, which are laid out as:
+ *
+ *	header		struct snapshot_header
+ *	ASNs		nasns uint32_t, ascending
+ *	nodes		nnodes records in pre-order of the tree, each the
+ *			address (4 or 16 bytes) followed by masklen and the
+ *			low and high masklen of the range it matches
+ *
+ * Glue nodes are not stored.  All numbers are in the byte order of the
+ * writer, readers with a different one refuse the file.  Snapshots are
+ * written to a temporary name and renamed into place.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+#define SNAPSHOT_MAGIC		"bgpq4snp"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_BYTEORDER	0x01020304
+
+extern int debug_expander;
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteorder;
+	uint32_t	family;		/* 4 or 6 */
+	uint32_t	nasns;
+	uint64_t	nnodes;
+	uint64_t	asnoff;
+	uint64_t	nodeoff;
+};
+
+static size_t
+bgpq_snapshot_recsize(int family)
+{
+	return (family == AF_INET ? 4 : 16) + 4;
+}
+
+void
+bgpq_snapshot_write(struct bgpq_expander *b, const char *path)
+{
+	struct snapshot_header	 hdr;
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*n;
+	struct sx_asnset_iter	 ait;
+	unsigned char		 rec[20];
+	char			 tmp[PATH_MAX];
+	size_t			 nbytes, recsize;
+	uint32_t		 asn;
+	FILE			*f;
+	int			 fd, failed;
+
+	nbytes = b->family == AF_INET ? 4 : 16;
+	recsize = bgpq_snapshot_recsize(b->family);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		sx_report(SX_FATAL, "Unable to create %s: %s\n", tmp,
+		    strerror(errno));
+
+	/* mkstemp creates the file 0600, snapshots are meant to be shared */
+	fchmod(fd, 0644);
+
+	if ((f = fdopen(fd, "w")) == NULL)
+		err(1, NULL);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.byteorder = SNAPSHOT_BYTEORDER;
+	hdr.family = b->family == AF_INET ? 4 : 6;
+	hdr.asnoff = sizeof(hdr);
+
+	/* header is written again once the counts are known */
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	SX_ASNSET_FOREACH(asn, ait, &b->asnlist) {
+		fwrite(&asn, sizeof(asn), 1, f);
+		hdr.nasns++;
+	}
+
+	hdr.nodeoff = hdr.asnoff + (uint64_t)hdr.nasns * sizeof(uint32_t);
+
+	if (b->tree->head) {
+		sx_radix_iter_init(&it, b->tree->head,
+		    SX_RADIX_PREORDER | SX_RADIX_SONS);
+		while ((n = sx_radix_iter_next(&it)) != NULL) {
+			if (n->isGlue)
+				continue;
+			memcpy(rec, n->prefix.addr.addrs, nbytes);
+			rec[nbytes] = n->prefix.masklen;
+			rec[nbytes + 1] = n->isAggregate ? n->aggregateLow :
+			    n->prefix.masklen;
+			rec[nbytes + 2] = n->isAggregate ? n->aggregateHi :
+			    n->prefix.masklen;
+			rec[nbytes + 3] = 0;
+			fwrite(rec, recsize, 1, f);
+			hdr.nnodes++;
+		}
+	}
+
+	if (fseek(f, 0, SEEK_SET) == 0)
+		fwrite(&hdr, sizeof(hdr), 1, f);
+
+	failed = ferror(f);
+	if (fclose(f) != 0)
+		failed = 1;
+
+	if (failed || rename(tmp, path) == -1) {
+		unlink(tmp);
+		sx_report(SX_FATAL, "Unable to write snapshot %s: %s\n", path,
+		    strerror(errno));
+	}
+
+	SX_DEBUG(debug_expander, "snapshot: wrote %" PRIu32 " ASNs and %"
+	    PRIu64 " prefixes to %s\n", hdr.nasns, hdr.nnodes, path);
+}
+
+/*
+ * Load a snapshot in place of expanding objects.  Plain prefixes are
+ * handed to the bulk insert, ranges go in one by one.
+ */
+void
+bgpq_snapshot_read(struct bgpq_expander *b, const char *path)
+{
+	struct snapshot_header	 hdr;
+	struct sx_prefix	*ps = NULL, p;
+	const unsigned char	*map, *rec;
+	const uint32_t		*asns;
+	struct stat		 st;
+	size_t			 nbytes, recsize, nps = 0;
+	uint64_t		 i;
+	int			 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		sx_report(SX_FATAL, "Unable to open %s: %s\n", path,
+		    strerror(errno));
+
+	if (fstat(fd, &st) == -1)
+		sx_report(SX_FATAL, "Unable to stat %s: %s\n", path,
+		    strerror(errno));
+
+	if ((size_t)st.st_size < sizeof(hdr))
+		sx_report(SX_FATAL, "%s is not a snapshot\n", path);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		sx_report(SX_FATAL, "Unable to map %s: %s\n", path,
+		    strerror(errno));
+	close(fd);
+
+	memcpy(&hdr, map, sizeof(hdr));
+
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0)
+		sx_report(SX_FATAL, "%s is not a snapshot\n", path);
+	if (hdr.byteorder != SNAPSHOT_BYTEORDER)
+		sx_report(SX_FATAL, "Snapshot %s was written on a machine "
+		    "with different byte order\n", path);
+	if (hdr.version != SNAPSHOT_VERSION)
+		sx_report(SX_FATAL, "Snapshot %s has unsupported version %"
+		    PRIu32 "\n", path, hdr.version);
+	if (hdr.family != (b->family == AF_INET ? 4 : 6))
+		sx_report(SX_FATAL, "Snapshot %s holds IPv%" PRIu32 " prefixes"
+		    "%s\n", path, hdr.family, hdr.family == 6 ? ", use -6" :
+		    ", do not use -6");
+
+	nbytes = b->family == AF_INET ? 4 : 16;
+	recsize = bgpq_snapshot_recsize(b->family);
+
+	if (hdr.asnoff % sizeof(uint32_t) != 0 ||
+	    hdr.asnoff + (uint64_t)hdr.nasns * sizeof(uint32_t) >
+	    hdr.nodeoff || hdr.nodeoff > (uint64_t)st.st_size ||
+	    hdr.nnodes > ((uint64_t)st.st_size - hdr.nodeoff) / recsize)
+		sx_report(SX_FATAL, "Snapshot %s is truncated\n", path);
+
+	asns = (const uint32_t *)(map + hdr.asnoff);
+	/* ascending, every one is appended */
+	for (i = 0; i < hdr.nasns; i++)
+		sx_asnset_add(&b->asnlist, asns[i]);
+
+	if (hdr.nnodes > 0 &&
+	    (ps = calloc(hdr.nnodes, sizeof(struct sx_prefix))) == NULL)
+		err(1, NULL);
+
+	memset(&p, 0, sizeof(p));
+	p.family = b->family;
+
+	for (i = 0, rec = map + hdr.nodeoff; i < hdr.nnodes;
+	    i++, rec += recsize) {
+		memcpy(p.addr.addrs, rec, nbytes);
+		p.masklen = rec[nbytes];
+		if (p.masklen > nbytes * 8 || rec[nbytes + 1] < p.masklen ||
+		    rec[nbytes + 2] < rec[nbytes + 1] ||
+		    rec[nbytes + 2] > nbytes * 8)
+			sx_report(SX_FATAL, "Snapshot %s is corrupt\n", path);
+		if (rec[nbytes + 1] == p.masklen &&
+		    rec[nbytes + 2] == p.masklen)
+			ps[nps++] = p;
+		else
+			sx_radix_tree_insert_range(b->tree, &p,
+			    rec[nbytes + 1], rec[nbytes + 2]);
+	}
+
+	sx_radix_tree_insert_bulk(b->tree, ps, nps);
+	free(ps);
+
+	munmap((void *)map, st.st_size);
+
+	SX_DEBUG(debug_expander, "snapshot: read %" PRIu32 " ASNs and %"
+	    PRIu64 " prefixes from %s\n", hdr.nasns, hdr.nnodes, path);
+}
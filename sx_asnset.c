@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sx_asnset.h"
+
+/* an array of this many members takes as much memory as a bitmap */
+#define SX_ASNSET_ARRAY_MAX	4096
+#define SX_ASNSET_WORDS		(65536 / 64)
+
+void
+sx_asnset_init(struct sx_asnset *s)
+{
+	memset(s, 0, sizeof(struct sx_asnset));
+}
+
+void
+sx_asnset_clear(struct sx_asnset *s)
+{
+	uint32_t	i;
+
+	for (i = 0; i < s->nconts; i++) {
+		free(s->conts[i].array);
+		free(s->conts[i].bitmap);
+	}
+
+	free(s->conts);
+	sx_asnset_init(s);
+}
+
+/*
+ * Find the container for key, or the position it belongs to.
+ */
+static int
+sx_asnset_cont_find(const struct sx_asnset *s, uint16_t key, uint32_t *pos)
+{
+	uint32_t	lo = 0, hi = s->nconts, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->conts[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+
+	return lo < s->nconts && s->conts[lo].key == key;
+}
+
+static int
+sx_asnset_array_find(const struct sx_asnset_cont *c, uint16_t low,
+    uint32_t *pos)
+{
+	uint32_t	lo = 0, hi = c->card, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->array[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+
+	return lo < c->card && c->array[lo] == low;
+}
+
+static void
+sx_asnset_to_bitmap(struct sx_asnset_cont *c)
+{
+	uint32_t	i;
+
+	if ((c->bitmap = calloc(SX_ASNSET_WORDS, sizeof(uint64_t))) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < c->card; i++)
+		c->bitmap[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+
+	free(c->array);
+	c->array = NULL;
+	c->size = 0;
+}
+
+int
+sx_asnset_add(struct sx_asnset *s, uint32_t asn)
+{
+	struct sx_asnset_cont	*c;
+	uint16_t		 low = asn & 0xffff;
+	uint32_t		 i, j;
+
+	if (!sx_asnset_cont_find(s, asn >> 16, &i)) {
+		if (s->nconts == s->size) {
+			s->size = s->size ? s->size * 2 : 4;
+			s->conts = realloc(s->conts,
+			    s->size * sizeof(struct sx_asnset_cont));
+			if (s->conts == NULL)
+				err(1, NULL);
+		}
+		memmove(&s->conts[i + 1], &s->conts[i],
+		    (s->nconts - i) * sizeof(struct sx_asnset_cont));
+		memset(&s->conts[i], 0, sizeof(struct sx_asnset_cont));
+		s->conts[i].key = asn >> 16;
+		s->nconts++;
+	}
+
+	c = &s->conts[i];
+
+	if (c->bitmap == NULL && c->card == SX_ASNSET_ARRAY_MAX &&
+	    !sx_asnset_array_find(c, low, &j))
+		sx_asnset_to_bitmap(c);
+
+	if (c->bitmap != NULL) {
+		if (c->bitmap[low >> 6] & (1ULL << (low & 63)))
+			return 0;
+		c->bitmap[low >> 6] |= 1ULL << (low & 63);
+	} else {
+		if (sx_asnset_array_find(c, low, &j))
+			return 0;
+		if (c->card == c->size) {
+			c->size = c->size ? c->size * 2 : 4;
+			c->array = realloc(c->array, c->size * sizeof(uint16_t));
+			if (c->array == NULL)
+				err(1, NULL);
+		}
+		memmove(&c->array[j + 1], &c->array[j],
+		    (c->card - j) * sizeof(uint16_t));
+		c->array[j] = low;
+	}
+
+	c->card++;
+	s->count++;
+
+	return 1;
+}
+
+int
+sx_asnset_del(struct sx_asnset *s, uint32_t asn)
+{
+	struct sx_asnset_cont	*c;
+	uint16_t		 low = asn & 0xffff;
+	uint32_t		 i, j;
+
+	if (!sx_asnset_cont_find(s, asn >> 16, &i))
+		return 0;
+
+	c = &s->conts[i];
+
+	if (c->bitmap != NULL) {
+		if (!(c->bitmap[low >> 6] & (1ULL << (low & 63))))
+			return 0;
+		c->bitmap[low >> 6] &= ~(1ULL << (low & 63));
+	} else {
+		if (!sx_asnset_array_find(c, low, &j))
+			return 0;
+		memmove(&c->array[j], &c->array[j + 1],
+		    (c->card - j - 1) * sizeof(uint16_t));
+	}
+
+	c->card--;
+	s->count--;
+
+	if (c->card == 0) {
+		free(c->array);
+		free(c->bitmap);
+		memmove(&s->conts[i], &s->conts[i + 1],
+		    (s->nconts - i - 1) * sizeof(struct sx_asnset_cont));
+		s->nconts--;
+	}
+
+	return 1;
+}
+
+static int
+sx_asnset_cont_has(const struct sx_asnset_cont *c, uint16_t low)
+{
+	uint32_t	j;
+
+	if (c->bitmap != NULL)
+		return (c->bitmap[low >> 6] >> (low & 63)) & 1;
+
+	return sx_asnset_array_find(c, low, &j);
+}
+
+int
+sx_asnset_has(const struct sx_asnset *s, uint32_t asn)
+{
+	uint32_t	i;
+
+	if (!sx_asnset_cont_find(s, asn >> 16, &i))
+		return 0;
+
+	return sx_asnset_cont_has(&s->conts[i], asn & 0xffff);
+}
+
+static uint32_t
+sx_asnset_bitmap_card(const uint64_t *bitmap)
+{
+	uint32_t	i, card = 0;
+
+	for (i = 0; i < SX_ASNSET_WORDS; i++)
+		card += __builtin_popcountll(bitmap[i]);
+
+	return card;
+}
+
+static void
+sx_asnset_cont_copy(struct sx_asnset_cont *c, const struct sx_asnset_cont *a)
+{
+	*c = *a;
+
+	if (a->bitmap != NULL) {
+		c->bitmap = malloc(SX_ASNSET_WORDS * sizeof(uint64_t));
+		if (c->bitmap == NULL)
+			err(1, NULL);
+		memcpy(c->bitmap, a->bitmap,
+		    SX_ASNSET_WORDS * sizeof(uint64_t));
+	} else {
+		if ((c->array = malloc(a->card * sizeof(uint16_t))) == NULL)
+			err(1, NULL);
+		memcpy(c->array, a->array, a->card * sizeof(uint16_t));
+		c->size = a->card;
+	}
+}
+
+/*
+ * Two arrays are merged while the result fits an array, anything else
+ * is or-ed into a bitmap.
+ */
+static void
+sx_asnset_cont_union(struct sx_asnset_cont *c, const struct sx_asnset_cont *a)
+{
+	uint16_t	*array;
+	uint32_t	 i, j, n, size = c->card + a->card;
+
+	if (c->bitmap == NULL && a->bitmap == NULL &&
+	    size <= SX_ASNSET_ARRAY_MAX) {
+		if ((array = malloc(size * sizeof(uint16_t))) == NULL)
+			err(1, NULL);
+		for (i = j = n = 0; i < c->card || j < a->card; ) {
+			if (j == a->card ||
+			    (i < c->card && c->array[i] < a->array[j]))
+				array[n++] = c->array[i++];
+			else if (i == c->card || a->array[j] < c->array[i])
+				array[n++] = a->array[j++];
+			else {
+				array[n++] = c->array[i++];
+				j++;
+			}
+		}
+		free(c->array);
+		c->array = array;
+		c->size = size;
+		c->card = n;
+		return;
+	}
+
+	if (c->bitmap == NULL)
+		sx_asnset_to_bitmap(c);
+
+	if (a->bitmap != NULL)
+		for (i = 0; i < SX_ASNSET_WORDS; i++)
+			c->bitmap[i] |= a->bitmap[i];
+	else
+		for (i = 0; i < a->card; i++)
+			c->bitmap[a->array[i] >> 6] |=
+			    1ULL << (a->array[i] & 63);
+
+	c->card = sx_asnset_bitmap_card(c->bitmap);
+}
+
+static void
+sx_asnset_cont_diff(struct sx_asnset_cont *c, const struct sx_asnset_cont *a)
+{
+	uint32_t	i, n;
+
+	if (c->bitmap == NULL) {
+		for (i = n = 0; i < c->card; i++)
+			if (!sx_asnset_cont_has(a, c->array[i]))
+				c->array[n++] = c->array[i];
+		c->card = n;
+		return;
+	}
+
+	if (a->bitmap != NULL)
+		for (i = 0; i < SX_ASNSET_WORDS; i++)
+			c->bitmap[i] &= ~a->bitmap[i];
+	else
+		for (i = 0; i < a->card; i++)
+			c->bitmap[a->array[i] >> 6] &=
+			    ~(1ULL << (a->array[i] & 63));
+
+	c->card = sx_asnset_bitmap_card(c->bitmap);
+}
+
+/*
+ * Add the members of a to s, merging the two lists of containers.
+ */
+void
+sx_asnset_union(struct sx_asnset *s, const struct sx_asnset *a)
+{
+	struct sx_asnset_cont	*conts;
+	uint32_t		 i = 0, j = 0, n = 0, size;
+
+	if (a->nconts == 0 || s == a)
+		return;
+
+	size = s->nconts + a->nconts;
+	if ((conts = calloc(size, sizeof(struct sx_asnset_cont))) == NULL)
+		err(1, NULL);
+
+	s->count = 0;
+	while (i < s->nconts || j < a->nconts) {
+		if (j == a->nconts ||
+		    (i < s->nconts && s->conts[i].key < a->conts[j].key))
+			conts[n] = s->conts[i++];
+		else if (i == s->nconts || a->conts[j].key < s->conts[i].key)
+			sx_asnset_cont_copy(&conts[n], &a->conts[j++]);
+		else {
+			conts[n] = s->conts[i++];
+			sx_asnset_cont_union(&conts[n], &a->conts[j++]);
+		}
+		s->count += conts[n++].card;
+	}
+
+	free(s->conts);
+	s->conts = conts;
+	s->nconts = n;
+	s->size = size;
+}
+
+/*
+ * Remove the members of a from s, and the containers left empty.
+ */
+void
+sx_asnset_diff(struct sx_asnset *s, const struct sx_asnset *a)
+{
+	struct sx_asnset_cont	*c;
+	uint32_t		 i, j, n;
+
+	if (s == a) {
+		sx_asnset_clear(s);
+		return;
+	}
+
+	for (i = n = 0; i < s->nconts; i++) {
+		c = &s->conts[i];
+		if (sx_asnset_cont_find(a, c->key, &j)) {
+			s->count -= c->card;
+			sx_asnset_cont_diff(c, &a->conts[j]);
+			s->count += c->card;
+		}
+		if (c->card == 0) {
+			free(c->array);
+			free(c->bitmap);
+			continue;
+		}
+		s->conts[n++] = *c;
+	}
+
+	s->nconts = n;
+}
+
+void
+sx_asnset_iter_init(struct sx_asnset_iter *it, const struct sx_asnset *s)
+{
+	it->set = s;
+	it->cont = 0;
+	it->pos = 0;
+}
+
+/*
+ * The next member in ascending order.  pos is the index into the array
+ * of the container, or the next bit of its bitmap.
+ */
+int
+sx_asnset_iter_next(struct sx_asnset_iter *it, uint32_t *asn)
+{
+	const struct sx_asnset_cont	*c;
+	uint64_t			 word;
+
+	for (; it->cont < it->set->nconts; it->cont++, it->pos = 0) {
+		c = &it->set->conts[it->cont];
+
+		if (c->bitmap == NULL) {
+			if (it->pos < c->card) {
+				*asn = (uint32_t)c->key << 16 |
+				    c->array[it->pos++];
+				return 1;
+			}
+			continue;
+		}
+
+		while (it->pos < 65536) {
+			word = c->bitmap[it->pos >> 6] >> (it->pos & 63);
+			if (word == 0) {
+				it->pos = (it->pos | 63) + 1;
+				continue;
+			}
+			it->pos += __builtin_ctzll(word);
+			*asn = (uint32_t)c->key << 16 | it->pos++;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SX_ASNSET_H_
+#define SX_ASNSET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sets of AS numbers.  Members are split by their upper 16 bits into
+ * containers, which hold the lower 16 bits as a sorted array while
+ * sparse and as a bitmap once dense.  Insertion, removal and lookup are
+ * a search among few containers plus at most a short memmove, and
+ * iteration is ascending over contiguous memory.  Union and difference
+ * go a container at a time, merging arrays or combining bitmap words.
+ */
+
+struct sx_asnset_cont {
+	uint16_t	 key;		/* upper 16 bits of the members */
+	uint32_t	 card;		/* members in the container */
+	uint32_t	 size;		/* allocated array slots */
+	uint16_t	*array;		/* sorted, while sparse */
+	uint64_t	*bitmap;	/* once dense, or NULL */
+};
+
+struct sx_asnset {
+	struct sx_asnset_cont	*conts;		/* sorted by key */
+	uint32_t		 nconts, size;
+	size_t			 count;
+};
+
+struct sx_asnset_iter {
+	const struct sx_asnset	*set;
+	uint32_t		 cont, pos;
+};
+
+#define SX_ASNSET_INITIALIZER	{ NULL, 0, 0, 0 }
+
+void sx_asnset_init(struct sx_asnset *s);
+void sx_asnset_clear(struct sx_asnset *s);
+
+/* returns 1 if asn was added, 0 if it was there already */
+int sx_asnset_add(struct sx_asnset *s, uint32_t asn);
+/* returns 1 if asn was removed, 0 if it was not there */
+int sx_asnset_del(struct sx_asnset *s, uint32_t asn);
+int sx_asnset_has(const struct sx_asnset *s, uint32_t asn);
+
+/* add the members of a to s, or remove them from s */
+void sx_asnset_union(struct sx_asnset *s, const struct sx_asnset *a);
+void sx_asnset_diff(struct sx_asnset *s, const struct sx_asnset *a);
+
+#define sx_asnset_empty(s)	((s)->count == 0)
+#define sx_asnset_count(s)	((s)->count)
+
+void sx_asnset_iter_init(struct sx_asnset_iter *it, const struct sx_asnset *s);
+int sx_asnset_iter_next(struct sx_asnset_iter *it, uint32_t *asn);
+
+#define SX_ASNSET_FOREACH(asn, it, s)					\
+	for (sx_asnset_iter_init(&(it), (s));				\
+	    sx_asnset_iter_next(&(it), &(asn)); )
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <errno.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sx_event.h"
+#include "sx_report.h"
+
+#define SX_EVENT_BATCH	64	/* descriptors returned per epoll_wait */
+
+struct sx_event_fd {
+	sx_event_cb	 cb;		/* NULL if not registered */
+	void		*arg;
+	int		 events;	/* watched for */
+	int		 armed;		/* known to epoll */
+	uint32_t	 gen;
+};
+
+struct sx_event {
+	struct sx_event_fd	*fds;		/* indexed by descriptor */
+	int			 nfds;
+	uint32_t		 gen;
+#ifdef HAVE_SYS_EPOLL_H
+	int			 epfd;
+#else
+	struct pollfd		*pfds;
+	uint32_t		*pgens;
+	int			 npfds;
+#endif
+};
+
+struct sx_event *
+sx_event_new(void)
+{
+	struct sx_event	*ev;
+
+	if ((ev = calloc(1, sizeof(struct sx_event))) == NULL)
+		err(1, NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		sx_report(SX_FATAL, "epoll_create error %i: %s\n", errno,
+		    strerror(errno));
+#endif
+
+	return ev;
+}
+
+void
+sx_event_free(struct sx_event *ev)
+{
+	if (ev == NULL)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	close(ev->epfd);
+#else
+	free(ev->pfds);
+	free(ev->pgens);
+#endif
+	free(ev->fds);
+	free(ev);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Tell epoll what fd is watched for now.  Descriptors without events are
+ * removed, epoll keeps reporting errors and hangups otherwise.
+ */
+static void
+sx_event_arm(struct sx_event *ev, int fd)
+{
+	struct sx_event_fd	*f = &ev->fds[fd];
+	struct epoll_event	 ee;
+	int			 op;
+
+	if (f->events == f->armed)
+		return;
+
+	memset(&ee, 0, sizeof(ee));
+	if (f->events & SX_EVENT_READ)
+		ee.events |= EPOLLIN;
+	if (f->events & SX_EVENT_WRITE)
+		ee.events |= EPOLLOUT;
+	ee.data.u64 = (uint64_t)f->gen << 32 | (uint32_t)fd;
+
+	if (f->events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (f->armed == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	/* closed without being deleted first, epoll forgot about it */
+	if (epoll_ctl(ev->epfd, op, fd, &ee) == -1 && !(errno == ENOENT &&
+	    (op == EPOLL_CTL_DEL ||
+	    epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &ee) == 0)))
+		sx_report(SX_FATAL, "epoll_ctl error %i: %s\n", errno,
+		    strerror(errno));
+
+	f->armed = f->events;
+}
+#endif
+
+void
+sx_event_set(struct sx_event *ev, int fd, int events, sx_event_cb cb,
+    void *arg)
+{
+	struct sx_event_fd	*f;
+	int			 n;
+
+	if (fd < 0)
+		sx_report(SX_FATAL, "Unable to watch invalid descriptor %i\n",
+		    fd);
+
+	if (fd >= ev->nfds) {
+		n = ev->nfds ? ev->nfds * 2 : 64;
+		if (n <= fd)
+			n = fd + 1;
+		if ((ev->fds = realloc(ev->fds,
+		    n * sizeof(struct sx_event_fd))) == NULL)
+			err(1, NULL);
+		memset(ev->fds + ev->nfds, 0,
+		    (n - ev->nfds) * sizeof(struct sx_event_fd));
+		ev->nfds = n;
+	}
+
+	f = &ev->fds[fd];
+	if (f->cb == NULL)
+		f->gen = ++ev->gen;
+	f->cb = cb;
+	f->arg = arg;
+	f->events = events;
+
+#ifdef HAVE_SYS_EPOLL_H
+	sx_event_arm(ev, fd);
+#endif
+}
+
+void
+sx_event_del(struct sx_event *ev, int fd)
+{
+	struct sx_event_fd	*f;
+
+	if (fd < 0 || fd >= ev->nfds || ev->fds[fd].cb == NULL)
+		return;
+
+	f = &ev->fds[fd];
+	f->events = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	sx_event_arm(ev, fd);
+#endif
+	f->cb = NULL;
+	f->arg = NULL;
+}
+
+/*
+ * Call back fd if it is still registered as it was when the wait began:
+ * an earlier callback may have deleted it, or closed it and registered
+ * a new descriptor with the same number.
+ */
+static int
+sx_event_dispatch(struct sx_event *ev, int fd, uint32_t gen, int ready)
+{
+	struct sx_event_fd	*f;
+
+	if (fd >= ev->nfds)
+		return 0;
+
+	f = &ev->fds[fd];
+	if (f->cb == NULL || f->gen != gen)
+		return 0;
+
+	if ((ready &= f->events) == 0)
+		return 0;
+
+	f->cb(fd, ready, f->arg);
+
+	return 1;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+int
+sx_event_wait(struct sx_event *ev, int timeout)
+{
+	struct epoll_event	 ees[SX_EVENT_BATCH];
+	int			 i, n, ready, dispatched = 0;
+
+	n = epoll_wait(ev->epfd, ees, SX_EVENT_BATCH, timeout);
+	if (n == -1 && errno == EINTR)
+		return 0;
+	else if (n == -1)
+		sx_report(SX_FATAL, "epoll_wait error %i: %s\n", errno,
+		    strerror(errno));
+
+	for (i = 0; i < n; i++) {
+		ready = 0;
+		if (ees[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			ready |= SX_EVENT_READ;
+		if (ees[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			ready |= SX_EVENT_WRITE;
+		dispatched += sx_event_dispatch(ev,
+		    (int)(uint32_t)ees[i].data.u64,
+		    (uint32_t)(ees[i].data.u64 >> 32), ready);
+	}
+
+	return dispatched;
+}
+#else
+int
+sx_event_wait(struct sx_event *ev, int timeout)
+{
+	struct sx_event_fd	*f;
+	int			 fd, i, n = 0, ret, ready, dispatched = 0;
+
+	for (fd = 0; fd < ev->nfds; fd++) {
+		f = &ev->fds[fd];
+		if (f->cb == NULL || f->events == 0)
+			continue;
+		if (n == ev->npfds) {
+			ev->npfds = ev->npfds ? ev->npfds * 2 : 64;
+			if ((ev->pfds = realloc(ev->pfds,
+			    ev->npfds * sizeof(struct pollfd))) == NULL)
+				err(1, NULL);
+			if ((ev->pgens = realloc(ev->pgens,
+			    ev->npfds * sizeof(uint32_t))) == NULL)
+				err(1, NULL);
+		}
+		ev->pfds[n].fd = fd;
+		ev->pfds[n].events = 0;
+		if (f->events & SX_EVENT_READ)
+			ev->pfds[n].events |= POLLIN;
+		if (f->events & SX_EVENT_WRITE)
+			ev->pfds[n].events |= POLLOUT;
+		ev->pfds[n].revents = 0;
+		ev->pgens[n] = f->gen;
+		n++;
+	}
+
+	ret = poll(ev->pfds, n, timeout);
+	if (ret == -1 && errno == EINTR)
+		return 0;
+	else if (ret == -1)
+		sx_report(SX_FATAL, "poll error %i: %s\n", errno,
+		    strerror(errno));
+
+	for (i = 0; i < n && ret > 0; i++) {
+		if (ev->pfds[i].revents == 0)
+			continue;
+		ret--;
+		ready = 0;
+		if (ev->pfds[i].revents & (POLLIN | POLLERR | POLLHUP |
+		    POLLNVAL))
+			ready |= SX_EVENT_READ;
+		if (ev->pfds[i].revents & (POLLOUT | POLLERR | POLLHUP |
+		    POLLNVAL))
+			ready |= SX_EVENT_WRITE;
+		dispatched += sx_event_dispatch(ev, ev->pfds[i].fd,
+		    ev->pgens[i], ready);
+	}
+
+	return dispatched;
+}
+#endif
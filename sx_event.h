@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SX_EVENT_H_
+#define SX_EVENT_H_
+
+/*
+ * Readiness of descriptors, with epoll where available and poll
+ * otherwise.  There is no limit on the descriptor numbers.
+ */
+
+#define SX_EVENT_READ	0x01
+#define SX_EVENT_WRITE	0x02
+
+struct sx_event;
+
+typedef void (*sx_event_cb)(int fd, int events, void *arg);
+
+struct sx_event *sx_event_new(void);
+void sx_event_free(struct sx_event *ev);
+
+/*
+ * watch fd for events, calling cb once it is ready for any of them.
+ * Setting the events again replaces them, no events stop watching fd
+ * but keep it registered.
+ */
+void sx_event_set(struct sx_event *ev, int fd, int events, sx_event_cb cb,
+    void *arg);
+
+/* forget about fd, to be called before it is closed */
+void sx_event_del(struct sx_event *ev, int fd);
+
+/*
+ * wait up to timeout milliseconds, or forever if -1, and call back the
+ * descriptors that are ready.  Returns the number of them.
+ */
+int sx_event_wait(struct sx_event *ev, int timeout);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sx_names.h"
+
+#define SX_NAMES_BUCKETS	64
+
+void
+sx_names_init(struct sx_names *t)
+{
+	memset(t, 0, sizeof(struct sx_names));
+}
+
+void
+sx_names_clear(struct sx_names *t)
+{
+	struct sx_name	*n, *next;
+	size_t		 i;
+
+	for (i = 0; i < t->nbuckets; i++) {
+		for (n = t->buckets[i]; n != NULL; n = next) {
+			next = n->next;
+			free(n);
+		}
+	}
+
+	free(t->buckets);
+	sx_names_init(t);
+}
+
+/* FNV-1a over the lower-cased name */
+static uint32_t
+sx_names_hash(const char *name)
+{
+	uint32_t	h = 2166136261u;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)tolower((unsigned char)*name);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct sx_name *
+sx_names_lookup(const struct sx_names *t, const char *name, uint32_t hash)
+{
+	struct sx_name	*n;
+
+	if (t->nbuckets == 0)
+		return NULL;
+
+	for (n = t->buckets[hash & (t->nbuckets - 1)]; n != NULL; n = n->next) {
+		if (n->hash == hash && strcasecmp(n->name, name) == 0)
+			return n;
+	}
+
+	return NULL;
+}
+
+struct sx_name *
+sx_names_find(const struct sx_names *t, const char *name)
+{
+	return sx_names_lookup(t, name, sx_names_hash(name));
+}
+
+static void
+sx_names_grow(struct sx_names *t)
+{
+	struct sx_name	**buckets, *n, *next;
+	size_t		  nbuckets, i;
+
+	nbuckets = t->nbuckets ? t->nbuckets * 2 : SX_NAMES_BUCKETS;
+
+	if ((buckets = calloc(nbuckets, sizeof(struct sx_name *))) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < t->nbuckets; i++) {
+		for (n = t->buckets[i]; n != NULL; n = next) {
+			next = n->next;
+			n->next = buckets[n->hash & (nbuckets - 1)];
+			buckets[n->hash & (nbuckets - 1)] = n;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nbuckets = nbuckets;
+}
+
+struct sx_name *
+sx_names_get(struct sx_names *t, const char *name)
+{
+	struct sx_name	*n;
+	uint32_t	 hash = sx_names_hash(name);
+	size_t		 len;
+
+	if ((n = sx_names_lookup(t, name, hash)) != NULL)
+		return n;
+
+	/* at most one entry per bucket on average */
+	if (t->count >= t->nbuckets)
+		sx_names_grow(t);
+
+	len = strlen(name);
+	if ((n = malloc(sizeof(struct sx_name) + len + 1)) == NULL)
+		err(1, NULL);
+
+	n->hash = hash;
+	n->flags = 0;
+	n->mark = 0;
+	memcpy(n->name, name, len + 1);
+
+	n->next = t->buckets[hash & (t->nbuckets - 1)];
+	t->buckets[hash & (t->nbuckets - 1)] = n;
+	t->count++;
+
+	return n;
+}
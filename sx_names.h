@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2019-2021 Job Snijders <job@sobornost.net>
+ * Copyright (c) 2007-2019 Alexandre Snarskii <snar@snar.spb.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SX_NAMES_H_
+#define SX_NAMES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Interned object names.  Names are hashed and compared without regard
+ * to case, as RPSL does, so every spelling of a name maps to the same
+ * entry and checks on it are a pointer away.  The flags and the mark
+ * belong to the user of the table.
+ */
+
+struct sx_name {
+	struct sx_name	*next;		/* in the hash chain */
+	uint32_t	 hash;
+	unsigned int	 flags;
+	unsigned int	 mark;
+	char		 name[];	/* as first seen */
+};
+
+struct sx_names {
+	struct sx_name	**buckets;
+	size_t		 nbuckets, count;
+};
+
+void sx_names_init(struct sx_names *t);
+void sx_names_clear(struct sx_names *t);
+
+/* the entry for name, NULL if there is none */
+struct sx_name *sx_names_find(const struct sx_names *t, const char *name);
+/* the entry for name, added if there is none */
+struct sx_name *sx_names_get(struct sx_names *t, const char *name);
+
+#endif
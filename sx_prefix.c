@@ -28,8 +28,12 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 
@@ -37,6 +41,8 @@
 #include "sx_report.h"
 
 int debug_aggregation = 0;
+int sx_radix_threads = 1;
+int sx_radix_split = 8;
 extern int debug_expander;
 
 struct sx_prefix *
@@ -62,19 +68,27 @@ sx_prefix_free(struct sx_prefix *p)
 		free(p);
 }
 
+/*
+ * Nodes are carved from per-tree slabs and never handed back to malloc
+ * one by one: unlinked nodes go to the tree's freelist and the whole tree
+ * is released at once by sx_radix_tree_free().
+ */
+#define SX_RADIX_SLAB_NODES	1024
+
+struct sx_radix_slab {
+	struct sx_radix_node	 nodes[SX_RADIX_SLAB_NODES];
+	struct sx_radix_slab	*next;
+	unsigned int		 used;
+};
+
 void
-sx_radix_node_destroy(struct sx_radix_node *n)
+sx_radix_node_destroy(struct sx_radix_tree *tree, struct sx_radix_node *n)
 {
 	if (!n)
 		return;
 
-	if (n->payload)
-		free(n->payload);
-
-	if (n->prefix)
-		free(n->prefix);
-
-	free(n);
+	n->parent = tree->freelist;
+	tree->freelist = n;
 }
 
 void
@@ -227,19 +241,14 @@ fixups:
 	return 0;
 }
 
-static int
+static inline int
 sx_prefix_isbitset(struct sx_prefix *p, int n)
 {
-	unsigned char	s;
-
 	/* bits outside the prefix considered unset */
-	if (p->family == AF_INET && (n < 0 || n > 32))
-		return 0;
-	else if (p->family == AF_INET6 && (n < 0 || n > 128))
+	if (n < 1 || n > (p->family == AF_INET ? 32 : 128))
 		return 0;
-	s = p->addr.addrs[(n - 1) / 8];
 
-	return (s & (0x80 >> ((n - 1) % 8))) ? 1 : 0;
+	return (p->addr.addrs[(n - 1) >> 3] >> (7 - ((n - 1) & 7))) & 1;
 }
 
 static void
@@ -258,22 +267,27 @@ sx_prefix_setbit(struct sx_prefix *p, int n)
 }
 
 
-static int
-sx_radix_tree_insert_specifics(struct sx_radix_tree *t, struct sx_prefix p,
-    unsigned min, unsigned max)
+/*
+ * Call func for every more-specific of p with masklen in [min, max]. Used
+ * by printers which have no notation for prefix-ranges.
+ */
+void
+sx_prefix_range_foreach(struct sx_prefix *p, unsigned int min,
+    unsigned int max, void (*func)(struct sx_prefix *, void *), void *udata)
 {
-	if (p.masklen >= min)
-		sx_radix_tree_insert(t, &p);
+	struct sx_prefix	q;
 
-	if (p.masklen + 1 > max)
-		return 1;
+	if (p->masklen >= min)
+		func(p, udata);
 
-	p.masklen += 1;
-	sx_radix_tree_insert_specifics(t, p, min, max);
-	sx_prefix_setbit(&p, p.masklen);
-	sx_radix_tree_insert_specifics(t, p, min, max);
+	if (p->masklen + 1 > max)
+		return;
 
-	return 1;
+	q = *p;
+	q.masklen += 1;
+	sx_prefix_range_foreach(&q, min, max, func, udata);
+	sx_prefix_setbit(&q, q.masklen);
+	sx_prefix_range_foreach(&q, min, max, func, udata);
 }
 
 int
@@ -324,6 +338,9 @@ sx_prefix_range_parse(struct sx_radix_tree *tree, int af, unsigned int maxlen,
 			sx_report(SX_ERROR, "Unable to parse prefix-range "
 			    "%s\n", text);
 			return 0;
+		} else {
+			/* ^n stands for "exactly n" */
+			max = min;
 		}
 	} else {
 		sx_report(SX_ERROR, "Invalid prefix-range %s\n", text);
@@ -336,11 +353,11 @@ sx_prefix_range_parse(struct sx_radix_tree *tree, int af, unsigned int maxlen,
 		return 0;
 	}
 
-	if (af == AF_INET && max > 32) {
+	if (p.family == AF_INET && max > 32) {
 		sx_report(SX_ERROR, "Invalid prefix-range %s: max %lu > "
 		    "32\n", text, max);
 		return 0;
-	} else if (af == AF_INET6 && max > 128) {
+	} else if (p.family == AF_INET6 && max > 128) {
 		sx_report(SX_ERROR, "Invalid ipv6 prefix-range %s: max %lu > "
 		    "128\n", text, max);
 		return 0;
@@ -352,7 +369,8 @@ sx_prefix_range_parse(struct sx_radix_tree *tree, int af, unsigned int maxlen,
 	SX_DEBUG(debug_expander, "parsed prefix-range %s as %lu-%lu (maxlen: "
 	    "%u)\n", text, min, max, maxlen);
 
-	sx_radix_tree_insert_specifics(tree, p, min, max);
+	if (min <= max)
+		sx_radix_tree_insert_range(tree, &p, min, max);
 
 	return 1;
 }
@@ -395,7 +413,7 @@ sx_prefix_fprint(FILE *f, struct sx_prefix *p)
 int
 sx_prefix_snprintf_sep(struct sx_prefix *p, char *rbuffer, int srb, char *sep)
 {
-	char buffer[128];
+	char buffer[INET6_ADDRSTRLEN];
 
 	if (!sep)
 		sep="/";
@@ -422,7 +440,7 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
     unsigned int aggregateLow, unsigned int aggregateHi)
 {
 	const char		*c = format;
-	struct sx_prefix	*q = sx_prefix_alloc(NULL);
+	struct sx_prefix	 q;
 	char			 prefix[128];
 
 	while (*c) {
@@ -453,8 +471,8 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
 				fprintf(f, "%s", name);
 				break;
 			case 'm':
-				sx_prefix_mask(p, q);
-				if (NULL != inet_ntop(p->family, &q->addr, prefix, sizeof(prefix))) {
+				sx_prefix_mask(p, &q);
+				if (NULL != inet_ntop(p->family, &q.addr, prefix, sizeof(prefix))) {
 					fprintf(f, "%s", prefix);
 				} else {
 					sx_report(SX_ERROR, "inet_ntop failed\n");
@@ -462,8 +480,8 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
 				}
 				break;
 			case 'i':
-				sx_prefix_imask(p, q);
-				if (NULL != inet_ntop(p->family, &q->addr, prefix, sizeof(prefix))) {
+				sx_prefix_imask(p, &q);
+				if (NULL != inet_ntop(p->family, &q.addr, prefix, sizeof(prefix))) {
 					fprintf(f, "%s", prefix);
 				} else {
 					sx_report(SX_ERROR, "inet_ntop failed\n");
@@ -533,47 +551,105 @@ sx_radix_tree_empty(struct sx_radix_tree *t)
 	return t->head == NULL;
 }
 
+static void
+sx_radix_slabs_free(struct sx_radix_slab *slab)
+{
+	struct sx_radix_slab *next;
+
+	for (; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+}
+
+void
+sx_radix_tree_free(struct sx_radix_tree *tree)
+{
+	if (!tree)
+		return;
+
+	sx_radix_slabs_free(tree->slabs);
+	free(tree);
+}
+
 struct sx_radix_node *
-sx_radix_node_new(struct sx_prefix *prefix)
+sx_radix_node_new(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 {
 	struct sx_radix_node *rn;
+	struct sx_radix_slab *slab;
 
-	if ((rn = malloc(sizeof(struct sx_radix_node))) == NULL)
-		err(1, NULL);
+	if ((rn = tree->freelist) != NULL) {
+		tree->freelist = rn->parent;
+	} else {
+		slab = tree->slabs;
+		if (!slab || slab->used == SX_RADIX_SLAB_NODES) {
+			/* keep nodes on cache line boundaries */
+			if ((errno = posix_memalign((void **)&slab, 64,
+			    sizeof(struct sx_radix_slab))) != 0)
+				err(1, NULL);
+			slab->next = tree->slabs;
+			slab->used = 0;
+			tree->slabs = slab;
+		}
+		rn = &slab->nodes[slab->used++];
+	}
 
 	memset(rn, 0, sizeof(struct sx_radix_node));
 
 	if (prefix)
-		rn->prefix = sx_prefix_alloc(prefix);
+		rn->prefix = *prefix;
 
 	return rn;
 }
 
-static int
-sx_prefix_eqbits(struct sx_prefix *a, struct sx_prefix *b)
+static inline uint32_t
+sx_prefix_word(struct sx_prefix *p, unsigned int i)
 {
-	unsigned int	i;
-	unsigned int	nbytes = (a->family == AF_INET ? 4 : 16);
+	uint32_t	w;
 
-	for (i = 0; i < nbytes; i++) {
+	memcpy(&w, p->addr.addrs + i * 4, sizeof(w));
 
-		if (a->addr.addrs[i] == b->addr.addrs[i])
-			continue;
-		else {
-			unsigned int j;
-			for (j = 0; j < 8 && i * 8 + j <= a->masklen
-			    && i * 8 + j <= b->masklen; j++) {
-				if ((a->addr.addrs[i] & (0x80 >> j))
-				    != (b->addr.addrs[i] & (0x80 >> j)))
-					return i * 8 + j;
-			}
-		}
+	return ntohl(w);
+}
+
+static inline unsigned int
+sx_clz32(uint32_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_clz(x);
+#else
+	unsigned int n = 0;
+
+	while (!(x & 0x80000000)) {
+		x <<= 1;
+		n++;
 	}
 
-	if (a->masklen < b->masklen)
-		return a->masklen;
+	return n;
+#endif
+}
 
-	return b->masklen;
+/*
+ * Number of leading bits a and b have in common, capped by the shorter
+ * masklen. Compares a 32-bit word at a time: one word for IPv4, up to
+ * four for IPv6.
+ */
+static int
+sx_prefix_eqbits(struct sx_prefix *a, struct sx_prefix *b)
+{
+	unsigned int	i, nwords = (a->family == AF_INET ? 1 : 4);
+	unsigned int	ml = (a->masklen < b->masklen ? a->masklen : b->masklen);
+	uint32_t	x;
+
+	for (i = 0; i < nwords && i * 32 < ml; i++) {
+		x = sx_prefix_word(a, i) ^ sx_prefix_word(b, i);
+		if (x) {
+			i = i * 32 + sx_clz32(x);
+			return i < ml ? i : ml;
+		}
+	}
+
+	return ml;
 }
 
 struct sx_prefix *
@@ -612,7 +688,7 @@ next:
 			sx_report(SX_ERROR,"Unlinking node with no parent and"
 			    " not root\n");
 		}
-		sx_radix_node_destroy(node);
+		sx_radix_node_destroy(tree, node);
 		return;
 	} else if (node->l) {
 		if (node->parent) {
@@ -632,7 +708,7 @@ next:
 		} else {
 			sx_report(SX_ERROR,"Unlinking node with no parent and not root\n");
 		}
-		sx_radix_node_destroy(node);
+		sx_radix_node_destroy(tree, node);
 		return;
 	} else {
 		/* the only case - node does not have descendants */
@@ -656,7 +732,7 @@ next:
 			sx_report(SX_ERROR, "Unlinking node with no parent and"
 			    " not root\n");
 		}
-		sx_radix_node_destroy(node);
+		sx_radix_node_destroy(tree, node);
 		return;
 	}
 }
@@ -680,13 +756,13 @@ sx_radix_tree_lookup(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 	chead = tree->head;
 
 next:
-	eb = sx_prefix_eqbits(chead->prefix, prefix);
-	if (eb == chead->prefix->masklen && eb == prefix->masklen) {
+	eb = sx_prefix_eqbits(&chead->prefix, prefix);
+	if (eb == chead->prefix.masklen && eb == prefix->masklen) {
 		/* they are equal */
 		if (chead->isGlue)
 			return candidate;
 		return chead;
-	} else if (eb < chead->prefix->masklen) {
+	} else if (eb < chead->prefix.masklen) {
 		return candidate;
 	} else if (eb < prefix->masklen) {
 		/* it equals chead->masklen */
@@ -718,7 +794,7 @@ next:
 	} else {
 		char pbuffer[128], cbuffer[128];
 		sx_prefix_snprintf(prefix, pbuffer, sizeof(pbuffer));
-		sx_prefix_snprintf(chead->prefix, cbuffer, sizeof(cbuffer));
+		sx_prefix_snprintf(&chead->prefix, cbuffer, sizeof(cbuffer));
 		printf("Unreachable point... eb=%i, prefix=%s, chead=%s\n",
 		    eb, pbuffer, cbuffer);
 		abort();
@@ -726,8 +802,12 @@ next:
 }
 
 
-struct sx_radix_node *
-sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
+/*
+ * Find or create the node for prefix. Newly created nodes are glue: they
+ * do not match anything until a range is added to them.
+ */
+static struct sx_radix_node *
+sx_radix_tree_link(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 {
 	unsigned int eb;
 	struct sx_radix_node *chead, **candidate = NULL;
@@ -739,7 +819,8 @@ sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 		return NULL;
 
 	if (!tree->head) {
-		tree->head = sx_radix_node_new(prefix);
+		tree->head = sx_radix_node_new(tree, prefix);
+		tree->head->isGlue = 1;
 		return tree->head;
 	}
 
@@ -747,21 +828,15 @@ sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 	chead = tree->head;
 
  next:
-	eb = sx_prefix_eqbits(prefix, chead->prefix);
-	if (eb < prefix->masklen && eb < chead->prefix->masklen) {
-		struct sx_prefix *neoRoot = sx_prefix_alloc(prefix);
-		
-		struct sx_radix_node *rn, *ret=sx_radix_node_new(prefix);
-		neoRoot->masklen = eb;
-		sx_prefix_adjust_masklen(neoRoot);
-		rn=sx_radix_node_new(neoRoot);
-                sx_prefix_free(neoRoot);
-                neoRoot = rn->prefix;
-		if (!rn) {
-			sx_report(SX_ERROR,"Unable to create node: %s\n",
-			    strerror(errno));
-			return NULL;
-		}
+	eb = sx_prefix_eqbits(prefix, &chead->prefix);
+	if (eb < prefix->masklen && eb < chead->prefix.masklen) {
+		struct sx_prefix neoRoot = *prefix;
+		struct sx_radix_node *rn, *ret = sx_radix_node_new(tree, prefix);
+
+		ret->isGlue = 1;
+		neoRoot.masklen = eb;
+		sx_prefix_adjust_masklen(&neoRoot);
+		rn = sx_radix_node_new(tree, &neoRoot);
 
 		if (sx_prefix_isbitset(prefix, eb + 1)) {
 			rn->l = chead;
@@ -777,9 +852,10 @@ sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 		rn->isGlue = 1;
 		*candidate = rn;
 		return ret;
-	} else if (eb == prefix->masklen && eb < chead->prefix->masklen) {
-		struct sx_radix_node *ret = sx_radix_node_new(prefix);
-		if (sx_prefix_isbitset(chead->prefix, eb + 1))
+	} else if (eb == prefix->masklen && eb < chead->prefix.masklen) {
+		struct sx_radix_node *ret = sx_radix_node_new(tree, prefix);
+		ret->isGlue = 1;
+		if (sx_prefix_isbitset(&chead->prefix, eb + 1))
 			ret->r = chead;
 		else
 			ret->l = chead;
@@ -787,14 +863,15 @@ sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 		chead->parent = ret;
 		*candidate = ret;
 		return ret;
-	} else if (eb == chead->prefix->masklen && eb < prefix->masklen) {
+	} else if (eb == chead->prefix.masklen && eb < prefix->masklen) {
 		if (sx_prefix_isbitset(prefix, eb + 1)) {
 			if (chead->r) {
 				candidate = &chead->r;
 				chead = chead->r;
 				goto next;
 			} else {
-				chead->r = sx_radix_node_new(prefix);
+				chead->r = sx_radix_node_new(tree, prefix);
+				chead->r->isGlue = 1;
 				chead->r->parent = chead;
 				return chead->r;
 			}
@@ -804,27 +881,542 @@ sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
 				chead = chead->l;
 				goto next;
 			} else {
-				chead->l = sx_radix_node_new(prefix);
+				chead->l = sx_radix_node_new(tree, prefix);
+				chead->l->isGlue = 1;
 				chead->l->parent = chead;
 				return chead->l;
 			}
 		}
-	} else if (eb == chead->prefix->masklen && eb == prefix->masklen) {
+	} else if (eb == chead->prefix.masklen && eb == prefix->masklen) {
 		/* equal routes... */
-		if (chead->isGlue) {
-			chead->isGlue = 0;
-		}
 		return chead;
 	} else {
 		char pbuffer[128], cbuffer[128];
 		sx_prefix_snprintf(prefix, pbuffer, sizeof(pbuffer));
-		sx_prefix_snprintf(chead->prefix, cbuffer, sizeof(cbuffer));
+		sx_prefix_snprintf(&chead->prefix, cbuffer, sizeof(cbuffer));
 		printf("Unreachable point... eb=%i, prefix=%s, chead=%s\n", eb,
 		    pbuffer, cbuffer);
 		abort();
 	}
 }
 
+#if defined(__GNUC__)
+#define SX_PREFETCH(p)	__builtin_prefetch(p)
+#else
+#define SX_PREFETCH(p)
+#endif
+
+/* iterator states, in the order a node goes through them */
+#define SX_ITER_PRE	0
+#define SX_ITER_LEFT	1
+#define SX_ITER_IN	2
+#define SX_ITER_RIGHT	3
+#define SX_ITER_POST	4
+
+/*
+ * Pre-order walks keep the pending nodes and their depth on the stack;
+ * the children of the last returned node are pushed only when the next
+ * one is asked for, so that sx_radix_iter_skip() can leave them out.
+ * Other orders keep the path from the head and the state of every node
+ * on it.
+ */
+void
+sx_radix_iter_init(struct sx_radix_iter *it, struct sx_radix_node *node,
+    int flags)
+{
+	it->flags = flags;
+	it->depth = 0;
+	it->son = NULL;
+	it->last = NULL;
+	it->sp = 0;
+
+	if (node) {
+		it->stack[0].node = node;
+		it->stack[0].state = 0;
+		it->sp = 1;
+	}
+}
+
+static struct sx_radix_node *
+sx_radix_iter_visit(struct sx_radix_iter *it, struct sx_radix_node *node,
+    int depth)
+{
+	it->depth = depth;
+	if (it->flags & SX_RADIX_SONS)
+		it->son = node->son;
+
+	return node;
+}
+
+/*
+ * Pre-order is what most walks use, so it is kept small enough to be
+ * inlined into the loops of this file.
+ */
+static inline struct sx_radix_node *
+sx_radix_iter_next_pre(struct sx_radix_iter *it)
+{
+	struct sx_radix_node	*n;
+
+	if ((n = it->son) != NULL) {
+		it->son = n->son;
+		return n;
+	}
+
+	if ((n = it->last) != NULL) {
+		if (n->r) {
+			SX_PREFETCH(n->r);
+			it->stack[it->sp].node = n->r;
+			it->stack[it->sp++].state = it->depth + 1;
+		}
+		if (n->l) {
+			SX_PREFETCH(n->l);
+			it->stack[it->sp].node = n->l;
+			it->stack[it->sp++].state = it->depth + 1;
+		}
+	}
+
+	if (it->sp == 0)
+		return (it->last = NULL);
+
+	it->sp--;
+	it->last = it->stack[it->sp].node;
+
+	return sx_radix_iter_visit(it, it->last, it->stack[it->sp].state);
+}
+
+struct sx_radix_node *
+sx_radix_iter_next(struct sx_radix_iter *it)
+{
+	struct sx_radix_node	*n;
+	int			 order = it->flags & 3;
+
+	if (order == SX_RADIX_PREORDER)
+		return sx_radix_iter_next_pre(it);
+
+	if ((n = it->son) != NULL) {
+		it->son = n->son;
+		return n;
+	}
+
+	while (it->sp > 0) {
+		n = it->stack[it->sp - 1].node;
+
+		switch (it->stack[it->sp - 1].state++) {
+		case SX_ITER_PRE:
+			/* both children are needed soon, start loading them */
+			SX_PREFETCH(n->l);
+			SX_PREFETCH(n->r);
+			break;
+		case SX_ITER_LEFT:
+		case SX_ITER_RIGHT:
+			if (it->stack[it->sp - 1].state == SX_ITER_IN)
+				n = n->l;
+			else
+				n = n->r;
+			if (n) {
+				it->stack[it->sp].node = n;
+				it->stack[it->sp].state = SX_ITER_PRE;
+				it->sp++;
+			}
+			break;
+		case SX_ITER_IN:
+			if (order == SX_RADIX_INORDER)
+				return sx_radix_iter_visit(it, n, it->sp - 1);
+			break;
+		default:
+			it->sp--;
+			if (order == SX_RADIX_POSTORDER)
+				return sx_radix_iter_visit(it, n, it->sp);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Do not descend into the children of the node just returned by a
+ * pre-order walk.
+ */
+void
+sx_radix_iter_skip(struct sx_radix_iter *it)
+{
+	it->last = NULL;
+}
+
+/*
+ * Every non-glue node (and every non-glue node on its son chain) matches
+ * the more-specifics of node->prefix with masklen in [low, high]. Plain
+ * routes are the degenerate case low == high == masklen.
+ */
+static unsigned int
+sx_radix_node_low(struct sx_radix_node *n)
+{
+	return n->isAggregate ? n->aggregateLow : n->prefix.masklen;
+}
+
+static unsigned int
+sx_radix_node_high(struct sx_radix_node *n)
+{
+	return n->isAggregate ? n->aggregateHi : n->prefix.masklen;
+}
+
+static void
+sx_radix_node_set_range(struct sx_radix_node *n, unsigned int low,
+    unsigned int hi)
+{
+	n->isGlue = 0;
+
+	if (low == n->prefix.masklen && hi == n->prefix.masklen) {
+		n->isAggregate = 0;
+		n->aggregateLow = n->aggregateHi = 0;
+	} else {
+		n->isAggregate = 1;
+		n->aggregateLow = low;
+		n->aggregateHi = hi;
+	}
+}
+
+/*
+ * Cut [alow, ahi] off either end of [*low, *hi]. A range which strictly
+ * contains [alow, ahi] is left as is. Returns 0 when nothing is left.
+ */
+static int
+sx_radix_range_trim(unsigned int *low, unsigned int *hi, unsigned int alow,
+    unsigned int ahi)
+{
+	if (*low >= alow && *low <= ahi)
+		*low = ahi + 1;
+	else if (*hi >= alow && *hi <= ahi)
+		*hi = alow - 1;
+
+	return *low <= *hi;
+}
+
+/*
+ * Merge [low, hi] into the ranges of node, extending an overlapping or
+ * adjacent range where possible and appending to the son chain otherwise.
+ */
+static void
+sx_radix_node_add_range(struct sx_radix_tree *tree, struct sx_radix_node *node,
+    unsigned int low, unsigned int hi)
+{
+	struct sx_radix_node	*n, *merged = NULL, *spare = NULL, *last = NULL;
+	unsigned int		 nlow, nhi;
+
+	for (n = node; n; n = n->son) {
+		last = n;
+		if (n->isGlue) {
+			if (!spare)
+				spare = n;
+			continue;
+		}
+		nlow = sx_radix_node_low(n);
+		nhi = sx_radix_node_high(n);
+		if (nlow > hi + 1 || low > nhi + 1)
+			continue;
+		/* overlapping or adjacent: absorb into the first match */
+		if (nlow < low)
+			low = nlow;
+		if (nhi > hi)
+			hi = nhi;
+		if (merged)
+			n->isGlue = 1;
+		else
+			merged = n;
+	}
+
+	if (!merged && spare)
+		merged = spare;
+
+	if (!merged) {
+		last->son = sx_radix_node_new(tree, &node->prefix);
+		merged = last->son;
+	}
+
+	sx_radix_node_set_range(merged, low, hi);
+}
+
+/*
+ * Remove [low, hi] from the ranges of all nodes below node, since these
+ * are now matched by an aggregate above them.
+ */
+static void
+sx_radix_node_trim(struct sx_radix_node *node, unsigned int low,
+    unsigned int hi)
+{
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*n;
+	unsigned int		 nlow, nhi;
+
+	sx_radix_iter_init(&it, node, SX_RADIX_PREORDER);
+	while ((node = sx_radix_iter_next_pre(&it)) != NULL) {
+		/* none of the ranges here or below can reach into [low, hi] */
+		if (node->prefix.masklen > hi) {
+			sx_radix_iter_skip(&it);
+			continue;
+		}
+
+		for (n = node; n; n = n->son) {
+			if (n->isGlue)
+				continue;
+			nlow = sx_radix_node_low(n);
+			nhi = sx_radix_node_high(n);
+			if (sx_radix_range_trim(&nlow, &nhi, low, hi))
+				sx_radix_node_set_range(n, nlow, nhi);
+			else
+				n->isGlue = 1;
+		}
+	}
+}
+
+static void
+sx_radix_node_trim_below(struct sx_radix_node *node)
+{
+	struct sx_radix_node	*n;
+
+	for (n = node; n; n = n->son) {
+		if (n->isGlue)
+			continue;
+		if (node->l)
+			sx_radix_node_trim(node->l, sx_radix_node_low(n),
+			    sx_radix_node_high(n));
+		if (node->r)
+			sx_radix_node_trim(node->r, sx_radix_node_low(n),
+			    sx_radix_node_high(n));
+	}
+}
+
+/*
+ * Insert all more-specifics of prefix with masklen in [low, hi] as a single
+ * range. Parts already covered by a less-specific range are dropped, and
+ * parts of more-specific ranges covered by the new one are removed from
+ * them. Returns the node that holds the range, or the covering node when
+ * nothing was left to insert.
+ */
+struct sx_radix_node *
+sx_radix_tree_insert_range(struct sx_radix_tree *tree,
+    struct sx_prefix *prefix, unsigned int low, unsigned int hi)
+{
+	struct sx_radix_node	*chead, *n, *node;
+	unsigned int		 eb;
+
+	if (!tree || !prefix)
+		return NULL;
+
+	if (tree->family != prefix->family)
+		return NULL;
+
+	for (chead = tree->head; chead; ) {
+		eb = sx_prefix_eqbits(&chead->prefix, prefix);
+		if (chead->prefix.masklen >= prefix->masklen ||
+		    eb < chead->prefix.masklen)
+			break;
+		for (n = chead; n; n = n->son) {
+			if (n->isGlue)
+				continue;
+			if (!sx_radix_range_trim(&low, &hi,
+			    sx_radix_node_low(n), sx_radix_node_high(n)))
+				return n;
+		}
+		if (sx_prefix_isbitset(prefix, chead->prefix.masklen + 1))
+			chead = chead->r;
+		else
+			chead = chead->l;
+	}
+
+	if ((node = sx_radix_tree_link(tree, prefix)) == NULL)
+		return NULL;
+
+	sx_radix_node_add_range(tree, node, low, hi);
+	sx_radix_node_trim_below(node);
+
+	return node;
+}
+
+struct sx_radix_node *
+sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
+{
+	if (!prefix)
+		return NULL;
+
+	return sx_radix_tree_insert_range(tree, prefix, prefix->masklen,
+	    prefix->masklen);
+}
+
+#define SX_PREFIX_DIGIT(p, d, nbytes)					\
+	((d) == (nbytes) ? (p)->masklen : (p)->addr.addrs[(d)])
+
+/*
+ * LSD radix sort of prefixes by address, then by masklen, one byte per
+ * pass. Passes where all prefixes share the same digit are skipped.
+ */
+static void
+sx_prefix_sort(struct sx_prefix *ps, size_t n, int family)
+{
+	struct sx_prefix	*tmp, *src = ps, *dst, *t;
+	size_t			 count[256], i, sum, c;
+	int			 d, nbytes = (family == AF_INET ? 4 : 16);
+
+	if (n < 2)
+		return;
+
+	if ((tmp = malloc(n * sizeof(struct sx_prefix))) == NULL)
+		err(1, NULL);
+
+	dst = tmp;
+
+	for (d = nbytes; d >= 0; d--) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[SX_PREFIX_DIGIT(&src[i], d, nbytes)]++;
+		if (count[SX_PREFIX_DIGIT(&src[0], d, nbytes)] == n)
+			continue;
+		for (i = 0, sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[SX_PREFIX_DIGIT(&src[i], d, nbytes)]++] = src[i];
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != ps)
+		memcpy(ps, src, n * sizeof(struct sx_prefix));
+
+	free(tmp);
+}
+
+/*
+ * Build the tree from sorted, unique prefixes. In this order a prefix
+ * follows all of its less-specifics and everything to the left of it, so
+ * the tree only ever grows along its rightmost path: keep that path on a
+ * stack and each prefix is linked in amortized constant time, with nodes
+ * laid out in the slabs in the order they are later walked.
+ */
+static void
+sx_radix_tree_build(struct sx_radix_tree *tree, struct sx_prefix *ps,
+    size_t n)
+{
+	struct sx_radix_node	*stack[130], *node, *top, *popped, *glue;
+	struct sx_prefix	 gp;
+	size_t			 i, depth = 0;
+	unsigned int		 eb = 0;
+
+	for (i = 0; i < n; i++) {
+		node = sx_radix_node_new(tree, &ps[i]);
+
+		/* unwind to the closest less-specific of ps[i] */
+		popped = NULL;
+		while (depth > 0) {
+			top = stack[depth - 1];
+			eb = sx_prefix_eqbits(&top->prefix, &ps[i]);
+			if (eb >= top->prefix.masklen)
+				break;
+			popped = top;
+			depth--;
+		}
+		top = depth ? stack[depth - 1] : NULL;
+
+		if (popped)
+			eb = sx_prefix_eqbits(&popped->prefix, &ps[i]);
+
+		if (!popped || (top && eb == top->prefix.masklen)) {
+			/* free slot right below top */
+			node->parent = top;
+			if (!top)
+				tree->head = node;
+			else if (sx_prefix_isbitset(&ps[i],
+			    top->prefix.masklen + 1))
+				top->r = node;
+			else
+				top->l = node;
+		} else {
+			/* ps[i] forks off the popped subtree */
+			gp = ps[i];
+			gp.masklen = eb;
+			sx_prefix_adjust_masklen(&gp);
+			glue = sx_radix_node_new(tree, &gp);
+			glue->isGlue = 1;
+			glue->l = popped;
+			glue->r = node;
+			glue->parent = top;
+			popped->parent = glue;
+			node->parent = glue;
+			if (!top)
+				tree->head = glue;
+			else if (top->l == popped)
+				top->l = glue;
+			else
+				top->r = glue;
+			stack[depth++] = glue;
+		}
+
+		stack[depth++] = node;
+	}
+}
+
+static void
+sx_radix_node_reinsert(struct sx_radix_tree *tree, struct sx_radix_node *node)
+{
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*n;
+
+	sx_radix_iter_init(&it, node, SX_RADIX_PREORDER | SX_RADIX_SONS);
+	while ((n = sx_radix_iter_next_pre(&it)) != NULL) {
+		if (!n->isGlue)
+			sx_radix_tree_insert_range(tree, &n->prefix,
+			    sx_radix_node_low(n), sx_radix_node_high(n));
+	}
+}
+
+/*
+ * Insert n prefixes at once. ps is sorted and deduplicated in place and
+ * the tree is built from it in one pass; whatever the tree held before
+ * (typically a handful of prefix-ranges) is inserted over the result.
+ * Returns the number of distinct prefixes.
+ */
+size_t
+sx_radix_tree_insert_bulk(struct sx_radix_tree *tree, struct sx_prefix *ps,
+    size_t n)
+{
+	struct sx_radix_tree	 old;
+	size_t			 i, j;
+	int			 nbytes;
+
+	if (!tree || !n)
+		return 0;
+
+	nbytes = (tree->family == AF_INET ? 4 : 16);
+
+	sx_prefix_sort(ps, n, tree->family);
+
+	for (i = 1, j = 1; i < n; i++) {
+		if (ps[i].masklen == ps[j - 1].masklen &&
+		    !memcmp(ps[i].addr.addrs, ps[j - 1].addr.addrs, nbytes))
+			continue;
+		ps[j++] = ps[i];
+	}
+	n = j;
+
+	old = *tree;
+	tree->head = NULL;
+	tree->slabs = NULL;
+	tree->freelist = NULL;
+
+	sx_radix_tree_build(tree, ps, n);
+
+	if (old.head) {
+		sx_radix_node_reinsert(tree, old.head);
+		sx_radix_slabs_free(old.slabs);
+	}
+
+	return n;
+}
+
 void
 sx_radix_node_fprintf(struct sx_radix_node *node, void *udata)
 {
@@ -834,7 +1426,7 @@ sx_radix_node_fprintf(struct sx_radix_node *node, void *udata)
 	if (!node) {
 		fprintf(out, "(null)\n");
 	} else {
-		sx_prefix_snprintf(node->prefix, buffer, sizeof(buffer));
+		sx_prefix_snprintf(&node->prefix, buffer, sizeof(buffer));
 		fprintf(out, "%s %s\n", buffer, node->isGlue ? "(glue)" : "");
 	}
 }
@@ -843,13 +1435,11 @@ int
 sx_radix_node_foreach(struct sx_radix_node *node,
     void (*func)(struct sx_radix_node *, void *), void *udata)
 {
-	func(node, udata);
+	struct sx_radix_iter	 it;
 
-	if (node->l)
-		sx_radix_node_foreach(node->l, func, udata);
-
-	if (node->r)
-		sx_radix_node_foreach(node->r, func, udata);
+	sx_radix_iter_init(&it, node, SX_RADIX_PREORDER);
+	while ((node = sx_radix_iter_next_pre(&it)) != NULL)
+		func(node, udata);
 
 	return 0;
 }
@@ -866,29 +1456,25 @@ sx_radix_tree_foreach(struct sx_radix_tree *tree,
 }
 
 static int
-sx_radix_node_aggregate(struct sx_radix_node *node)
+sx_radix_node_aggregate(struct sx_radix_tree *tree,
+    struct sx_radix_node *node)
 {
-	if (node->l)
-		sx_radix_node_aggregate(node->l);
-	if (node->r)
-		sx_radix_node_aggregate(node->r);
-
 	if (debug_aggregation) {
 		printf("Aggregating on node: ");
-		sx_prefix_fprint(stdout, node->prefix);
+		sx_prefix_fprint(stdout, &node->prefix);
 		printf(" %s%s%u,%u\n", node->isGlue?"Glue ":"",
 			node->isAggregate?"Aggregate ":"",node->aggregateLow,
 			node->aggregateHi);
 		if (node->r) {
 			printf("R-Tree: ");
-			sx_prefix_fprint(stdout, node->r->prefix);
+			sx_prefix_fprint(stdout, &node->r->prefix);
 			printf(" %s%s%u,%u\n",
 			    (node->r->isGlue) ? "Glue " : "",
 			    (node->r->isAggregate) ? " Aggregate ": "",
 			    node->r->aggregateLow, node->r->aggregateHi);
 			if (node->r->son) {
 				printf("R-Son: ");
-			sx_prefix_fprint(stdout, node->r->son->prefix);
+			sx_prefix_fprint(stdout, &node->r->son->prefix);
 			printf(" %s%s%u,%u\n",
 			    node->r->son->isGlue ? "Glue " : "",
 			    node->r->son->isAggregate ? "Aggregate " : "",
@@ -898,13 +1484,13 @@ sx_radix_node_aggregate(struct sx_radix_node *node)
 		}
 		if (node->l) {
 			printf("L-Tree: ");
-			sx_prefix_fprint(stdout, node->l->prefix);
+			sx_prefix_fprint(stdout, &node->l->prefix);
 			printf(" %s%s%u,%u\n", node->l->isGlue ? "Glue ": "",
 			    node->l->isAggregate ? "Aggregate ": "",
 			    node->l->aggregateLow, node->l->aggregateHi);
 			if (node->l->son) {
 				printf("L-Son: ");
-				sx_prefix_fprint(stdout, node->l->son->prefix);
+				sx_prefix_fprint(stdout, &node->l->son->prefix);
 				printf(" %s%s%u,%u\n",
 				    node->l->son->isGlue ? "Glue " : "",
 				    node->l->son->isAggregate ? "Aggregate " : "",
@@ -914,253 +1500,712 @@ sx_radix_node_aggregate(struct sx_radix_node *node)
 		}
 	}
 
-	if (node->r && node->l) {
-		if (!node->r->isAggregate && !node->l->isAggregate
-		    && !node->r->isGlue && !node->l->isGlue
-		    && node->r->prefix->masklen == node->l->prefix->masklen) {
-			if (node->r->prefix->masklen == node->prefix->masklen + 1) {
-				node->isAggregate = 1;
-				node->r->isGlue = 1;
-				node->l->isGlue = 1;
-				node->aggregateHi = node->r->prefix->masklen;
-				if (node->isGlue) {
-					node->isGlue = 0;
-					node->aggregateLow = node->r->prefix->masklen;
-				} else {
-					node->aggregateLow = node->prefix->masklen;
-				}
-			}
-			if (node->r->son && node->l->son
-			    && node->r->son->isAggregate
-			    && node->l->son->isAggregate
-			    && node->r->son->aggregateHi == node->l->son->aggregateHi
-			    && node->r->son->aggregateLow == node->l->son->aggregateLow
-			    && node->r->prefix->masklen == node->prefix->masklen + 1
-			    && node->l->prefix->masklen == node->prefix->masklen + 1) {
-				node->son = sx_radix_node_new(node->prefix);
-				node->son->isGlue = 0;
-				node->son->isAggregate = 1;
-				node->son->aggregateHi = node->r->son->aggregateHi;
-				node->son->aggregateLow = node->r->son->aggregateLow;
-				node->r->son->isGlue = 1;
-				node->l->son->isGlue = 1;
-			}
-		} else if (node->r->isAggregate && node->l->isAggregate
-		    && node->r->aggregateHi == node->l->aggregateHi
-		    && node->r->aggregateLow==node->l->aggregateLow) {
-			if (node->r->prefix->masklen == node->prefix->masklen + 1
-			    && node->l->prefix->masklen == node->prefix->masklen + 1) {
-				if (node->isGlue) {
-					node->r->isGlue = 1;
-					node->l->isGlue = 1;
-					node->isAggregate = 1;
-					node->isGlue = 0;
-					node->aggregateHi = node->r->aggregateHi;
-					node->aggregateLow = node->r->aggregateLow;
-				} else if (node->r->prefix->masklen == node->r->aggregateLow) {
-					node->r->isGlue = 1;
-					node->l->isGlue = 1;
-					node->isAggregate = 1;
-					node->aggregateHi = node->r->aggregateHi;
-					node->aggregateLow = node->prefix->masklen;
-				} else {
-					node->son = sx_radix_node_new(node->prefix);
-					node->son->isGlue = 0;
-					node->son->isAggregate = 1;
-					node->son->aggregateHi = node->r->aggregateHi;
-					node->son->aggregateLow = node->r->aggregateLow;
-					node->r->isGlue = 1;
-					node->l->isGlue = 1;
-					if (node->r->son && node->l->son
-					    && node->r->son->aggregateHi == node->l->son->aggregateHi
-					    && node->r->son->aggregateLow == node->l->son->aggregateLow) {
-						node->son->son = sx_radix_node_new(node->prefix);
-						node->son->son->isGlue = 0;
-						node->son->son->isAggregate = 1;
-						node->son->son->aggregateHi = node->r->son->aggregateHi;
-						node->son->son->aggregateLow = node->r->son->aggregateLow;
-						node->r->son->isGlue = 1;
-						node->l->son->isGlue = 1;
-					}
-				}
-			}
-		} else if (node->l->son && node->r->isAggregate
-		    && node->l->son->isAggregate
-		    && node->r->aggregateHi == node->l->son->aggregateHi
-		    && node->r->aggregateLow == node->l->son->aggregateLow) {
-			if (node->r->prefix->masklen == node->prefix->masklen + 1
-			    && node->l->prefix->masklen == node->prefix->masklen + 1) {
-				if (node->isGlue) {
-					node->r->isGlue = 1;
-					node->l->son->isGlue = 1;
-					node->isAggregate = 1;
-					node->isGlue = 0;
-					node->aggregateHi = node->r->aggregateHi;
-					node->aggregateLow = node->r->aggregateLow;
-				} else {
-					node->son = sx_radix_node_new(node->prefix);
-					node->son->isGlue = 0;
-					node->son->isAggregate = 1;
-					node->son->aggregateHi = node->r->aggregateHi;
-					node->son->aggregateLow = node->r->aggregateLow;
-					node->r->isGlue = 1;
-					node->l->son->isGlue = 1;
-				}
-			}
-		} else if (node->r->son && node->l->isAggregate
-		    && node->r->son->isAggregate
-		    && node->l->aggregateHi == node->r->son->aggregateHi
-		    && node->l->aggregateLow == node->r->son->aggregateLow) {
-			if (node->l->prefix->masklen == node->prefix->masklen + 1
-			    && node->r->prefix->masklen == node->prefix->masklen + 1) {
-				if (node->isGlue) {
-					node->l->isGlue = 1;
-					node->r->son->isGlue = 1;
-					node->isAggregate = 1;
-					node->isGlue = 0;
-					node->aggregateHi = node->l->aggregateHi;
-					node->aggregateLow = node->l->aggregateLow;
-				} else {
-					node->son = sx_radix_node_new(node->prefix);
-					node->son->isGlue = 0;
-					node->son->isAggregate = 1;
-					node->son->aggregateHi = node->l->aggregateHi;
-					node->son->aggregateLow = node->l->aggregateLow;
-					node->l->isGlue = 1;
-					node->r->son->isGlue = 1;
-				}
+	if (node->r && node->l
+	    && node->r->prefix.masklen == node->prefix.masklen + 1
+	    && node->l->prefix.masklen == node->prefix.masklen + 1) {
+		struct sx_radix_node *rn, *ln;
+
+		/*
+		 * A range present in both halves is a range of the node
+		 * itself.
+		 */
+		for (rn = node->r; rn; rn = rn->son) {
+			if (rn->isGlue)
+				continue;
+			for (ln = node->l; ln; ln = ln->son) {
+				if (!ln->isGlue
+				    && sx_radix_node_low(ln) == sx_radix_node_low(rn)
+				    && sx_radix_node_high(ln) == sx_radix_node_high(rn))
+					break;
 			}
+			if (!ln)
+				continue;
+			sx_radix_node_add_range(tree, node,
+			    sx_radix_node_low(rn), sx_radix_node_high(rn));
+			rn->isGlue = 1;
+			ln->isGlue = 1;
 		}
 	}
 
 	return 0;
 }
 
-int
-sx_radix_tree_aggregate(struct sx_radix_tree *tree)
+static void
+sx_radix_subtree_aggregate(struct sx_radix_tree *tree,
+    struct sx_radix_node *root)
 {
-	if (tree && tree->head)
-		return sx_radix_node_aggregate(tree->head);
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*node;
 
-	return 0;
+	/* children first, so their aggregates can be lifted further up */
+	sx_radix_iter_init(&it, root, SX_RADIX_POSTORDER);
+	while ((node = sx_radix_iter_next(&it)) != NULL)
+		sx_radix_node_aggregate(tree, node);
+}
+
+/*
+ * Optimal aggregation. For every node v (at depth d) of the tree:
+ *  - range: masklens matched by the ranges of v and its ancestors,
+ *  - avail: masklens l for which every length-l specific of v is matched,
+ *    so that "v ge l le l" is a valid entry,
+ *  - own: masklens of matched specifics of v which are not under one of
+ *    its children, and thus can only be covered at v or above,
+ *  - need: masklens of all matched specifics of v.
+ * An entry at v may cover any run of consecutive masklens in avail. The
+ * minimal number of entries covering the subtree of v, given the masklens
+ * already covered by entries above it, is found by trying every set of
+ * runs at v and memoizing the result per (node, covered) pair.  Only the
+ * first SX_OPT_MAXRUNS runs at a node are tried, so that is minimal as
+ * long as no node has more.
+ */
+struct sx_masklens {
+	uint64_t	 w[3];
+};
+
+struct sx_optmemo {
+	struct sx_optmemo	*next;
+	struct sx_masklens	 covered, chosen;
+	size_t			 cost;
+};
+
+struct sx_optnode {
+	struct sx_radix_node	*node;
+	struct sx_optnode	*l, *r;
+	struct sx_masklens	 avail, own, need;
+	struct sx_optmemo	*memo;
+};
+
+struct sx_optctx {
+	struct sx_optnode	*nodes;
+	size_t			 nnodes;
+	unsigned int		 maxbits;
+};
+
+/*
+ * Runs above this many at a single node are all taken, not enumerated:
+ * the result may then be larger than minimal, but an IPv6 node can have
+ * up to 64 runs and trying 2^64 sets of them would never end.
+ */
+#define SX_OPT_MAXRUNS	16
+
+static void
+sx_masklens_set(struct sx_masklens *m, unsigned int i)
+{
+	m->w[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static int
+sx_masklens_isset(const struct sx_masklens *m, unsigned int i)
+{
+	return (m->w[i / 64] >> (i % 64)) & 1;
 }
 
 static void
-setGlueUpTo(struct sx_radix_node *node, void *udata)
+sx_masklens_range(struct sx_masklens *m, unsigned int low, unsigned int hi)
 {
-	unsigned refine = *(unsigned *)udata;
+	unsigned int	 i, first, last;
 
-	if (node && node->prefix->masklen <= refine)
-		node->isGlue = 1;
+	for (i = low / 64; i <= hi / 64; i++) {
+		first = i == low / 64 ? low % 64 : 0;
+		last = i == hi / 64 ? hi % 64 : 63;
+		m->w[i] |= (~(uint64_t)0 >> (63 - last)) &
+		    (~(uint64_t)0 << first);
+	}
+}
+
+static void
+sx_masklens_and(struct sx_masklens *m, const struct sx_masklens *a)
+{
+	m->w[0] &= a->w[0];
+	m->w[1] &= a->w[1];
+	m->w[2] &= a->w[2];
+}
+
+static void
+sx_masklens_or(struct sx_masklens *m, const struct sx_masklens *a)
+{
+	m->w[0] |= a->w[0];
+	m->w[1] |= a->w[1];
+	m->w[2] |= a->w[2];
 }
 
 static int
-sx_radix_node_refine(struct sx_radix_node *node, unsigned refine)
+sx_masklens_eq(const struct sx_masklens *a, const struct sx_masklens *b)
 {
-	if (!node->isGlue && node->prefix->masklen<refine) {
-		node->isAggregate = 1;
-		node->aggregateLow = node->prefix->masklen;
-		node->aggregateHi = refine;
-		if (node->l) {
-			sx_radix_node_foreach(node->l, setGlueUpTo, &refine);
-			sx_radix_node_refine(node->l, refine);
+	return a->w[0] == b->w[0] && a->w[1] == b->w[1] && a->w[2] == b->w[2];
+}
+
+static void
+sx_radix_node_count(struct sx_radix_node *node __attribute__((unused)),
+    void *udata)
+{
+	(*(size_t *)udata)++;
+}
+
+/*
+ * First pass, parents before children: the ranges matched at each node.
+ * Kept in avail until sx_optnode_finish() completes it.
+ */
+static void
+sx_optnode_prep(struct sx_optctx *ctx, struct sx_optnode *o,
+    const struct sx_masklens *inherited)
+{
+	struct sx_radix_node	*n;
+	struct sx_masklens	 above;
+
+	memset(&above, 0, sizeof(above));
+	sx_masklens_range(&above, o->node->prefix.masklen, ctx->maxbits);
+
+	o->avail = *inherited;
+	for (n = o->node; n; n = n->son)
+		if (!n->isGlue)
+			sx_masklens_range(&o->avail, sx_radix_node_low(n),
+			    sx_radix_node_high(n));
+	sx_masklens_and(&o->avail, &above);
+}
+
+/* Second pass, children before parents. */
+static void
+sx_optnode_finish(struct sx_optctx *ctx, struct sx_optnode *o)
+{
+	struct sx_radix_node	*node = o->node;
+	unsigned int		 depth = node->prefix.masklen;
+	int			 tiled;
+
+	/* children at depth + 1 leave nothing of node outside of them */
+	tiled = o->l && o->r && node->l->prefix.masklen == depth + 1 &&
+	    node->r->prefix.masklen == depth + 1;
+
+	memset(&o->own, 0, sizeof(o->own));
+	if (tiled)
+		sx_masklens_set(&o->own, depth);
+	else
+		sx_masklens_range(&o->own, depth, ctx->maxbits);
+	sx_masklens_and(&o->own, &o->avail);
+
+	o->need = o->own;
+	if (tiled) {
+		struct sx_masklens both = o->l->avail;
+
+		sx_masklens_and(&both, &o->r->avail);
+		sx_masklens_or(&o->avail, &both);
+	}
+	if (o->l)
+		sx_masklens_or(&o->need, &o->l->need);
+	if (o->r)
+		sx_masklens_or(&o->need, &o->r->need);
+}
+
+static size_t
+sx_optnode_solve(struct sx_optctx *ctx, struct sx_optnode *o,
+    struct sx_masklens covered)
+{
+	struct sx_masklens	 runs[SX_OPT_MAXRUNS], forced, chosen, below;
+	struct sx_masklens	 run, best;
+	struct sx_optmemo	*m;
+	unsigned int		 i, nruns = 0, depth = o->node->prefix.masklen;
+	unsigned long		 set;
+	size_t			 cost, bestcost = SIZE_MAX;
+	int			 useful, needed;
+
+	sx_masklens_and(&covered, &o->need);
+
+	for (m = o->memo; m; m = m->next)
+		if (sx_masklens_eq(&m->covered, &covered))
+			return m->cost;
+
+	memset(&forced, 0, sizeof(forced));
+	memset(&run, 0, sizeof(run));
+	useful = needed = 0;
+
+	/* split avail into runs, keeping those which cover anything new */
+	for (i = depth; i <= ctx->maxbits + 1; i++) {
+		if (i <= ctx->maxbits && sx_masklens_isset(&o->avail, i)) {
+			sx_masklens_set(&run, i);
+			if (sx_masklens_isset(&o->need, i) &&
+			    !sx_masklens_isset(&covered, i)) {
+				useful = 1;
+				if (sx_masklens_isset(&o->own, i))
+					needed = 1;
+			}
+			continue;
 		}
-		if (node->r) {
-			sx_radix_node_foreach(node->r, setGlueUpTo, &refine);
-			sx_radix_node_refine(node->r, refine);
+		if (needed || (useful && nruns == SX_OPT_MAXRUNS))
+			sx_masklens_or(&forced, &run);
+		else if (useful)
+			runs[nruns++] = run;
+		memset(&run, 0, sizeof(run));
+		useful = needed = 0;
+	}
+
+	memset(&best, 0, sizeof(best));
+	for (set = 0; set < (1UL << nruns); set++) {
+		chosen = forced;
+		cost = 0;
+		for (i = 0; i < nruns; i++)
+			if (set & (1UL << i))
+				sx_masklens_or(&chosen, &runs[i]);
+		for (i = depth; i <= ctx->maxbits; i++)
+			if (sx_masklens_isset(&chosen, i) &&
+			    (i == depth || !sx_masklens_isset(&chosen, i - 1)))
+				cost++;
+		below = covered;
+		sx_masklens_or(&below, &chosen);
+		if (o->l)
+			cost += sx_optnode_solve(ctx, o->l, below);
+		if (o->r)
+			cost += sx_optnode_solve(ctx, o->r, below);
+		if (cost < bestcost) {
+			bestcost = cost;
+			best = chosen;
 		}
-	} else if (!node->isGlue && node->prefix->masklen == refine) {
-		/* not setting aggregate in this case */
-		if (node->l)
-			sx_radix_node_refine(node->l, refine);
-		if (node->r)
-			sx_radix_node_refine(node->r, refine);
-	} else if (node->isGlue) {
-		if (node->r)
-			sx_radix_node_refine(node->r, refine);
-		if (node->l)
-			sx_radix_node_refine(node->l, refine);
-	} else {
-		/* node->prefix.masklen > refine */
-		/*
-		 * do nothing, should pass specifics 'as is'. Also, do not
-		 * process any embedded routes, their masklen is bigger, too...
-		node->isGlue = 1;
-		if (node->l)
-			sx_radix_node_foreach(node->l, setGlue, NULL);
+	}
 
-		if (node->r)
-			sx_radix_node_foreach(node->r, setGlue, NULL);
-		*/
+	if ((m = malloc(sizeof(struct sx_optmemo))) == NULL)
+		err(1, NULL);
+	m->covered = covered;
+	m->chosen = best;
+	m->cost = bestcost;
+	m->next = o->memo;
+	o->memo = m;
+
+	return bestcost;
+}
+
+/*
+ * Replay the choices made by sx_optnode_solve(), trimming every run to
+ * the masklens it is actually needed for.
+ */
+static void
+sx_optnode_apply(struct sx_radix_tree *tree, struct sx_optctx *ctx,
+    struct sx_optnode *o, struct sx_masklens covered)
+{
+	struct sx_optmemo	*m;
+	unsigned int		 i, low = 0, hi = 0, depth = o->node->prefix.masklen;
+	int			 inrun = 0;
+
+	sx_masklens_and(&covered, &o->need);
+
+	for (m = o->memo; m; m = m->next)
+		if (sx_masklens_eq(&m->covered, &covered))
+			break;
+	if (!m)
+		return;
+
+	for (i = depth; i <= ctx->maxbits + 1; i++) {
+		if (i <= ctx->maxbits && sx_masklens_isset(&m->chosen, i)) {
+			if (sx_masklens_isset(&o->need, i) &&
+			    !sx_masklens_isset(&covered, i)) {
+				if (!inrun)
+					low = i;
+				hi = i;
+				inrun = 1;
+			}
+			continue;
+		}
+		if (inrun)
+			sx_radix_node_add_range(tree, o->node, low, hi);
+		inrun = 0;
 	}
-	return 0;
+
+	sx_masklens_or(&covered, &m->chosen);
+	if (o->l)
+		sx_optnode_apply(tree, ctx, o->l, covered);
+	if (o->r)
+		sx_optnode_apply(tree, ctx, o->r, covered);
 }
-	
+
+static void
+sx_radix_node_unset(struct sx_radix_node *node,
+    void *udata __attribute__((unused)))
+{
+	struct sx_radix_node	*n;
+
+	for (n = node; n; n = n->son)
+		n->isGlue = 1;
+}
+
+/*
+ * Replace the contents of the tree with the smallest set of prefix ranges
+ * matching exactly the same specifics.
+ */
 int
-sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine)
+sx_radix_tree_aggregate_optimal(struct sx_radix_tree *tree)
 {
-	if (tree && tree->head)
-		return sx_radix_node_refine(tree->head, refine);
+	struct sx_optnode	*path[SX_RADIX_MAXDEPTH], *o;
+	struct sx_optctx	 ctx;
+	struct sx_masklens	 none;
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*node;
+	size_t			 i, count = 0, cost;
+
+	if (!tree || !tree->head)
+		return 0;
+
+	sx_radix_tree_foreach(tree, sx_radix_node_count, &count);
+
+	if ((ctx.nodes = calloc(count, sizeof(struct sx_optnode))) == NULL)
+		err(1, NULL);
+	ctx.nnodes = 0;
+	ctx.maxbits = tree->family == AF_INET ? 32 : 128;
+
+	memset(&none, 0, sizeof(none));
+
+	sx_radix_iter_init(&it, tree->head, SX_RADIX_PREORDER);
+	while ((node = sx_radix_iter_next_pre(&it)) != NULL) {
+		o = &ctx.nodes[ctx.nnodes++];
+		o->node = node;
+		if (it.depth) {
+			if (path[it.depth - 1]->node->l == node)
+				path[it.depth - 1]->l = o;
+			else
+				path[it.depth - 1]->r = o;
+			sx_optnode_prep(&ctx, o, &path[it.depth - 1]->avail);
+		} else
+			sx_optnode_prep(&ctx, o, &none);
+		path[it.depth] = o;
+	}
+
+	/* in reverse pre-order every node comes after its children */
+	for (i = ctx.nnodes; i > 0; i--)
+		sx_optnode_finish(&ctx, &ctx.nodes[i - 1]);
+
+	cost = sx_optnode_solve(&ctx, &ctx.nodes[0], none);
+	SX_DEBUG(debug_aggregation, "optimal aggregation: %zu entries\n", cost);
+
+	sx_radix_tree_foreach(tree, sx_radix_node_unset, NULL);
+	sx_optnode_apply(tree, &ctx, &ctx.nodes[0], none);
+
+	for (i = 0; i < ctx.nnodes; i++) {
+		struct sx_optmemo	*m, *next;
+
+		for (m = ctx.nodes[i].memo; m; m = next) {
+			next = m->next;
+			free(m);
+		}
+	}
+	free(ctx.nodes);
 
 	return 0;
 }
 
+/*
+ * Drop the masklens covered by ranges above node from either end of its
+ * own ranges, then add what is left to covered.
+ */
 static void
-setGlueFrom(struct sx_radix_node *node, void *udata)
+sx_radix_node_trim_covered(struct sx_radix_node *node,
+    struct sx_masklens *covered)
 {
-	unsigned refine = *(unsigned *)udata;
+	struct sx_radix_node	*n;
+	unsigned int		 low, hi;
 
-	if (node && node->prefix->masklen <= refine)
-		node->isGlue = 1;
+	for (n = node; n; n = n->son) {
+		if (n->isGlue)
+			continue;
+		low = sx_radix_node_low(n);
+		hi = sx_radix_node_high(n);
+		while (low <= hi && sx_masklens_isset(covered, low))
+			low++;
+		while (low <= hi && sx_masklens_isset(covered, hi))
+			hi--;
+		if (low > hi)
+			n->isGlue = 1;
+		else
+			sx_radix_node_set_range(n, low, hi);
+	}
+
+	for (n = node; n; n = n->son)
+		if (!n->isGlue)
+			sx_masklens_range(covered, sx_radix_node_low(n),
+			    sx_radix_node_high(n));
 }
 
-static int
-sx_radix_node_refineLow(struct sx_radix_node *node, unsigned refineLow)
+/*
+ * Refining is done in a single walk: the ranges of the ancestors are
+ * carried down in covered instead of trimming every subtree once per
+ * ancestor.
+ */
+static void
+sx_radix_node_refine(struct sx_radix_tree *tree, struct sx_radix_node *node,
+    unsigned refine, struct sx_masklens *covered)
 {
-	if (!node->isGlue && node->prefix->masklen<=refineLow) {
+	struct sx_radix_node	*n;
+	unsigned int		 low;
 
-		if (!node->isAggregate) {
-			node->isAggregate = 1;
-			node->aggregateLow = refineLow;
-			if (node->prefix->family == AF_INET)
-				node->aggregateHi = 32;
-			else
-				node->aggregateHi = 128;
+	for (n = node; n; n = n->son) {
+		if (n->isGlue || sx_radix_node_low(n) > refine
+		    || sx_radix_node_high(n) >= refine)
+			continue;
+		low = sx_radix_node_low(n);
+		n->isGlue = 1;
+		sx_radix_node_add_range(tree, node, low, refine);
+	}
+
+	sx_radix_node_trim_covered(node, covered);
+}
+
+static void
+sx_radix_node_refineLow(struct sx_radix_tree *tree,
+    struct sx_radix_node *node, unsigned refineLow,
+    struct sx_masklens *covered)
+{
+	struct sx_radix_node	*n;
+	unsigned int		 low, hi;
+
+	/* deeper nodes are kept, less what the new ranges above cover */
+	for (n = node; n && node->prefix.masklen <= refineLow; n = n->son) {
+		if (n->isGlue)
+			continue;
+		if (!n->isAggregate) {
+			low = refineLow;
+			hi = node->prefix.family == AF_INET ? 32 : 128;
+		} else {
+			low = n->aggregateLow > refineLow ? n->aggregateLow :
+			    refineLow;
+			hi = n->aggregateHi;
+		}
+		n->isGlue = 1;
+		if (low <= hi)
+			sx_radix_node_add_range(tree, node, low, hi);
+	}
+
+	sx_radix_node_trim_covered(node, covered);
+}
+
+#define SX_JOB_AGGREGATE	0
+#define SX_JOB_REFINE		1
+#define SX_JOB_REFINELOW	2
+
+/*
+ * Refine the subtree of root, with covered holding what the ranges above
+ * it match.
+ */
+static void
+sx_radix_subtree_refine(struct sx_radix_tree *tree, struct sx_radix_node *root,
+    int job, unsigned int len, const struct sx_masklens *above)
+{
+	struct sx_masklens	 covered[SX_RADIX_MAXDEPTH];
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*node;
+
+	sx_radix_iter_init(&it, root, SX_RADIX_PREORDER);
+	while ((node = sx_radix_iter_next_pre(&it)) != NULL) {
+		covered[it.depth] = it.depth ? covered[it.depth - 1] : *above;
+
+		if (job == SX_JOB_REFINE) {
+			sx_radix_node_refine(tree, node, len,
+			    &covered[it.depth]);
+			/* specifics longer than refine are passed 'as is' */
+			if (node->prefix.masklen >= len)
+				sx_radix_iter_skip(&it);
 		} else
-			node->aggregateLow=refineLow;
+			sx_radix_node_refineLow(tree, node, len,
+			    &covered[it.depth]);
+	}
+}
 
-		if (node->l) {
-			sx_radix_node_foreach(node->l, setGlueFrom, &refineLow);
-			sx_radix_node_refineLow(node->l, refineLow);
+/*
+ * Parallel aggregation and refine. Nodes down to sx_radix_split levels
+ * below the head are handled by the calling thread, the subtrees hanging
+ * below them by a pool of sx_radix_threads workers. Work on a subtree
+ * only reads and writes nodes of that subtree, so the result is the same
+ * as the one of a serial walk. Each worker allocates nodes from slabs of
+ * its own, which are handed over to the tree when it is done.
+ */
+struct sx_radix_work {
+	struct sx_radix_node	*node;
+	struct sx_masklens	 covered;
+};
+
+struct sx_radix_pool {
+	struct sx_radix_tree	*tree;
+	struct sx_radix_work	*work;
+	size_t			 nwork, next;
+	int			 job;
+	unsigned int		 len;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		 lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#define SX_POOL_LOCK(p)		pthread_mutex_lock(&(p)->lock)
+#define SX_POOL_UNLOCK(p)	pthread_mutex_unlock(&(p)->lock)
+#else
+#define SX_POOL_LOCK(p)
+#define SX_POOL_UNLOCK(p)
+#endif
+
+static void *
+sx_radix_pool_worker(void *arg)
+{
+	struct sx_radix_pool	*pool = arg;
+	struct sx_radix_tree	 local;
+	struct sx_radix_slab	*last;
+	size_t			 i;
+
+	memset(&local, 0, sizeof(local));
+	local.family = pool->tree->family;
+
+	for (;;) {
+		SX_POOL_LOCK(pool);
+		i = pool->next++;
+		SX_POOL_UNLOCK(pool);
+
+		if (i >= pool->nwork)
+			break;
+
+		if (pool->job == SX_JOB_AGGREGATE)
+			sx_radix_subtree_aggregate(&local, pool->work[i].node);
+		else
+			sx_radix_subtree_refine(&local, pool->work[i].node,
+			    pool->job, pool->len, &pool->work[i].covered);
+	}
+
+	if (local.slabs) {
+		for (last = local.slabs; last->next; last = last->next)
+			;
+		SX_POOL_LOCK(pool);
+		last->next = pool->tree->slabs;
+		pool->tree->slabs = local.slabs;
+		SX_POOL_UNLOCK(pool);
+	}
+
+	return NULL;
+}
+
+static void
+sx_radix_tree_parallel(struct sx_radix_tree *tree, int job, unsigned int len)
+{
+	struct sx_masklens	 covered[SX_RADIX_MAXDEPTH];
+	struct sx_radix_pool	 pool;
+	struct sx_radix_iter	 it;
+	struct sx_radix_node	*node, **top = NULL;
+	size_t			 i, ntop = 0, topsize = 0, worksize = 0;
+#ifdef HAVE_PTHREAD_H
+	pthread_t		*tids;
+	int			 nthreads = 0;
+#endif
+
+	memset(&pool, 0, sizeof(pool));
+	pool.tree = tree;
+	pool.job = job;
+	pool.len = len;
+
+	sx_radix_iter_init(&it, tree->head, SX_RADIX_PREORDER);
+	while ((node = sx_radix_iter_next_pre(&it)) != NULL) {
+		if (it.depth)
+			covered[it.depth] = covered[it.depth - 1];
+		else
+			memset(&covered[0], 0, sizeof(covered[0]));
+
+		if (it.depth == sx_radix_split) {
+			if (pool.nwork == worksize) {
+				worksize = worksize ? worksize * 2 : 256;
+				pool.work = realloc(pool.work,
+				    worksize * sizeof(struct sx_radix_work));
+				if (pool.work == NULL)
+					err(1, NULL);
+			}
+			pool.work[pool.nwork].node = node;
+			pool.work[pool.nwork].covered = covered[it.depth];
+			pool.nwork++;
+			sx_radix_iter_skip(&it);
+			continue;
 		}
 
-		if (node->r) {
-			sx_radix_node_foreach(node->r, setGlueFrom, &refineLow);
-			sx_radix_node_refineLow(node->r, refineLow);
+		switch (job) {
+		case SX_JOB_AGGREGATE:
+			/* aggregated after the workers are done */
+			if (ntop == topsize) {
+				topsize = topsize ? topsize * 2 : 256;
+				top = realloc(top,
+				    topsize * sizeof(struct sx_radix_node *));
+				if (top == NULL)
+					err(1, NULL);
+			}
+			top[ntop++] = node;
+			break;
+		case SX_JOB_REFINE:
+			sx_radix_node_refine(tree, node, len,
+			    &covered[it.depth]);
+			if (node->prefix.masklen >= len)
+				sx_radix_iter_skip(&it);
+			break;
+		case SX_JOB_REFINELOW:
+			sx_radix_node_refineLow(tree, node, len,
+			    &covered[it.depth]);
+			break;
 		}
+	}
 
-	} else if (!node->isGlue && node->prefix->masklen == refineLow) {
-		/* not setting aggregate in this case */
-		if (node->l)
-			sx_radix_node_refineLow(node->l, refineLow);
-		if (node->r)
-			sx_radix_node_refineLow(node->r, refineLow);
-	} else if (node->isGlue) {
-		if (node->r)
-			sx_radix_node_refineLow(node->r, refineLow);
-		if (node->l)
-			sx_radix_node_refineLow(node->l, refineLow);
-	} else {
-		/* node->prefix.masklen > refine */
-		/* do nothing, should pass specifics 'as is'. Also, do not
-		process any embedded routes, their masklen is bigger, too...
-		node->isGlue = 1;
-		if (node->l)
-			sx_radix_node_foreach(node->l, setGlue, NULL);
-		if (node->r)
-			sx_radix_node_foreach(node->r, setGlue, NULL);
-		*/
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&pool.lock, NULL);
+
+	if ((tids = calloc(sx_radix_threads, sizeof(pthread_t))) == NULL)
+		err(1, NULL);
+
+	/* the calling thread is a worker too */
+	while (nthreads < sx_radix_threads - 1 &&
+	    (size_t)nthreads + 1 < pool.nwork) {
+		if (pthread_create(&tids[nthreads], NULL, sx_radix_pool_worker,
+		    &pool) != 0) {
+			SX_DEBUG(debug_aggregation, "pthread_create: %s\n",
+			    strerror(errno));
+			break;
+		}
+		nthreads++;
 	}
+#endif
+
+	sx_radix_pool_worker(&pool);
+
+#ifdef HAVE_PTHREAD_H
+	while (nthreads > 0)
+		pthread_join(tids[--nthreads], NULL);
+
+	free(tids);
+	pthread_mutex_destroy(&pool.lock);
+#endif
+
+	/* in reverse pre-order every node comes after its children */
+	for (i = ntop; i > 0; i--)
+		sx_radix_node_aggregate(tree, top[i - 1]);
+
+	free(top);
+	free(pool.work);
+}
+
+int
+sx_radix_tree_aggregate(struct sx_radix_tree *tree)
+{
+	if (!tree)
+		return 0;
+
+	if (sx_radix_threads > 1 && !debug_aggregation)
+		sx_radix_tree_parallel(tree, SX_JOB_AGGREGATE, 0);
+	else
+		sx_radix_subtree_aggregate(tree, tree->head);
+
+	return 0;
+}
+
+int
+sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine)
+{
+	struct sx_masklens	 none;
+
+	if (!tree)
+		return 0;
+
+	memset(&none, 0, sizeof(none));
+
+	if (sx_radix_threads > 1)
+		sx_radix_tree_parallel(tree, SX_JOB_REFINE, refine);
+	else
+		sx_radix_subtree_refine(tree, tree->head, SX_JOB_REFINE,
+		    refine, &none);
 
 	return 0;
 }
@@ -1168,8 +2213,18 @@ sx_radix_node_refineLow(struct sx_radix_node *node, unsigned refineLow)
 int
 sx_radix_tree_refineLow(struct sx_radix_tree *tree, unsigned refineLow)
 {
-	if (tree && tree->head)
-		return sx_radix_node_refineLow(tree->head, refineLow);
+	struct sx_masklens	 none;
+
+	if (!tree)
+		return 0;
+
+	memset(&none, 0, sizeof(none));
+
+	if (sx_radix_threads > 1)
+		sx_radix_tree_parallel(tree, SX_JOB_REFINELOW, refineLow);
+	else
+		sx_radix_subtree_refine(tree, tree->head, SX_JOB_REFINELOW,
+		    refineLow, &none);
 
 	return 0;
 }
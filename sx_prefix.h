@@ -42,38 +42,76 @@ typedef struct sx_prefix {
 	} addr;
 } sx_prefix_t;
 
+/*
+ * Laid out to fit a single 64-byte cache line: everything a lookup looks
+ * at while descending the tree is loaded with one miss.
+ */
 typedef struct sx_radix_node { 
 	struct sx_radix_node	*parent, *l, *r, *son;
-	void			*payload;
+	struct sx_prefix	 prefix;
 	unsigned int 		 isGlue:1;
-	unsigned int 		 isAggregated:1;
 	unsigned int 		 isAggregate:1;
-	unsigned int 		 aggregateLow;
-	unsigned int 		 aggregateHi;
-	struct sx_prefix	*prefix;
+	unsigned int 		 aggregateLow:8;
+	unsigned int 		 aggregateHi:8;
 } sx_radix_node_t;
 
+struct sx_radix_slab;
+
 typedef struct sx_radix_tree { 
 	int 			 family;
 	struct sx_radix_node	*head;
+	struct sx_radix_slab	*slabs;
+	struct sx_radix_node	*freelist;
 } sx_radix_tree_t;
 
+/*
+ * Walks a tree without recursion. A path from the head holds at most one
+ * node per masklen, so the stack is bounded by SX_RADIX_MAXDEPTH.
+ */
+#define SX_RADIX_MAXDEPTH	129
+
+#define SX_RADIX_PREORDER	0
+#define SX_RADIX_INORDER	1
+#define SX_RADIX_POSTORDER	2
+#define SX_RADIX_SONS		4	/* return son chains after their node */
+
+typedef struct sx_radix_iter {
+	int			 flags;
+	int			 depth;		/* of the last returned node */
+	int			 sp;
+	struct sx_radix_node	*son, *last;
+	struct {
+		struct sx_radix_node	*node;
+		int			 state;
+	} stack[SX_RADIX_MAXDEPTH + 1];
+} sx_radix_iter_t;
+
+/* workers used by aggregate/refine, and the depth the tree is split at */
+extern int sx_radix_threads;
+extern int sx_radix_split;
+
 /* most common operations with the tree is to: lookup/insert/unlink */
 struct sx_radix_node *sx_radix_tree_lookup(struct sx_radix_tree *tree,
     struct sx_prefix *prefix);
 struct sx_radix_node *sx_radix_tree_insert(struct sx_radix_tree *tree, 
     struct sx_prefix *prefix);
+struct sx_radix_node *sx_radix_tree_insert_range(struct sx_radix_tree *tree,
+    struct sx_prefix *prefix, unsigned int low, unsigned int hi);
+size_t sx_radix_tree_insert_bulk(struct sx_radix_tree *tree,
+    struct sx_prefix *ps, size_t n);
 void sx_radix_tree_unlink(struct sx_radix_tree *t, struct sx_radix_node *n);
 struct sx_radix_node *sx_radix_tree_lookup_exact(struct sx_radix_tree *tree,
 	struct sx_prefix *prefix);
 
 struct sx_prefix *sx_prefix_alloc(struct sx_prefix *p);
 void sx_prefix_free(struct sx_prefix *p);
-void sx_radix_node_destroy(struct sx_radix_node *p);
+void sx_radix_node_destroy(struct sx_radix_tree *t, struct sx_radix_node *n);
 void sx_prefix_adjust_masklen(struct sx_prefix *p);
 struct sx_prefix *sx_prefix_new(int af, char *text);
 int sx_prefix_parse(struct sx_prefix *p, int af, char *text);
 int sx_prefix_range_parse(struct sx_radix_tree *t, int af, unsigned int ml, char *text);
+void sx_prefix_range_foreach(struct sx_prefix *p, unsigned int min,
+    unsigned int max, void (*func)(struct sx_prefix *, void *), void *udata);
 int sx_prefix_fprint(FILE *f, struct sx_prefix *p);
 int sx_prefix_snprintf(struct sx_prefix *p, char *rbuffer, int srb);
 int sx_prefix_snprintf_sep(struct sx_prefix *p, char *rbuffer, int srb, char *);
@@ -82,15 +120,22 @@ void sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
     unsigned int aggregateHi);
 int sx_prefix_jsnprintf(struct sx_prefix *p, char *rbuffer, int srb);
 struct sx_radix_tree *sx_radix_tree_new(int af);
-struct sx_radix_node *sx_radix_node_new(struct sx_prefix *prefix);
+struct sx_radix_node *sx_radix_node_new(struct sx_radix_tree *t,
+    struct sx_prefix *prefix);
+void sx_radix_tree_free(struct sx_radix_tree *t);
 struct sx_prefix *sx_prefix_overlay(struct sx_prefix *p, int n);
 int sx_radix_tree_empty(struct sx_radix_tree *t);
 void sx_radix_node_fprintf(struct sx_radix_node *node, void *udata);
+void sx_radix_iter_init(struct sx_radix_iter *it, struct sx_radix_node *node,
+    int flags);
+struct sx_radix_node *sx_radix_iter_next(struct sx_radix_iter *it);
+void sx_radix_iter_skip(struct sx_radix_iter *it);
 int  sx_radix_node_foreach(struct sx_radix_node *node, 
 	void (*func)(struct sx_radix_node *, void *), void *udata);
 int sx_radix_tree_foreach(struct sx_radix_tree *tree, 
 	void (*func)(struct sx_radix_node *, void *), void *udata);
 int sx_radix_tree_aggregate(struct sx_radix_tree *tree);
+int sx_radix_tree_aggregate_optimal(struct sx_radix_tree *tree);
 int sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine);
 int sx_radix_tree_refineLow(struct sx_radix_tree *tree, unsigned refineLow);
 
@@ -26,6 +26,9 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +39,12 @@
 #include "sx_report.h"
 
 static int reportStderr=1;
+static const char *reportContext = NULL;
+static void (*reportHook)(sx_report_t, const char *, void *) = NULL;
+static void *reportHookArg = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_t reportHookThread;
+#endif
 
 static char const* 
 sx_report_name(sx_report_t t)
@@ -66,23 +75,37 @@ sx_report(sx_report_t t, char* fmt, ...)
 	vsnprintf(buffer, sizeof(buffer), fmt, ap);
 	va_end(ap);
 
-	if (reportStderr) { 
+#ifdef HAVE_PTHREAD_H
+	if (reportHook && pthread_equal(reportHookThread, pthread_self())) {
+#else
+	if (reportHook) {
+#endif
+		char line[65536 + 256];
+
+		snprintf(line, sizeof(line), "%s%s%s", sx_report_name(t),
+		    reportContext ? reportContext : "", buffer);
+		reportHook(t, line, reportHookArg);
+	} else if (reportStderr) { 
 		fputs(sx_report_name(t), stderr);
+		if (reportContext)
+			fputs(reportContext, stderr);
 		fputs(buffer, stderr);
 	} else { 
+		const char *ctx = reportContext ? reportContext : "";
+
 		switch(t) { 
 		case SX_FATAL: 
-			syslog(LOG_ERR,"FATAL ERROR: %s", buffer);
+			syslog(LOG_ERR,"FATAL ERROR: %s%s", ctx, buffer);
 			break;
 		case SX_MISFEATURE:
 		case SX_ERROR: 
-			syslog(LOG_ERR,"ERROR: %s", buffer);
+			syslog(LOG_ERR,"ERROR: %s%s", ctx, buffer);
 			break;
 		case SX_NOTICE: 
-			syslog(LOG_WARNING,"Notice: %s", buffer);
+			syslog(LOG_WARNING,"Notice: %s%s", ctx, buffer);
 			break;
 		case SX_DEBUG: 
-			syslog(LOG_DEBUG,"Debug: %s", buffer);
+			syslog(LOG_DEBUG,"Debug: %s%s", ctx, buffer);
 			break;
 		}
 	}
@@ -117,6 +140,22 @@ sx_debug(char const* const file, char const* const func, int const line,
 	return 0;
 }
 
+void
+sx_report_context(const char *context)
+{
+	reportContext = context;
+}
+
+void
+sx_report_hook(void (*hook)(sx_report_t, const char *, void *), void *arg)
+{
+	reportHook = hook;
+	reportHookArg = arg;
+#ifdef HAVE_PTHREAD_H
+	reportHookThread = pthread_self();
+#endif
+}
+
 void
 sx_openlog(char* progname)
 { 
@@ -38,6 +38,16 @@ typedef enum {
 /* opens syslog and disables logging to stderr */
 void sx_openlog(char* progname);
 
+/* prefix reports with where they apply, NULL to stop */
+void sx_report_context(const char *context);
+
+/*
+ * pass the reports of the calling thread to hook instead, NULL to stop.
+ * Fatal reports still exit if the hook returns.
+ */
+void sx_report_hook(void (*hook)(sx_report_t, const char *, void *),
+    void *arg);
+
 int  sx_report(sx_report_t, char* fmt, ...) 
 	__attribute__ ((format (printf, 2, 3)));
 
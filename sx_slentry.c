@@ -45,18 +45,3 @@ sx_slentry_new(char *t)
 
 	return e;
 }
-
-struct sx_tentry *
-sx_tentry_new(char *t)
-{
-	struct sx_tentry	*te = malloc(sizeof(struct sx_tentry));
-
-	if (!te)
-		return NULL;
-
-	memset(te, 0, sizeof(struct sx_tentry));
-
-	te->text = strdup(t);
-
-	return te;
-}
@@ -0,0 +1,211 @@
+#!/bin/sh
+#
+# Checks of the filters generated by bgpq4, run by "make check".  The
+# objects come from the RPSL dump next to this script (-i), no IRRD is
+# needed.  Set RUN to run every bgpq4 under a checker, see leaks.sh.
+#
+
+BGPQ4=${BGPQ4:-./bgpq4}
+srcdir=${srcdir:-.}
+db=$srcdir/tests/test.db
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/bgpq4.XXXXXX") || exit 99
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+
+# bgpq4 with the arguments given must print what is on stdin
+check()
+{
+	cat > "$tmp/expected"
+	$RUN "$BGPQ4" -i "$db" "$@" > "$tmp/out" 2> "$tmp/err"
+	status=$?
+	if [ $status -ne 0 ] || ! diff -u "$tmp/expected" "$tmp/out"; then
+		echo "FAIL: bgpq4 $* (exit $status)"
+		cat "$tmp/err"
+		failed=1
+	fi
+}
+
+# bgpq4 with the arguments given must fail
+fails()
+{
+	if $RUN "$BGPQ4" -i "$db" "$@" > /dev/null 2>&1; then
+		echo "FAIL: bgpq4 $* did not fail"
+		failed=1
+	fi
+}
+
+check AS-TEST <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 10.0.0.0/8
+ip prefix-list NN permit 192.0.2.0/24
+ip prefix-list NN permit 192.0.2.128/25
+ip prefix-list NN permit 198.51.100.0/24
+ip prefix-list NN permit 203.0.113.0/24
+EOF
+
+check -6 -b -l x AS-TEST <<EOF
+x = [
+    2001:db8::/32,
+    2001:db8:1000::/36
+];
+EOF
+
+check -R 26 -r 24 AS-TEST <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 10.0.0.0/8 ge 24 le 26
+ip prefix-list NN permit 192.0.2.0/24 le 26
+ip prefix-list NN permit 198.51.100.0/24 le 26
+ip prefix-list NN permit 203.0.113.0/24 le 26
+EOF
+
+check -L 1 AS-TEST <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 192.0.2.0/24
+ip prefix-list NN permit 192.0.2.128/25
+ip prefix-list NN permit 198.51.100.0/24
+EOF
+
+check AS-TEST EXCEPT AS-SUB <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 192.0.2.0/24
+ip prefix-list NN permit 192.0.2.128/25
+ip prefix-list NN permit 198.51.100.0/24
+EOF
+
+check RS-TEST <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 192.0.2.0/24 le 32
+ip prefix-list NN permit 203.0.113.0/24
+EOF
+
+# without %a/%A ranges are listed as their more-specifics
+check -F '%n/%l\n' RS-RANGE <<EOF
+198.18.0.0/23
+198.18.0.0/24
+198.18.1.0/24
+198.18.2.0/23
+198.18.2.0/24
+198.18.3.0/24
+203.0.113.0/31
+203.0.113.0/32
+203.0.113.1/32
+203.0.113.2/31
+203.0.113.2/32
+203.0.113.3/32
+EOF
+
+check -F '%n/%l %a-%A\n' RS-RANGE <<EOF
+198.18.0.0/22 23-24
+203.0.113.0/30 31-32
+EOF
+
+check -f 1 AS-TEST <<EOF
+no ip as-path access-list NN
+ip as-path access-list NN permit ^1(_1)*\$
+ip as-path access-list NN permit ^1(_[0-9]+)*_(2|3|10|11)\$
+EOF
+
+# AS3 has no routes
+check -w -f 1 AS-TEST <<EOF
+no ip as-path access-list NN
+ip as-path access-list NN permit ^1(_1)*\$
+ip as-path access-list NN permit ^1(_[0-9]+)*_(2|10|11)\$
+EOF
+
+# the stoplist also applies to ASNs given before it
+check AS1 AS2 EXCEPT AS2 <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 192.0.2.0/24
+ip prefix-list NN permit 192.0.2.128/25
+EOF
+
+check -j -t AS-TEST <<EOF
+{"NN": [
+  1,2,3,10,11
+]}
+EOF
+
+fails -t AS-TEST
+fails -J -b AS-TEST
+fails -y 60:120 AS-TEST
+fails -h 127.0.0.1 AS-TEST
+
+# a batch must give the same filters as one run each
+cat > "$tmp/jobs" <<EOF
+$tmp/1.out AS-TEST
+$tmp/2.out -6 -b -l x AS-TEST
+$tmp/3.out -f 1 AS-TEST
+EOF
+if ! $RUN "$BGPQ4" -i "$db" -x "$tmp/jobs" > /dev/null 2> "$tmp/err"; then
+	echo "FAIL: bgpq4 -x"
+	cat "$tmp/err"
+	failed=1
+fi
+while read -r out args; do
+	$RUN "$BGPQ4" -i "$db" $args > "$tmp/single" 2> /dev/null
+	if ! diff -u "$tmp/single" "$out"; then
+		echo "FAIL: bgpq4 -x job $args"
+		failed=1
+	fi
+done < "$tmp/jobs"
+
+# a filter served by -Z must be the one of a single run
+request()
+{
+	perl -MIO::Socket::UNIX -e '
+		for (1 .. 100) {
+			last if ($s = IO::Socket::UNIX->new(Peer => $ARGV[0]));
+			select(undef, undef, undef, 0.1);
+		}
+		$s or die "$ARGV[0]: $!\n";
+		print $s "$ARGV[1]\n";
+		print while (<$s>);' "$tmp/sock" "$1"
+}
+if command -v perl > /dev/null 2>&1; then
+	$RUN "$BGPQ4" -i "$db" -Z "$tmp/sock" 2> "$tmp/err" &
+	daemon=$!
+	for args in "AS-TEST" "-6 -b -l x AS-TEST" "-f 1 AS-TEST"; do
+		request "$args" > "$tmp/out"
+		$RUN "$BGPQ4" -i "$db" $args > "$tmp/single" 2> /dev/null
+		if ! diff -u "$tmp/single" "$tmp/out"; then
+			echo "FAIL: bgpq4 -Z request $args"
+			cat "$tmp/err"
+			failed=1
+		fi
+	done
+	kill $daemon
+	wait $daemon 2> /dev/null
+fi
+
+# a run answered from the cache must not connect, nothing listens on port 1
+cached()
+{
+	h=-3750763034362895579
+	k=$1
+	while [ -n "$k" ]; do
+		c=${k%"${k#?}"}
+		k=${k#?}
+		h=$(( (h ^ $(printf '%d' "'$c")) * 1099511628211 ))
+	done
+	printf 'bgpq4-cache 1\n%s\n%d A\n%s' "$1" \
+	    $(( $(date +%s) + 3600 )) "$2" > "$tmp/cache/$(printf '%016x' $h)"
+}
+mkdir "$tmp/cache"
+cached "127.0.0.1:1 capabilities" "0 TEST "
+cached "127.0.0.1:1 TEST !gAS1" "192.0.2.0/24 192.0.2.128/25 "
+cat > "$tmp/expected" <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 192.0.2.0/24
+ip prefix-list NN permit 192.0.2.128/25
+EOF
+$RUN "$BGPQ4" -h 127.0.0.1:1 -C "$tmp/cache" AS1 > "$tmp/out" 2> "$tmp/err"
+status=$?
+if [ $status -ne 0 ] || ! diff -u "$tmp/expected" "$tmp/out"; then
+	echo "FAIL: bgpq4 -C warm run (exit $status)"
+	cat "$tmp/err"
+	failed=1
+fi
+
+exit $failed